@@ -5,8 +5,20 @@
 #include <iomanip>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 #include "swap_space.hpp"
 #include "backing_store.hpp"
+#include "wal.hpp"
+#include "shared_latch.hpp"
+#include "key_search.hpp"
+#include "metrics.hpp"
+#include "latency_histogram.hpp"
 
 #include <assert.h>
 #include <algorithm>
@@ -26,6 +38,181 @@ class InvalidKeyRange : public exception {
     }
 };
 
+class BulkLoadException : public exception {
+    virtual const char *what() const throw() {
+        return "bulkLoad needs an empty tree and strictly ascending keys.";
+    }
+};
+
+class NoMergeOperatorException : public exception {
+    virtual const char *what() const throw() {
+        return "upsert needs a merge operator.";
+    }
+};
+
+class InvalidTraceException : public exception {
+    virtual const char *what() const throw() {
+        return "not an operation trace.";
+    }
+};
+
+/*
+ * A merge operator gives meaning to the UPDATE messages produced by upsert.
+ * apply: the value after applying delta to base, base is NULL when the key has no value.
+ * combine: one delta with the same effect as applying older and then newer.
+ */
+template<typename Value>
+class MergeOperator {
+public:
+    virtual Value apply(const Value *base, const Value &delta) const = 0;
+
+    virtual Value combine(const Value &older, const Value &newer) const = 0;
+
+    virtual ~MergeOperator() {}
+};
+
+//adds the deltas to the value, a missing value counts as zero.
+template<typename Value>
+class CounterMerge : public MergeOperator<Value> {
+public:
+    Value apply(const Value *base, const Value &delta) const {
+        return base ? *base + delta : delta;
+    }
+
+    Value combine(const Value &older, const Value &newer) const {
+        return older + newer;
+    }
+};
+
+//keeps the largest value seen.
+template<typename Value>
+class MaxMerge : public MergeOperator<Value> {
+public:
+    Value apply(const Value *base, const Value &delta) const {
+        return base && delta < *base ? *base : delta;
+    }
+
+    Value combine(const Value &older, const Value &newer) const {
+        return newer < older ? older : newer;
+    }
+};
+
+//appends the delta to the value, for sequence values such as std::string.
+template<typename Value>
+class AppendMerge : public MergeOperator<Value> {
+public:
+    Value apply(const Value *base, const Value &delta) const {
+        if (!base) {
+            return delta;
+        }
+        return combine(*base, delta);
+    }
+
+    Value combine(const Value &older, const Value &newer) const {
+        Value result = older;
+        result.insert(result.end(), newer.begin(), newer.end());
+        return result;
+    }
+};
+
+/*
+ * A flush policy picks the children that receive messages when an internal node's buffer is full.
+ * choose: pending[i] is the number of buffered messages routed to child i, fills targets with the
+ * indexes of the children to flush to. a flush never goes beyond the children of the flushed node.
+ */
+class FlushPolicy {
+public:
+    virtual void choose(const vector<size_t> &pending, vector<size_t> &targets) const = 0;
+
+    virtual ~FlushPolicy() {}
+};
+
+//the k children with the most pending messages, k = 1 is the classic heaviest child flush.
+class HeaviestChildrenFlush : public FlushPolicy {
+public:
+    HeaviestChildrenFlush(size_t k = 1) : k(k) {}
+
+    void choose(const vector<size_t> &pending, vector<size_t> &targets) const {
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (pending[i] > 0) {
+                targets.push_back(i);
+            }
+        }
+        size_t n = std::min(k, targets.size());
+        std::partial_sort(targets.begin(), targets.begin() + n, targets.end(), [&pending](size_t a, size_t b) {
+            return pending[a] > pending[b];
+        });
+        targets.resize(n);
+    }
+
+private:
+    size_t k;
+};
+
+//every child with pending messages, the whole buffer moves down one level.
+class AllChildrenFlush : public FlushPolicy {
+public:
+    void choose(const vector<size_t> &pending, vector<size_t> &targets) const {
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (pending[i] > 0) {
+                targets.push_back(i);
+            }
+        }
+    }
+};
+
+/*
+ * Flush counters of one tree.
+ * a cascade is everything a single full buffer sets off: the node itself and every child it
+ * pushes messages into, recursively.
+ */
+struct FlushStats {
+    FlushStats() : flushes(0), cascades(0), messages_moved(0), nodes_touched(0),
+                   last_cascade_nodes(0), max_cascade_nodes(0) {}
+
+    uint64_t flushes;            //nodes whose full buffer was flushed
+    uint64_t cascades;
+    uint64_t messages_moved;     //messages pushed from a node to one of its children
+    uint64_t nodes_touched;      //flushed nodes plus children that received messages
+    uint64_t last_cascade_nodes;
+    uint64_t max_cascade_nodes;
+};
+
+/*
+ * Counters of one tree, see BEpsilonTree::stats().
+ * a flush counts at its level in the cascade: 0 for the node whose buffer filled up, which is the root
+ * for inserts and batches, 1 for the children that node flushed, and so on. the last level counts the
+ * ones below it too.
+ */
+struct TreeStats {
+    static constexpr int LEVELS = 16;
+
+    TreeStats() : messages_inserted(0), splits(0), merges(0), borrows(0), leaf_applies(0) {
+        std::fill(flushes, flushes + LEVELS, 0);
+        std::fill(messages_moved, messages_moved + LEVELS, 0);
+    }
+
+    uint64_t messages_inserted;        //by insert, upsert, remove and batches
+    uint64_t flushes[LEVELS];
+    uint64_t messages_moved[LEVELS];   //pushed into children by the flushes of a level
+    uint64_t splits;
+    uint64_t merges;
+    uint64_t borrows;
+    uint64_t leaf_applies;             //leaf buffers applied to the leaf's keys
+};
+
+/*
+ * Latencies of one tree in nanoseconds, see BEpsilonTree::latencies().
+ * an operation is timed once it has the latch, so a reader waiting for a writer doesn't count. a flush is
+ * a whole cascade, everything a single full buffer sets off, inside the insert, remove or batch it holds up.
+ */
+struct TreeLatencies {
+    latency_histogram insert;
+    latency_histogram remove;
+    latency_histogram point_query;
+    latency_histogram flush;
+};
+
 template<typename Key, typename Value, int B>
 class BEpsilonTree {
 public:
@@ -56,6 +243,12 @@ public:
 
 
         void _serialize(std::iostream &fs, serialization_context &context) {
+            if (context.format == BINARY_FORMAT) {
+                write_raw(fs, (uint8_t) opcode);
+                serialize(fs, context, key);
+                serialize(fs, context, value);
+                return;
+            }
             fs << "message{" << endl;
             fs << "opcode:" << std::endl;
             fs << opcode << std::endl;
@@ -69,6 +262,14 @@ public:
         }
 
         void _deserialize(std::iostream &fs, serialization_context &context) {
+            if (context.format == BINARY_FORMAT) {
+                uint8_t op;
+                read_raw(fs, op);
+                opcode = (Opcode) op;
+                deserialize(fs, context, key);
+                deserialize(fs, context, value);
+                return;
+            }
             std::string dummy;
             int op_int;
             fs >> dummy;
@@ -99,12 +300,39 @@ public:
     typedef typename vector<BEpsilonTree<Key, Value, B>::Message>::iterator MessageIterator;
     typedef typename vector<NodePointer>::iterator ChildIterator;
 
-    BEpsilonTree(swap_space *sspace) : ss(sspace), size_(0) {
+    //merge is needed only for upsert, the tree doesn't take ownership of it.
+    BEpsilonTree(swap_space *sspace, const MergeOperator<Value> *merge = NULL)
+            : ss(sspace), size_(0), merge_(merge), flush_policy_(&heaviest_child_), flush_depth_(0),
+              wal_(NULL), last_sequence_(0), concurrent_(false),
+              message_capacity_(Node::MAX_NUMBER_OF_MESSAGE_PER_NODE), trace_(NULL), stats_interval_ms_(0),
+              stats_running_(false), stats_stopping_(false), flush_start_(0) {
         root = NodePointer();
     }
 
+    ~BEpsilonTree() {
+        stopStatsDump();
+    }
+
     void insert(Key key, Value value);
 
+    //A blind read-modify-write: buffers delta as an UPDATE message that the merge operator
+    //applies to the key's value later, no read of the current value is needed.
+    void upsert(Key key, Value delta);
+
+    //Builds an empty tree bottom-up from the (key, value) pairs in [begin, end), which must come in
+    //strictly ascending key order. nodes are filled to fill_factor of their capacity (kept within the
+    //tree bounds) and every node is written to the swap_space once. throws BulkLoadException if the
+    //tree isn't empty or the keys aren't ascending.
+    template<typename Iterator>
+    void bulkLoad(Iterator begin, Iterator end, double fill_factor = 1.0);
+
+    class WriteBatch;
+
+    //Applies every operation of batch, in the order they were added, as one step: the batch is
+    //sorted and merged into the root buffer in a single pass followed by one flush.
+    //nothing is applied if the batch holds an upsert and the tree has no merge operator.
+    void write(const WriteBatch &batch);
+
     void remove(Key key);
 
     void printTree();
@@ -113,6 +341,105 @@ public:
 
     bool pointQuery(Key key, Value& value);
 
+    class Cursor;
+
+    //A cursor that is not positioned yet, call seek() first.
+    Cursor cursor();
+
+    class Snapshot;
+
+    //A read-only view of the tree as it is now, that stays the same while the tree changes.
+    Snapshot snapshot();
+
+    //calls callback(key, value) for every key in [lo, hi] in ascending key order.
+    //throws InvalidKeyRange if hi < lo.
+    void rangeQuery(Key lo, Key hi, std::function<void(const Key &, const Value &)> callback);
+
+    //calls callback(key, value) for the first count keys from lo on, in ascending key order.
+    void scan(Key lo, size_t count, std::function<void(const Key &, const Value &)> callback);
+
+    //A durability point: every insert/remove so far reaches the backing store before this returns.
+    void sync();
+
+    //sync() plus a superblock with the root and the size, so open() can pick the tree up again
+    //after a restart. a crash before the next checkpoint goes back to this one, or with a write-ahead
+    //log to the last logged operation. the log is truncated up to the checkpoint.
+    void checkpoint();
+
+    //Picks up the tree of the last checkpoint in the swap_space's backing store, only the superblock
+    //is read and the nodes are loaded as they are reached, then replays what the write-ahead log holds
+    //after the checkpoint. the tree and its swap_space must be new.
+    //returns false, leaving the tree empty, when there is neither a checkpoint nor a logged operation.
+    bool open();
+
+    //Every insert, remove, upsert and batch is appended to wal before it is applied, a batch as one
+    //record. with a SYNC_EACH_WRITE log an operation is durable once it returns without any node being
+    //written. an operation waits for its sync after it lets go of the tree, so with concurrent readers
+    //the writers on other threads share syncs. set it before open(), the tree doesn't take ownership
+    //of wal.
+    void setWriteAheadLog(write_ahead_log *wal) {
+        wal_ = wal;
+    }
+
+    //Records every insert, remove, upsert, batch, pointQuery, rangeQuery and scan from now on into trace, in
+    //the order they run, so replayTrace() can run them again on a tree of any B, cache and buffer
+    //size. the trace starts with a header, NULL stops the recording. the tree doesn't take ownership.
+    void setTrace(std::iostream *trace);
+
+    //Runs every operation of a trace that setTrace() recorded, reads included, and returns how many.
+    //throws InvalidTraceException if trace doesn't start with a trace header.
+    uint64_t replayTrace(std::iostream &trace);
+
+    //Lets pointQuery, contains, rangeQuery, size and the snapshot reads run on any number of threads at
+    //once, alongside threads that change the tree. the readers share the tree and every change has it to
+    //itself: a change waits for the reads in flight, and the reads that come in meanwhile wait for the
+    //change. the swap_space is made thread safe as well, and readers that miss read their nodes side by
+    //side. a rangeQuery callback must not change the tree, a Snapshot's may. set it while no other thread
+    //uses the tree, and open() before it.
+    void setConcurrentReaders(bool on) {
+        ss->set_thread_safe(on || stats_running_);
+        concurrent_ = on;
+    }
+
+    //the tree doesn't take ownership of policy, NULL restores the default heaviest child flush.
+    void setFlushPolicy(const FlushPolicy *policy) {
+        flush_policy_ = policy ? policy : &heaviest_child_;
+    }
+
+    //a node flushes its buffer once it holds that many messages, Node::MAX_NUMBER_OF_MESSAGE_PER_NODE
+    //by default. the larger it is the more the tree buffers (epsilon goes up), 1 sends every message
+    //down to its leaf at once, which makes the tree a plain B+ tree.
+    void setMessageBufferCapacity(size_t messages) {
+        message_capacity_ = std::max<size_t>(messages, 1);
+    }
+
+    size_t messageBufferCapacity() const {
+        return message_capacity_;
+    }
+
+    const FlushStats &flushStats() const {
+        return flush_stats_;
+    }
+
+    //a copy of the counters. from another thread only with concurrent readers on or while the stats are
+    //dumped, otherwise the tree isn't latched and a writer changes the counters under the reader. the swap_space keeps its own, see
+    //swap_space::stats().
+    TreeStats stats();
+
+    //copies of the latency histograms, from another thread on the same terms as stats(). the swap_space
+    //keeps those of its loads and write-backs, see swap_space::latencies().
+    TreeLatencies latencies();
+
+    //the counters and latencies of the tree and of its swap_space in the Prometheus text format, from
+    //another thread on the same terms as stats().
+    void writeMetrics(std::ostream &out);
+
+    //Replaces filename with writeMetrics() now and then every interval_ms from a thread of its own, which
+    //collects the metrics under the read latch and writes the file without it. while the dumps run the
+    //tree and its swap_space take their locks as they do for concurrent readers. an empty filename stops
+    //the dumps after a last one. set it while no other thread uses the tree.
+    void setStatsDump(const std::string &filename, unsigned interval_ms = 1000);
+
     int size();
 
     class Node : public serializable {
@@ -123,6 +450,10 @@ public:
         static constexpr int MESSAGE_SIZE = sizeof(Message);
         static constexpr int MAX_NUMBER_OF_MESSAGE_PER_NODE = BUFFER_SIZE / MESSAGE_SIZE;
 
+        //header of the binary node image, bump the version whenever the layout changes.
+        static constexpr uint32_t BINARY_MAGIC = 0x4e505342; // "BSPN"
+        static constexpr uint32_t BINARY_VERSION = 1;
+
         Node(bool isLeaf = true, NodePointer parent = NodePointer(), NodePointer right_sibling = NodePointer(),
              NodePointer left_sibling = NodePointer());
 
@@ -137,6 +468,10 @@ public:
         void RI();
 
         void _serialize(std::iostream &fs, serialization_context &context) {
+            if (context.format == BINARY_FORMAT) {
+                _serializeBinary(fs, context);
+                return;
+            }
             fs << "isLeaf:" << std::endl;
             fs << isLeaf << std::endl;
             fs << "parent:" << std::endl;
@@ -158,6 +493,10 @@ public:
         }
 
         void _deserialize(std::iostream &fs, serialization_context &context) {
+            if (context.format == BINARY_FORMAT) {
+                _deserializeBinary(fs, context);
+                return;
+            }
             std::string dummy;
             fs >> dummy;
             fs >> isLeaf;
@@ -179,6 +518,49 @@ public:
             deserialize(fs, context, message_buff);
         }
 
+        //heap blocks of the vectors included, the heap memory of the keys and values themselves isn't.
+        uint64_t _memory_size(void) const {
+            return sizeof(Node) + keys.capacity() * sizeof(Key) + values.capacity() * sizeof(Value)
+                   + children.capacity() * sizeof(NodePointer) + message_buff.capacity() * sizeof(Message);
+        }
+
+        /*
+         * binary node image:
+         * header: magic, version, isLeaf, parent, right_sibling, left_sibling, sub_tree_min_key.
+         * then the length-prefixed keys, values, children ids and messages arrays.
+         */
+        void _serializeBinary(std::iostream &fs, serialization_context &context) {
+            write_raw(fs, (uint32_t) BINARY_MAGIC);
+            write_raw(fs, (uint32_t) BINARY_VERSION);
+            write_raw(fs, (uint8_t) isLeaf);
+            serialize(fs, context, parent);
+            serialize(fs, context, right_sibling);
+            serialize(fs, context, left_sibling);
+            serialize(fs, context, sub_tree_min_key);
+            serialize(fs, context, keys);
+            serialize(fs, context, values);
+            serialize(fs, context, children);
+            serialize(fs, context, message_buff);
+        }
+
+        void _deserializeBinary(std::iostream &fs, serialization_context &context) {
+            uint32_t magic, version;
+            uint8_t leaf;
+            read_raw(fs, magic);
+            read_raw(fs, version);
+            assert(magic == BINARY_MAGIC && version == BINARY_VERSION);
+            read_raw(fs, leaf);
+            isLeaf = leaf;
+            deserialize(fs, context, parent);
+            deserialize(fs, context, right_sibling);
+            deserialize(fs, context, left_sibling);
+            deserialize(fs, context, sub_tree_min_key);
+            deserialize(fs, context, keys);
+            deserialize(fs, context, values);
+            deserialize(fs, context, children);
+            deserialize(fs, context, message_buff);
+        }
+
 
     private:
         bool isLeaf;
@@ -202,13 +584,198 @@ public:
         friend class BEpsilonTree;
     };
 
+    /*
+     * A forward cursor in key order.
+     * the cursor holds one leaf at a time: its keys/values merged with the pending messages of the
+     * leaf and of every ancestor message_buff on the path to the root, restricted to the leaf key range.
+     * it keeps that path, so it moves to the next leaf through the ancestors it already knows.
+     * any insert/remove on the tree invalidates the cursor.
+     */
+    class Cursor {
+    public:
+        Cursor(BEpsilonTree *tree) : tree(tree), ix(0) {}
+
+        //position on the first key >= key, returns valid().
+        bool seek(Key key);
+
+        //move to the next key, returns valid().
+        bool next();
+
+        bool valid() const {
+            return ix < keys.size();
+        }
+
+        const Key &key() const {
+            return keys[ix];
+        }
+
+        const Value &value() const {
+            return values[ix];
+        }
+
+    private:
+        //an ancestor of the leaf and the child the path goes through. the pivots around that child bound
+        //the leaf keys from this level on, a deeper level's bound is the tighter one.
+        struct Level {
+            NodePointer node;
+            size_t child_ix;
+            bool has_lo, has_hi;
+            Key lo, hi;
+        };
+
+        //goes down from p to a leaf, through the child for key or, without one, the first child.
+        void descend(NodePointer p, const Key *key);
+
+        void pushLevel(const NodePointer &p, const swap_space::pin<Node> &node, size_t child_ix);
+
+        void loadLeaf();
+
+        bool skipExhaustedLeaves();
+
+        BEpsilonTree *tree;
+        //root first.
+        vector <Level> path;
+        NodePointer leaf;
+        vector <Key> keys;
+        vector <Value> values;
+        size_t ix;
+    };
+
+    /*
+     * A consistent view of the tree as it was when snapshot() was called, for scans and exports that
+     * run while inserts and removes go on.
+     * the swap_space copies a node the tree is about to change or free while a snapshot may still read
+     * it, and the snapshot reads the copy under the node's old id, see swap_space::take_snapshot.
+     * copies of a Snapshot share it, the copies of nodes go away with the last one. the tree must
+     * outlive its snapshots.
+     */
+    class Snapshot {
+    public:
+        bool pointQuery(Key key, Value &value) const;
+
+        bool contains(Key key) const {
+            Value value;
+            return pointQuery(key, value);
+        }
+
+        //calls callback(key, value) for every key in [lo, hi] in ascending key order, a leaf at a time.
+        //throws InvalidKeyRange if hi < lo.
+        void rangeQuery(Key lo, Key hi, std::function<void(const Key &, const Value &)> callback) const;
+
+        int size() const {
+            return state_->size;
+        }
+
+    private:
+        class State {
+        public:
+            State(BEpsilonTree *tree) : tree(tree), number(tree->ss->take_snapshot()),
+                                        root(tree->root.object_id()), size(tree->size_) {}
+
+            ~State() {
+                tree->ss->release_snapshot(number);
+            }
+
+            BEpsilonTree *tree;
+            uint64_t number;
+            uint64_t root;
+            int size;
+        };
+
+        Snapshot(BEpsilonTree *tree) : state_(std::make_shared<State>(tree)) {}
+
+        //node id as the snapshot sees it, node must be new.
+        void fetch(uint64_t id, Node &node) const {
+            shared_latch::read_guard guard(state_->tree->latch());
+            state_->tree->ss->read_snapshot(state_->number, id, node);
+        }
+
+        std::shared_ptr<State> state_;
+
+        friend class BEpsilonTree;
+    };
+
+    /*
+     * A group of insert/remove/upsert operations for BEpsilonTree::write.
+     * the batch only records the operations, it doesn't touch the tree, so it can be refilled and reused.
+     */
+    class WriteBatch {
+    public:
+        void insert(Key key, Value value) {
+            messages.push_back(Message(INSERT, key, value));
+        }
+
+        void remove(Key key) {
+            messages.push_back(Message(REMOVE, key, Value()));
+        }
+
+        void upsert(Key key, Value delta) {
+            messages.push_back(Message(UPDATE, key, delta));
+        }
+
+        void clear() {
+            messages.clear();
+        }
+
+        size_t size() const {
+            return messages.size();
+        }
+
+        bool empty() const {
+            return messages.empty();
+        }
+
+    private:
+        //in the order the operations were added.
+        vector <Message> messages;
+
+        friend class BEpsilonTree;
+    };
+
 
     swap_space *ss;
     NodePointer root;
     int size_;
     Key default_key_;
+    const MergeOperator<Value> *merge_;
+    HeaviestChildrenFlush heaviest_child_;
+    const FlushPolicy *flush_policy_;
+    FlushStats flush_stats_;
+    int flush_depth_;
+    //nodes whose buffer filled up during a rebalance, flushed once the tree is consistent again.
+    vector <NodePointer> deferred_flushes_;
+    write_ahead_log *wal_;
+    //of the last logged operation that was applied.
+    uint64_t last_sequence_;
+    //taken shared by the readers and exclusively by the operations that change the tree, only when
+    //concurrent_ is set or the stats are dumped.
+    shared_latch latch_;
+    bool concurrent_;
+    size_t message_capacity_;
+    std::iostream *trace_;
+    //readers record in parallel.
+    std::mutex trace_mutex_;
+    TreeStats stats_;
+    std::string stats_file_;
+    unsigned stats_interval_ms_;
+    //the dump thread waits on stats_wakeup_ between dumps, stats_stopping_ is under stats_mutex_.
+    std::thread stats_thread_;
+    std::mutex stats_mutex_;
+    std::condition_variable stats_wakeup_;
+    bool stats_running_;
+    bool stats_stopping_;
+    latency_histogram insert_latency_;
+    latency_histogram remove_latency_;
+    latency_histogram flush_latency_;
+    //the only one recorded by readers.
+    shared_latency_histogram point_query_latency_;
+    uint64_t flush_start_;
 
 private:
+    shared_latch *latch() {
+        return concurrent_ || stats_running_ ? &latch_ : NULL;
+    }
+
     /**
 Check if node is is full, node is full when it has B children.
 
@@ -230,9 +797,25 @@ Check if node is is full, node is full when it has B children.
 
     //A function to find the index of this node in the his parent children vector
     //the assumption is this->parent != NULL.
-    int getOrder(NodePointer p);
+    int getOrder(const NodePointer &p);
+
+    //deltas holds the values of the UPDATE messages met on the way down, newest first.
+    bool pointQuery(const NodePointer &p, Key key, Value& value, vector<Value> &deltas);
 
-    bool pointQuery(NodePointer p, Key key, Value& value);
+    //one node of a point query: returns true when the node decides it, found and value are the answer
+    //then, otherwise the query goes on at child child_ix.
+    bool searchNode(const Node &node, const Key &key, Value &value, vector<Value> &deltas, bool &found,
+                    size_t &child_ix);
+
+    //the leaf's keys and values with the pending messages, sorted by key, applied.
+    void applyPending(const vector<Key> &leaf_keys, const vector<Value> &leaf_values,
+                      const vector<Message> &pending, vector<Key> &keys, vector<Value> &values);
+
+    //folds deltas (newest first) into base, returns false if the key has no value at all.
+    bool applyDeltas(const Value *base, const vector<Value> &deltas, Value &value);
+
+    //the message for a key that has both an older and a newer message.
+    Message mergeMessages(const Message &older, const Message &newer);
 
     // A function that returns the index of the key in the parent that that point to this
     // the assumption is that parent != NULL and this node have some keys.
@@ -273,7 +856,139 @@ Check if node is is full, node is full when it has B children.
 
     void updateParentKeys(NodePointer p);
 
-    static bool insertMessage(vector<Message> &buff, Message m);
+    bool insertMessage(vector<Message> &buff, Message m);
+
+    void deferFlush(NodePointer p);
+
+    void updateRoot();
+
+    typedef enum {
+        LOG_OPERATION,
+        LOG_BATCH
+    } LogRecordKind;
+
+    //a log record: the kind and the messages, in the binary format. returns its sequence number, the
+    //record isn't synced yet.
+    uint64_t logMessages(LogRecordKind kind, vector<Message> &messages);
+
+    //0 without a log.
+    uint64_t logMessage(Opcode opcode, Key key, Value value = Value()) {
+        if (wal_ == NULL) {
+            return 0;
+        }
+        vector<Message> messages(1, Message(opcode, key, value));
+        return logMessages(LOG_OPERATION, messages);
+    }
+
+    //waits, when it goes, for the logged record of an operation to be as durable as the log makes it.
+    //declared before the write guard it outlives the latch, so other writers append meanwhile and the
+    //sync covers their records too.
+    class DurabilityWait {
+    public:
+        DurabilityWait(write_ahead_log *wal) : wal(wal), sequence(0) {}
+
+        ~DurabilityWait() {
+            if (wal != NULL && sequence > 0) {
+                wal->wait_durable(sequence);
+            }
+        }
+
+        write_ahead_log *wal;
+        uint64_t sequence;
+    };
+
+    void replayRecord(uint64_t sequence, const std::string &record);
+
+    static constexpr uint64_t TRACE_MAGIC = 0x31454341525445ULL; // "ETRACE1"
+
+    //a trace record is the kind and its messages: one for a write, a point query or the start of a
+    //scan, the bounds of a range query as two, the whole of a batch.
+    typedef enum {
+        TRACE_WRITE,
+        TRACE_BATCH,
+        TRACE_POINT_QUERY,
+        TRACE_RANGE_QUERY,
+        TRACE_SCAN
+    } TraceRecordKind;
+
+    //a scan record ends with its count.
+    void traceMessages(TraceRecordKind kind, const vector<Message> &messages, uint64_t count = 0);
+
+    //writeMetrics without the latch.
+    void collectMetrics(std::ostream &out);
+
+    //one dump, on whichever thread calls it.
+    void dumpStats();
+
+    //the body of the dump thread.
+    void statsDumper();
+
+    //joins the dump thread after a last dump.
+    void stopStatsDump();
+
+    void traceMessage(TraceRecordKind kind, Opcode opcode, Key key, Value value = Value()) {
+        if (trace_ != NULL) {
+            traceMessages(kind, vector<Message>(1, Message(opcode, key, value)));
+        }
+    }
+
+    //positions in the sorted keys / message_buff of a node, specialized per Key in key_search.hpp.
+    static size_t lowerBound(const vector<Key> &keys, const Key &key) {
+        return key_search<Key>::lower_bound(keys.data(), keys.size(), key);
+    }
+
+    static size_t upperBound(const vector<Key> &keys, const Key &key) {
+        return key_search<Key>::upper_bound(keys.data(), keys.size(), key);
+    }
+
+    static size_t messageLowerBound(const vector<Message> &buff, const Key &key) {
+        return branchless_lower_bound(buff.data(), buff.size(), key, [](const Message &m) -> const Key & {
+            return m.key;
+        });
+    }
+
+    /*
+     * The state of a bulkLoad: one level per tree height, bottom up.
+     * a level keeps its nodes pinned until they got both a parent and a right sibling, so a node is
+     * complete before the swap_space may write it. a level holds back at least the minimum number
+     * of nodes, so the last node of every level can be filled legally at finish().
+     */
+    class BulkLoader {
+    public:
+        BulkLoader(BEpsilonTree *tree, double fill_factor);
+
+        void add(const Key &key, const Value &value);
+
+        //builds the remaining nodes and returns the root.
+        NodePointer finish();
+
+        int count() const {
+            return count_;
+        }
+
+    private:
+        struct Level {
+            Level() : created(0) {}
+
+            deque <NodePointer> pending;
+            deque <swap_space::pin<Node> > pins;
+            int created;
+        };
+
+        void emitLeaf(size_t n);
+
+        void emitParent(size_t level, size_t n);
+
+        void addNode(size_t level, NodePointer node);
+
+        BEpsilonTree *tree;
+        size_t leaf_keys;
+        size_t node_children;
+        vector <Key> keys;
+        vector <Value> values;
+        deque <Level> levels;
+        int count_;
+    };
 };
 
 template<typename Key, typename Value, int B>
@@ -299,25 +1014,24 @@ bool BEpsilonTree<Key, Value, B>::isNotLegal(NodePointer p) {
 template<typename Key, typename Value, int B>
 int BEpsilonTree<Key, Value, B>::getKeyOrder(NodePointer p) {
     //for sure this node isn't root and full, we check it before this function call.
-    int ix = 0;
-    while (ix < p->parent->keys.size() && p->parent->keys[ix] <= p->keys[0]) {
-        ix++;
-    }
-    return ix;
+    return upperBound(p->parent->keys, p->keys[0]);
 };
 
 template<typename Key, typename Value, int B>
-int BEpsilonTree<Key, Value, B>::getOrder(NodePointer p) {
+int BEpsilonTree<Key, Value, B>::getOrder(const NodePointer &p) {
     int ix = 0;
     //for sure this node isn't root and full, we check it before this function call.
-    typedef typename vector<NodePointer>::iterator iterator;
-    for (iterator it = p->parent->children.begin(); it != p->parent->children.end(); it++) {
+    const NodePointer parent = p->parent;
+    const swap_space::pin<Node> pinned_parent(&parent);
+    typedef typename vector<NodePointer>::const_iterator iterator;
+    for (iterator it = pinned_parent->children.begin(); it != pinned_parent->children.end(); it++) {
         if ((*it) == p) {
             return ix;
         } else {
             ix++;
         }
     }
+    return -1;
 };
 
 template<typename Key, typename Value, int B>
@@ -329,6 +1043,9 @@ void BEpsilonTree<Key, Value, B>::splitChild(NodePointer p, int ix, NodePointer
                                                                                  left_child->parent,
                                                                                  left_child->right_sibling,
                                                                                  left_child->left_sibling));
+    //both stay in memory while iterators into them are in use and other nodes are loaded.
+    swap_space::pin<Node> pinned_left(&left_child);
+    swap_space::pin<Node> pinned_right(&right_child);
 
     //update the sibling of both child and new node, add the new node between the child and the new node.
     //if the nods is internal and not a leaf, the sibling will be NULL.
@@ -339,6 +1056,7 @@ void BEpsilonTree<Key, Value, B>::splitChild(NodePointer p, int ix, NodePointer
     right_child->right_sibling = left_child->right_sibling;
     left_child->right_sibling = right_child;
     //left_child->left_sibling and left_child->right_sibling->right_sibling doesn't change.
+    stats_.splits++;
 
     //update to move the minimum number of children for each node, and not 1.
     //B should be grater than 2, else infinite loop will occur.
@@ -368,10 +1086,7 @@ void BEpsilonTree<Key, Value, B>::splitChild(NodePointer p, int ix, NodePointer
         //find the appropriate key and its index.
         Key key = left_child->keys[middle_ix];
         right_child_min_key = key;
-        int key_ix = 0;
-        while ((key_ix >= 0) && (key_ix < p->keys.size()) && (p->keys[key_ix] < key)) {
-            key_ix++;
-        }
+        int key_ix = lowerBound(p->keys, key);
 
         p->keys.insert(p->keys.begin() + key_ix, key);
 
@@ -399,7 +1114,8 @@ void BEpsilonTree<Key, Value, B>::splitChild(NodePointer p, int ix, NodePointer
     }
 
     MessageIterator first_message_it = left_child->message_buff.begin();
-    while (first_message_it != left_child->message_buff.end() && first_message_it->key <= right_child_min_key) {
+    //messages for right_child_min_key itself are routed to the right child from now on.
+    while (first_message_it != left_child->message_buff.end() && first_message_it->key < right_child_min_key) {
         first_message_it++;
     }
     right_child->message_buff.insert(right_child->message_buff.begin(),
@@ -453,6 +1169,9 @@ void BEpsilonTree<Key, Value, B>::mergeKeysUpdate(NodePointer p, int child_ix) {
 template<typename Key, typename Value, int B>
 bool BEpsilonTree<Key, Value, B>::tryBorrowFromLeft(NodePointer p) {
     if (isSiblingBorrowable(p, LEFT)) {
+        NodePointer sibling = p->left_sibling;
+        swap_space::pin<Node> pinned(&p);
+        swap_space::pin<Node> pinned_sibling(&sibling);
 
         if (p->isLeaf) {
             p->values.insert(p->values.begin(),
@@ -472,7 +1191,7 @@ bool BEpsilonTree<Key, Value, B>::tryBorrowFromLeft(NodePointer p) {
         Key key = p->isLeaf ?
                   p->left_sibling->keys[p->left_sibling->keys.size() - 1] : p->children[0]->sub_tree_min_key;
         MessageIterator l_it = p->left_sibling->message_buff.begin();
-        while (l_it->key < key) {
+        while (l_it != p->left_sibling->message_buff.end() && l_it->key < key) {
             l_it++;
         }
         p->message_buff.insert(p->message_buff.begin(), l_it, p->left_sibling->message_buff.end());
@@ -481,7 +1200,8 @@ bool BEpsilonTree<Key, Value, B>::tryBorrowFromLeft(NodePointer p) {
         p->updateMinSubTreeKey(p);
         updateParentKeys(p->left_sibling);
         updateParentKeys(p);
-        bufferFlushIfFull(p);
+        deferFlush(p);
+        stats_.borrows++;
         return true;
     }
 
@@ -491,6 +1211,9 @@ bool BEpsilonTree<Key, Value, B>::tryBorrowFromLeft(NodePointer p) {
 template<typename Key, typename Value, int B>
 bool BEpsilonTree<Key, Value, B>::tryBorrowFromRight(NodePointer p) {
     if (isSiblingBorrowable(p, RIGHT)) {
+        NodePointer sibling = p->right_sibling;
+        swap_space::pin<Node> pinned(&p);
+        swap_space::pin<Node> pinned_sibling(&sibling);
 
         if (p->isLeaf) {
             p->values.insert(p->values.end(), p->right_sibling->values[0]);
@@ -504,20 +1227,22 @@ bool BEpsilonTree<Key, Value, B>::tryBorrowFromRight(NodePointer p) {
             p->right_sibling->children.erase(p->right_sibling->children.begin());
         }
 
+        //the new first key of the sibling is the new bound, the messages below it are routed to p now.
+        p->right_sibling->keys.erase(p->right_sibling->keys.begin());
         Key key = p->isLeaf ?
                   p->right_sibling->keys[0] : p->right_sibling->children[0]->sub_tree_min_key;
         MessageIterator r_it = p->right_sibling->message_buff.begin();
-        while (r_it->key < key) {
+        while (r_it != p->right_sibling->message_buff.end() && r_it->key < key) {
             r_it++;
         }
         p->message_buff.insert(p->message_buff.end(), p->right_sibling->message_buff.begin(), r_it);
         p->right_sibling->message_buff.erase(p->right_sibling->message_buff.begin(), r_it);
 
-        p->right_sibling->keys.erase(p->right_sibling->keys.begin());
         p->updateMinSubTreeKey(p);
         p->updateMinSubTreeKey(p->right_sibling);
         updateParentKeys(p->right_sibling);
         updateParentKeys(p);
+        stats_.borrows++;
         return true;
     }
 
@@ -560,7 +1285,8 @@ bool BEpsilonTree<Key, Value, B>::tryMergeWithLeft(NodePointer p) {
                           p->message_buff.end()
     );
     p->keys.erase(p->keys.begin(), p->keys.end());
-    bufferFlushIfFull(p->left_sibling);
+    deferFlush(p->left_sibling);
+    stats_.merges++;
     return true;
 }
 
@@ -599,9 +1325,8 @@ bool BEpsilonTree<Key, Value, B>::tryMergeWithRight(NodePointer p) {
     );
     p->keys.erase(p->keys.begin(), p->keys.end());
     p->updateMinSubTreeKey(p->right_sibling);
-    if (!p->left_sibling.isNull()) {
-        bufferFlushIfFull(p->left_sibling);
-    }
+    deferFlush(p->right_sibling);
+    stats_.merges++;
     return true;
 }
 
@@ -748,30 +1473,163 @@ void BEpsilonTree<Key, Value, B>::Node::RI() {
 
 template<typename Key, typename Value, int B>
 void BEpsilonTree<Key, Value, B>::insert(Key key, Value value) {
+    DurabilityWait durable(wal_);
+    shared_latch::write_guard guard(latch());
+    latency_timer<latency_histogram> timer(insert_latency_);
+    durable.sequence = logMessage(INSERT, key, value);
+    traceMessage(TRACE_WRITE, INSERT, key, value);
+    stats_.messages_inserted++;
     if (root.isNull()) { // if the Tree is empty
         root = ss->allocate(new Node(true));
     }
     if (insert(root, key, value)) {
         size_++;
     }
-    if (!root->parent.isNull()) {
-        root = root->parent;
-    }
-
+    updateRoot();
 };
 
 
 template<typename Key, typename Value, int B>
-bool BEpsilonTree<Key, Value, B>::insertMessage(NodePointer p, Opcode opcode, Key key, Value value) {
-    Message message(opcode, key, value);
-    //ix will contains the appropriate index in the message.key in the message buffer.
-    int ix = 0;
-    for (; ix < p->message_buff.size() && p->message_buff[ix].key < key; ix++) {}
+void BEpsilonTree<Key, Value, B>::upsert(Key key, Value delta) {
+    DurabilityWait durable(wal_);
+    shared_latch::write_guard guard(latch());
+    if (merge_ == NULL) {
+        throw NoMergeOperatorException();
+    }
+    durable.sequence = logMessage(UPDATE, key, delta);
+    traceMessage(TRACE_WRITE, UPDATE, key, delta);
+    stats_.messages_inserted++;
+    if (root.isNull()) { // if the Tree is empty
+        root = ss->allocate(new Node(true));
+    }
+    insertMessage(root, UPDATE, key, delta);
+    updateRoot();
+};
 
-    if (ix < p->message_buff.size() && p->message_buff[ix].key == key) {
-        p->message_buff[ix] = message;
-    } else {
-        p->message_buff.insert(p->message_buff.begin() + ix, message);
+template<typename Key, typename Value, int B>
+template<typename Iterator>
+void BEpsilonTree<Key, Value, B>::bulkLoad(Iterator begin, Iterator end, double fill_factor) {
+    shared_latch::write_guard guard(latch());
+    if (!root.isNull()) {
+        throw BulkLoadException();
+    }
+    BulkLoader loader(this, fill_factor);
+    for (; begin != end; ++begin) {
+        loader.add(begin->first, begin->second);
+    }
+    root = loader.finish();
+    size_ = loader.count();
+};
+
+/*
+ * bulkLoad bounds: a leaf has B / 2 .. B - 1 keys, an internal node (B + 1) / 2 .. B children, which is
+ * what splitChild leaves behind. for both, twice the minimum is at most the maximum + 1, so a leftover
+ * of at least the minimum always fits into one or two legal nodes.
+ */
+template<typename Key, typename Value, int B>
+BEpsilonTree<Key, Value, B>::BulkLoader::BulkLoader(BEpsilonTree *tree, double fill_factor)
+        : tree(tree), count_(0) {
+    leaf_keys = std::max(B / 2, std::min(B - 1, (int) (fill_factor * (B - 1) + 0.5)));
+    node_children = std::max((B + 1) / 2, std::min(B, (int) (fill_factor * B + 0.5)));
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::BulkLoader::add(const Key &key, const Value &value) {
+    //a leaf is emitted only while at least B / 2 pairs stay behind, so keys is never empty here.
+    if (count_ > 0 && !(keys.back() < key)) {
+        throw BulkLoadException();
+    }
+    keys.push_back(key);
+    values.push_back(value);
+    count_++;
+    if (keys.size() >= leaf_keys + B / 2) {
+        emitLeaf(leaf_keys);
+    }
+};
+
+template<typename Key, typename Value, int B>
+typename BEpsilonTree<Key, Value, B>::NodePointer BEpsilonTree<Key, Value, B>::BulkLoader::finish() {
+    if (count_ == 0) {
+        return NodePointer();
+    }
+    if (keys.size() > B - 1) {
+        emitLeaf(keys.size() / 2);
+    }
+    emitLeaf(keys.size());
+    for (size_t level = 0;; level++) {
+        if (levels[level].created == 1) {
+            return levels[level].pending.front();
+        }
+        size_t left = levels[level].pending.size();
+        if (left > B) {
+            emitParent(level, left / 2);
+        }
+        emitParent(level, levels[level].pending.size());
+    }
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::BulkLoader::emitLeaf(size_t n) {
+    NodePointer leaf = tree->ss->allocate(new Node(true));
+    swap_space::pin<Node> leaf_pin(&leaf);
+    leaf->keys.assign(keys.begin(), keys.begin() + n);
+    leaf->values.assign(values.begin(), values.begin() + n);
+    leaf->sub_tree_min_key = keys[0];
+    keys.erase(keys.begin(), keys.begin() + n);
+    values.erase(values.begin(), values.begin() + n);
+    addNode(0, leaf);
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::BulkLoader::emitParent(size_t level, size_t n) {
+    NodePointer parent = tree->ss->allocate(new Node(false));
+    swap_space::pin<Node> parent_pin(&parent);
+    Level &children = levels[level];
+    for (size_t i = 0; i < n; i++) {
+        NodePointer child = children.pending.front();
+        child->parent = parent;
+        if (i > 0) {
+            parent->keys.push_back(child->sub_tree_min_key);
+        } else {
+            parent->sub_tree_min_key = child->sub_tree_min_key;
+        }
+        parent->children.push_back(child);
+        //the child already has its right sibling (or is the last one), so it is complete.
+        children.pending.pop_front();
+        children.pins.pop_front();
+    }
+    addNode(level + 1, parent);
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::BulkLoader::addNode(size_t level, NodePointer node) {
+    if (level == levels.size()) {
+        levels.emplace_back();
+    }
+    Level &l = levels[level];
+    if (!l.pending.empty()) {
+        l.pending.back()->right_sibling = node;
+        node->left_sibling = l.pending.back();
+    }
+    l.pending.push_back(node);
+    l.pins.emplace_back(&node);
+    l.created++;
+    //nodes of every level are children of the level above, so hold back the minimum number of children.
+    if (l.pending.size() >= node_children + (B + 1) / 2) {
+        emitParent(level, node_children);
+    }
+};
+
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::insertMessage(NodePointer p, Opcode opcode, Key key, Value value) {
+    Message message(opcode, key, value);
+    //ix will contains the appropriate index in the message.key in the message buffer.
+    size_t ix = messageLowerBound(p->message_buff, key);
+
+    if (ix < p->message_buff.size() && p->message_buff[ix].key == key) {
+        p->message_buff[ix] = mergeMessages(p->message_buff[ix], message);
+    } else {
+        p->message_buff.insert(p->message_buff.begin() + ix, message);
     }
     //ask after the insert if there a need to split the message buffer.
     bufferFlushIfFull(p);
@@ -784,104 +1642,299 @@ bool BEpsilonTree<Key, Value, B>::insertMessage(NodePointer p, Opcode opcode, Ke
 
 template<typename Key, typename Value, int B>
 bool BEpsilonTree<Key, Value, B>::insertMessage(vector<Message> &buff, Message m) {
-    int ix = 0;
-    for(; ix < buff.size() && buff[ix].key < m.key; ix++);
+    size_t ix = messageLowerBound(buff, m.key);
     if(ix < buff.size() && buff[ix].key == m.key) {
-        buff[ix] = m;
+        buff[ix] = mergeMessages(buff[ix], m);
     } else {
         buff.insert(buff.begin() + ix, m);
     }
+    return true;
+};
+
+template<typename Key, typename Value, int B>
+typename BEpsilonTree<Key, Value, B>::Message
+BEpsilonTree<Key, Value, B>::mergeMessages(const Message &older, const Message &newer) {
+    if (newer.opcode != UPDATE) {
+        return newer;
+    }
+    switch (older.opcode) {
+        case INSERT:
+            return Message(INSERT, newer.key, merge_->apply(&older.value, newer.value));
+        case REMOVE:
+            return Message(INSERT, newer.key, merge_->apply(NULL, newer.value));
+        default:
+            return Message(UPDATE, newer.key, merge_->combine(older.value, newer.value));
+    }
 };
 
 /*
- * when the buffer got empty, we need to flush the message into the key, value buffers,
- * and then handle the node separate.*/
+ * when the buffer is full it is flushed.
+ * a leaf applies all of its messages to its keys/values, and splits as often as needed.
+ * an internal node moves the messages of the children picked by the flush policy into their
+ * buffers and flushes those children, until its own buffer isn't full anymore.
+ * no iterator into a node is kept across a call that may touch other nodes, they can be evicted.*/
 template<typename Key, typename Value, int B>
 void BEpsilonTree<Key, Value, B>::bufferFlushIfFull(NodePointer p) {
     if (isMessagesBufferFull(p) == false) return;
-    vector <Message> tmp;
+    //the children of a cascade are counted when they receive messages, the node that starts it here.
+    if (flush_depth_++ == 0) {
+        flush_start_ = latency_now();
+        flush_stats_.cascades++;
+        flush_stats_.nodes_touched++;
+        flush_stats_.last_cascade_nodes = 1;
+    }
+    flush_stats_.flushes++;
+    int level = std::min(flush_depth_ - 1, TreeStats::LEVELS - 1);
+    stats_.flushes[level]++;
+
     if (p->isLeaf) { //i.e. leaf node.. so apply the messages.
-        for (MessageIterator m = p->message_buff.begin(); m != p->message_buff.end(); m++) {
-            if (m->opcode == REMOVE) {
-                int ix;
-                for (ix = 0; ix < p->keys.size() && p->keys[ix] < m->key; ix++) {}
-                if (ix < p->keys.size() && p->keys[ix] == m->key) {
-                    if (p->keys[ix] == m->key) {
-                        p->keys.erase(p->keys.begin() + ix);
-                        p->values.erase(p->values.begin() + ix);
-                    }
+        stats_.leaf_applies++;
+        {
+            swap_space::pin<Node> leaf(&p);
+            vector <Message> buff;
+            buff.swap(leaf->message_buff);
+            vector <Key> keys;
+            vector <Value> values;
+            keys.reserve(leaf->keys.size() + buff.size());
+            values.reserve(leaf->keys.size() + buff.size());
+            size_t i = 0, j = 0;
+            while (i < leaf->keys.size() || j < buff.size()) {
+                if (j == buff.size() || (i < leaf->keys.size() && leaf->keys[i] < buff[j].key)) {
+                    keys.push_back(leaf->keys[i]);
+                    values.push_back(leaf->values[i]);
+                    i++;
+                    continue;
+                }
+                const Message &m = buff[j++];
+                const Value *base = NULL;
+                if (i < leaf->keys.size() && leaf->keys[i] == m.key) {
+                    base = &leaf->values[i];
+                    i++;
+                }
+                if (m.opcode == INSERT) {
+                    keys.push_back(m.key);
+                    values.push_back(m.value);
+                } else if (m.opcode == UPDATE) {
+                    //the leaf holds the base value, so the delta is folded in here.
+                    keys.push_back(m.key);
+                    values.push_back(merge_->apply(base, m.value));
                 }
-                tmp.push_back(*m);
             }
-        }
-        for (Message m : tmp) {
-            MessageIterator m_it = std::find(p->message_buff.begin(), p->message_buff.end(), m);
-            p->message_buff.erase(m_it);
-        }
-        int num_of_applied_message = 0;
-        for (Message m : p->message_buff) {
-            if (isFull(p)) break;
-            int ix;
-            for (ix = 0; ix < p->keys.size() && p->keys[ix] < m.key; ix++) {}
-            if (m.opcode == INSERT) {
-                p->keys.insert(p->keys.begin() + ix, m.key);
-                p->values.insert(p->values.begin() + ix, m.value);
-                num_of_applied_message++;
-            } else {
-                assert("unexpected opcode!!!");
+            leaf->keys.swap(keys);
+            leaf->values.swap(values);
+            if (!leaf->keys.empty()) {
+                leaf->sub_tree_min_key = leaf->keys[0];
             }
         }
-        p->message_buff.erase(p->message_buff.begin(), p->message_buff.begin() + num_of_applied_message);
-        p->sub_tree_min_key = p->keys[0];
-        insertKeysUpdate(p);
+        //every split leaves B / 2 keys on the left, the rest goes on to the right sibling.
+        NodePointer q = p;
+        while (isFull(q)) {
+            insertKeysUpdate(q);
+            q = q->right_sibling;
+        }
         balance(p, NodePointer());
     } else {
-        MessageIterator message_it = p->message_buff.begin();
-        ChildIterator child_it = p->children.begin();
-        for (int key_ix = 0; key_ix < p->keys.size(); key_ix++) {
-            while ((message_it != p->message_buff.end()) && (message_it->key < p->keys[key_ix])) {
-                insertMessage((*child_it)->message_buff, *message_it);
-                message_it++;
+        vector <size_t> bounds;
+        vector <size_t> pending;
+        vector <size_t> targets;
+        while (isMessagesBufferFull(p)) {
+            //the messages of child i are message_buff[bounds[i], bounds[i + 1]), same routing as pointQuery.
+            {
+                swap_space::pin<Node> node(&p);
+                bounds.assign(1, 0);
+                for (size_t i = 0; i < node->keys.size(); i++) {
+                    bounds.push_back(messageLowerBound(node->message_buff, node->keys[i]));
+                }
+                bounds.push_back(node->message_buff.size());
             }
-            child_it++;
-        }
-        //here
-        if (message_it != p->message_buff.end()) {
-            NodePointer child = *child_it;
-            while(message_it != p->message_buff.end()) {
-                insertMessage(child->message_buff, *message_it);
-                message_it++;
+            pending.clear();
+            for (size_t i = 0; i + 1 < bounds.size(); i++) {
+                pending.push_back(bounds[i + 1] - bounds[i]);
+            }
+            targets.clear();
+            flush_policy_->choose(pending, targets);
+            targets.erase(std::remove_if(targets.begin(), targets.end(), [&pending](size_t t) {
+                return t >= pending.size() || pending[t] == 0;
+            }), targets.end());
+            if (targets.empty()) {
+                //a policy that picks no messages would never empty the buffer.
+                heaviest_child_.choose(pending, targets);
+            }
+            //from the right, so the bounds of the children still to go stay valid.
+            std::sort(targets.rbegin(), targets.rend());
+            targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+            vector <pair<NodePointer, vector<Message> > > moves;
+            for (size_t t : targets) {
+                swap_space::pin<Node> node(&p);
+                moves.push_back(make_pair(node->children[t],
+                                          vector<Message>(node->message_buff.begin() + bounds[t],
+                                                          node->message_buff.begin() + bounds[t + 1])));
+                node->message_buff.erase(node->message_buff.begin() + bounds[t],
+                                         node->message_buff.begin() + bounds[t + 1]);
+            }
+            for (auto &move : moves) {
+                swap_space::pin<Node> child(&move.first);
+                for (const Message &m : move.second) {
+                    insertMessage(child->message_buff, m);
+                }
+                flush_stats_.messages_moved += move.second.size();
+                stats_.messages_moved[level] += move.second.size();
+                flush_stats_.nodes_touched++;
+                flush_stats_.last_cascade_nodes++;
+            }
+            for (auto &move : moves) {
+                bufferFlushIfFull(move.first);
             }
         }
-        p->message_buff.erase(p->message_buff.begin(), p->message_buff.end());
-        NodePointer child = p->children.front();
-        NodePointer right_child;
-        while (!child.isNull()) {
-            right_child = child->right_sibling;
-            bufferFlushIfFull(child);
-            child = right_child;
-        }
+    }
+
+    if (--flush_depth_ == 0) {
+        flush_latency_.record(latency_now() - flush_start_);
+        flush_stats_.max_cascade_nodes = std::max(flush_stats_.max_cascade_nodes, flush_stats_.last_cascade_nodes);
     }
 }
 
 template<typename Key, typename Value, int B>
 bool BEpsilonTree<Key, Value, B>::isMessagesBufferFull(NodePointer p) {
-    return p->message_buff.size() >= Node::MAX_NUMBER_OF_MESSAGE_PER_NODE;
+    return p->message_buff.size() >= message_capacity_;
 };
 
 template<typename Key, typename Value, int B>
 void BEpsilonTree<Key, Value, B>::remove(Key key) {
-    if (!root.isNull()) {
-        if (remove(root, key)) {
-            size_--;
+    DurabilityWait durable(wal_);
+    shared_latch::write_guard guard(latch());
+    latency_timer<latency_histogram> timer(remove_latency_);
+    if (root.isNull()) {
+        return;
+    }
+    durable.sequence = logMessage(REMOVE, key);
+    traceMessage(TRACE_WRITE, REMOVE, key);
+    stats_.messages_inserted++;
+    if (remove(root, key)) {
+        size_--;
+    }
+    updateRoot();
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::write(const WriteBatch &batch) {
+    if (batch.empty()) {
+        return;
+    }
+    DurabilityWait durable(wal_);
+    shared_latch::write_guard guard(latch());
+    //check before anything is changed, so a batch is applied whole or not at all.
+    if (merge_ == NULL) {
+        for (const Message &m : batch.messages) {
+            if (m.opcode == UPDATE) {
+                throw NoMergeOperatorException();
+            }
         }
-        if (root->children.size() == 1) {
-            root = root->children[0];
-            root->parent = NodePointer();
+    }
+    if (wal_ != NULL) {
+        vector <Message> logged = batch.messages;
+        durable.sequence = logMessages(LOG_BATCH, logged);
+    }
+    if (trace_ != NULL) {
+        traceMessages(TRACE_BATCH, batch.messages);
+    }
+    stats_.messages_inserted += batch.messages.size();
+
+    //stable, so the messages of one key keep their order and fold from the oldest to the newest.
+    vector <Message> sorted = batch.messages;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Message &a, const Message &b) {
+        return a.key < b.key;
+    });
+    vector <Message> batch_buff;
+    batch_buff.reserve(sorted.size());
+    for (const Message &m : sorted) {
+        if (!batch_buff.empty() && batch_buff.back().key == m.key) {
+            batch_buff.back() = mergeMessages(batch_buff.back(), m);
+        } else {
+            batch_buff.push_back(m);
         }
     }
-    if (!root->parent.isNull()) {
-        root = root->parent;
+
+    if (root.isNull()) { // if the Tree is empty
+        root = ss->allocate(new Node(true));
+    }
+    {
+        //one pin for the whole merge, the batch messages are newer than the buffered ones.
+        swap_space::pin<Node> node(&root);
+        vector <Message> &buff = node->message_buff;
+        vector <Message> merged;
+        merged.reserve(buff.size() + batch_buff.size());
+        size_t i = 0, j = 0;
+        while (i < buff.size() || j < batch_buff.size()) {
+            if (j == batch_buff.size() || (i < buff.size() && buff[i].key < batch_buff[j].key)) {
+                merged.push_back(buff[i++]);
+            } else if (i == buff.size() || batch_buff[j].key < buff[i].key) {
+                merged.push_back(batch_buff[j++]);
+            } else {
+                merged.push_back(mergeMessages(buff[i++], batch_buff[j++]));
+            }
+        }
+        buff.swap(merged);
+    }
+    bufferFlushIfFull(root);
+    if (!root->keys.empty() && root->keys[0] < root->sub_tree_min_key) {
+        root->sub_tree_min_key = root->keys[0];
+    }
+
+    for (const Message &m : batch_buff) {
+        if (m.opcode == INSERT) {
+            size_++;
+        } else if (m.opcode == REMOVE) {
+            size_--;
+        }
+    }
+    updateRoot();
+};
+
+/*
+ * flushing from inside a merge or borrow would rebalance the tree again while balance() is still
+ * walking up through it, so the node waits until the change is done, see updateRoot.
+ */
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::deferFlush(NodePointer p) {
+    if (isMessagesBufferFull(p)) {
+        deferred_flushes_.push_back(p);
+    }
+};
+
+/*
+ * first the deferred flushes, they can defer more of their own.
+ * after a change the root may have been split (more than once, a flush can split every level
+ * on its way) or, after merges, left with a single child.
+ * a single child replaces the root and takes over its messages, which are newer than its own.
+ * the parent is copied out first: assigning root can free the old root while root->parent still pins it.
+ */
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::updateRoot() {
+    for (;;) {
+        while (!deferred_flushes_.empty()) {
+            NodePointer p = deferred_flushes_.back();
+            deferred_flushes_.pop_back();
+            bufferFlushIfFull(p);
+        }
+        for (NodePointer parent = root->parent; !parent.isNull(); parent = root->parent) {
+            root = parent;
+        }
+        if (root->children.size() != 1) {
+            if (deferred_flushes_.empty()) {
+                return;
+            }
+            continue;
+        }
+        NodePointer child = root->children[0];
+        vector <Message> messages = root->message_buff;
+        for (const Message &m : messages) {
+            insertMessage(child->message_buff, m);
+        }
+        child->parent = NodePointer();
+        root = child;
+        bufferFlushIfFull(root);
     }
 };
 
@@ -893,41 +1946,67 @@ void BEpsilonTree<Key, Value, B>::printTree() {
 };
 
 template<typename Key, typename Value, int B>
-bool BEpsilonTree<Key, Value, B>::pointQuery(NodePointer p, Key key, Value& value) {
-    Message m(ANY, key, Value());
-    MessageIterator message_it = std::find(p->message_buff.begin(), p->message_buff.end(), m);
-    if(message_it != p->message_buff.end()) { // the key is appear in
+bool BEpsilonTree<Key, Value, B>::pointQuery(const NodePointer &p, Key key, Value& value, vector<Value> &deltas) {
+    //p is const all the way down, so a query leaves every node it reads clean.
+    const swap_space::pin<Node> node = p.read_pin();
+    bool found;
+    size_t child_ix;
+    if (searchNode(*node.operator->(), key, value, deltas, found, child_ix)) {
+        return found;
+    }
+    NodePointer child = node->children[child_ix];
+    return pointQuery(child, key, value, deltas);
+}
+
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::searchNode(const Node &node, const Key &key, Value &value,
+                                             vector<Value> &deltas, bool &found, size_t &child_ix) {
+    typename vector<Message>::const_iterator message_it = node.message_buff.begin() + messageLowerBound(node.message_buff, key);
+    if(message_it != node.message_buff.end() && message_it->key == key) { // the key is appear in
         switch(message_it->opcode) {
-            case REMOVE : return false;
-            case INSERT : value = message_it->value; return true;
+            case REMOVE : found = applyDeltas(NULL, deltas, value); return true;
+            case INSERT : found = applyDeltas(&message_it->value, deltas, value); return true;
+            case UPDATE : deltas.push_back(message_it->value); break;
             default: assert("no such opcode");
         }
-    } else if (p->isLeaf) {
-        typename vector<Key>::iterator key_it = p->keys.begin();
-        int ix = 0;
-        for(;key_it != p->keys.end() && *key_it < key; key_it++, ix++) {}
-        if(key_it != p->keys.end() && *key_it == key) {
-            value = p->values[ix];
-            return true;
-        }
-    } else {
-        ChildIterator child_it = p->children.begin();
-        typename vector<Key>::iterator key_it = p->keys.begin();
-        while(key_it != p->keys.end() && (*key_it) <= key) {
-            child_it++;
-            key_it++;
+    }
+    if (node.isLeaf) {
+        size_t ix = lowerBound(node.keys, key);
+        if(ix < node.keys.size() && node.keys[ix] == key) {
+            found = applyDeltas(&node.values[ix], deltas, value);
+        } else {
+            found = applyDeltas(NULL, deltas, value);
         }
-        NodePointer child = child_it != p->children.end() ? (*child_it) : p->children.back();
-        return pointQuery(child, key, value);
+        return true;
     }
+    child_ix = std::min(upperBound(node.keys, key), node.children.size() - 1);
     return false;
 }
 
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::applyDeltas(const Value *base, const vector<Value> &deltas, Value &value) {
+    if (base == NULL && deltas.empty()) {
+        return false;
+    }
+    Value result = base ? *base : Value();
+    bool has_value = base != NULL;
+    for (typename vector<Value>::const_reverse_iterator it = deltas.rbegin(); it != deltas.rend(); it++) {
+        result = merge_->apply(has_value ? &result : NULL, *it);
+        has_value = true;
+    }
+    value = result;
+    return true;
+}
+
 
 template<typename Key, typename Value, int B>
 bool BEpsilonTree<Key, Value, B>::pointQuery(Key key, Value& value) {
+    shared_latch::read_guard guard(latch());
+    latency_timer<shared_latency_histogram> timer(point_query_latency_);
+    traceMessage(TRACE_POINT_QUERY, INSERT, key);
     if(!root.isNull()) {
-        return pointQuery(root, key, value);
+        vector <Value> deltas;
+        return pointQuery(root, key, value, deltas);
     }
     return false;
 };
@@ -939,11 +2018,538 @@ bool BEpsilonTree<Key, Value, B>::contains(Key key) {
     return pointQuery(key, value);
 };
 
+template<typename Key, typename Value, int B>
+typename BEpsilonTree<Key, Value, B>::Cursor BEpsilonTree<Key, Value, B>::cursor() {
+    return Cursor(this);
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::rangeQuery(Key lo, Key hi,
+                                             std::function<void(const Key &, const Value &)> callback) {
+    if (hi < lo) {
+        throw InvalidKeyRange();
+    }
+    shared_latch::read_guard guard(latch());
+    if (trace_ != NULL) {
+        vector <Message> bounds;
+        bounds.push_back(Message(INSERT, lo, Value()));
+        bounds.push_back(Message(INSERT, hi, Value()));
+        traceMessages(TRACE_RANGE_QUERY, bounds);
+    }
+    Cursor c = cursor();
+    for (c.seek(lo); c.valid() && !(hi < c.key()); c.next()) {
+        callback(c.key(), c.value());
+    }
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::scan(Key lo, size_t count,
+                                       std::function<void(const Key &, const Value &)> callback) {
+    shared_latch::read_guard guard(latch());
+    if (trace_ != NULL) {
+        traceMessages(TRACE_SCAN, vector<Message>(1, Message(INSERT, lo, Value())), count);
+    }
+    Cursor c = cursor();
+    for (c.seek(lo); c.valid() && count > 0; c.next(), count--) {
+        callback(c.key(), c.value());
+    }
+};
+
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::Cursor::seek(Key key) {
+    path.clear();
+    leaf = NodePointer();
+    keys.clear();
+    values.clear();
+    ix = 0;
+    if (tree->root.isNull()) {
+        return false;
+    }
+    descend(tree->root, &key);
+    ix = lowerBound(keys, key);
+    return skipExhaustedLeaves();
+};
+
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::Cursor::next() {
+    if (!valid()) {
+        return false;
+    }
+    ix++;
+    return skipExhaustedLeaves();
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::Cursor::descend(NodePointer p, const Key *key) {
+    while (!p.read_pin()->isLeaf) {
+        //same routing as pointQuery: the child after the last key <= key.
+        const swap_space::pin<Node> node = p.read_pin();
+        size_t child_ix = key == NULL ? 0 : std::min(upperBound(node->keys, *key), node->children.size() - 1);
+        pushLevel(p, node, child_ix);
+        p = node->children[child_ix];
+    }
+    leaf = p;
+    loadLeaf();
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::Cursor::pushLevel(const NodePointer &p, const swap_space::pin<Node> &node,
+                                                    size_t child_ix) {
+    Level level;
+    level.node = p;
+    level.child_ix = child_ix;
+    level.has_lo = child_ix > 0;
+    level.has_hi = child_ix < node->keys.size();
+    level.lo = level.has_lo ? node->keys[child_ix - 1] : Key();
+    level.hi = level.has_hi ? node->keys[child_ix] : Key();
+    path.push_back(level);
+};
+
+//an exhausted leaf gives way to the next one: up the path to the first ancestor with a child to the right,
+//and down its leftmost branch.
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::Cursor::skipExhaustedLeaves() {
+    while (ix >= keys.size()) {
+        NodePointer next;
+        while (next.isNull() && !path.empty()) {
+            Level level = path.back();
+            path.pop_back();
+            const swap_space::pin<Node> node = level.node.read_pin();
+            if (level.child_ix + 1 < node->children.size()) {
+                pushLevel(level.node, node, level.child_ix + 1);
+                next = node->children[level.child_ix + 1];
+            }
+        }
+        if (next.isNull()) {
+            path.clear();
+            leaf = NodePointer();
+            keys.clear();
+            values.clear();
+            ix = 0;
+            return false;
+        }
+        descend(next, NULL);
+        ix = 0;
+    }
+    return true;
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::Cursor::loadLeaf() {
+    //collect the pending messages from the oldest (the leaf) to the newest (the root),
+    //insertMessage lets a newer message replace an older one for the same key.
+    vector <Message> pending = leaf.read_pin()->message_buff;
+    bool has_lo = false, has_hi = false;
+    Key lo = Key(), hi = Key();
+    for (size_t level = path.size(); level-- > 0; ) {
+        const Level &l = path[level];
+        if (!has_lo && l.has_lo) {
+            lo = l.lo;
+            has_lo = true;
+        }
+        if (!has_hi && l.has_hi) {
+            hi = l.hi;
+            has_hi = true;
+        }
+        //the buffer is sorted, only the messages of the leaf range are looked at.
+        const swap_space::pin<Node> node = l.node.read_pin();
+        const vector <Message> &buff = node->message_buff;
+        size_t first = has_lo ? messageLowerBound(buff, lo) : 0;
+        for (size_t i = first; i < buff.size() && (!has_hi || buff[i].key < hi); i++) {
+            tree->insertMessage(pending, buff[i]);
+        }
+    }
+
+    const swap_space::pin<Node> node = leaf.read_pin();
+    tree->applyPending(node->keys, node->values, pending, keys, values);
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::applyPending(const vector<Key> &leaf_keys, const vector<Value> &leaf_values,
+                                               const vector<Message> &pending, vector<Key> &keys,
+                                               vector<Value> &values) {
+    keys.clear();
+    values.clear();
+    size_t i = 0, j = 0;
+    while (i < leaf_keys.size() || j < pending.size()) {
+        if (j == pending.size() || (i < leaf_keys.size() && leaf_keys[i] < pending[j].key)) {
+            keys.push_back(leaf_keys[i]);
+            values.push_back(leaf_values[i]);
+            i++;
+            continue;
+        }
+        const Message &m = pending[j++];
+        const Value *base = NULL;
+        if (i < leaf_keys.size() && leaf_keys[i] == m.key) {
+            base = &leaf_values[i];
+            i++;
+        }
+        if (m.opcode == INSERT) {
+            keys.push_back(m.key);
+            values.push_back(m.value);
+        } else if (m.opcode == UPDATE) {
+            keys.push_back(m.key);
+            values.push_back(merge_->apply(base, m.value));
+        }
+    }
+};
+
+template<typename Key, typename Value, int B>
+typename BEpsilonTree<Key, Value, B>::Snapshot BEpsilonTree<Key, Value, B>::snapshot() {
+    shared_latch::read_guard guard(latch());
+    return Snapshot(this);
+};
+
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::Snapshot::pointQuery(Key key, Value &value) const {
+    vector <Value> deltas;
+    uint64_t id = state_->root;
+    while (id != 0) {
+        Node node;
+        fetch(id, node);
+        bool found;
+        size_t child_ix;
+        if (state_->tree->searchNode(node, key, value, deltas, found, child_ix)) {
+            return found;
+        }
+        id = node.children[child_ix].object_id();
+    }
+    return false;
+};
+
+/*
+ * every leaf is reached from the root: the snapshot copies each node it reads, so it holds nothing of
+ * the tree between leaves, and the callback may change the tree. the messages of the nodes on the path
+ * that fall into the leaf key range apply to the leaf, the newest (nearest the root) last.
+ */
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::Snapshot::rangeQuery(Key lo, Key hi,
+                                                       std::function<void(const Key &, const Value &)> callback) const {
+    if (hi < lo) {
+        throw InvalidKeyRange();
+    }
+    BEpsilonTree *tree = state_->tree;
+    Key start = lo;
+    while (state_->root != 0) {
+        vector <Node> path(1);
+        fetch(state_->root, path.back());
+        bool has_lo = false, has_hi = false;
+        Key leaf_lo = Key(), leaf_hi = Key();
+        while (!path.back().isLeaf) {
+            const Node &node = path.back();
+            size_t child_ix = std::min(upperBound(node.keys, start), node.children.size() - 1);
+            if (child_ix > 0) {
+                leaf_lo = node.keys[child_ix - 1];
+                has_lo = true;
+            }
+            if (child_ix < node.keys.size()) {
+                leaf_hi = node.keys[child_ix];
+                has_hi = true;
+            }
+            uint64_t child = node.children[child_ix].object_id();
+            path.push_back(Node());
+            fetch(child, path.back());
+        }
+
+        vector <Message> pending;
+        for (typename vector<Node>::reverse_iterator it = path.rbegin(); it != path.rend(); ++it) {
+            for (const Message &m : it->message_buff) {
+                if ((!has_lo || !(m.key < leaf_lo)) && (!has_hi || m.key < leaf_hi)) {
+                    tree->insertMessage(pending, m);
+                }
+            }
+        }
+        vector <Key> keys;
+        vector <Value> values;
+        tree->applyPending(path.back().keys, path.back().values, pending, keys, values);
+        path.clear();
+
+        for (size_t i = lowerBound(keys, start); i < keys.size() && !(hi < keys[i]); i++) {
+            callback(keys[i], values[i]);
+        }
+        if (!has_hi || hi < leaf_hi) {
+            return;
+        }
+        start = leaf_hi;
+    }
+};
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::sync() {
+    shared_latch::write_guard guard(latch());
+    ss->sync();
+};
+
+//the state is the root pointer, the size and the last applied log record, the root's reference is
+//kept in the superblock.
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::checkpoint() {
+    shared_latch::write_guard guard(latch());
+    std::stringstream state;
+    serialization_context ctxt(*ss, BINARY_FORMAT);
+    ctxt.detach = false;
+    serialize(state, ctxt, root);
+    serialize(state, ctxt, size_);
+    serialize(state, ctxt, last_sequence_);
+    ss->checkpoint(state.str());
+    if (wal_ != NULL) {
+        wal_->truncate(last_sequence_);
+    }
+}
+
+template<typename Key, typename Value, int B>
+bool BEpsilonTree<Key, Value, B>::open() {
+    assert(root.isNull() && size_ == 0);
+    std::string image;
+    bool found = ss->open(image);
+    if (found) {
+        std::stringstream state(image);
+        serialization_context ctxt(*ss, BINARY_FORMAT);
+        deserialize(state, ctxt, root);
+        deserialize(state, ctxt, size_);
+        deserialize(state, ctxt, last_sequence_);
+    }
+    if (wal_ != NULL) {
+        uint64_t checkpointed = last_sequence_;
+        wal_->replay(checkpointed, [this](uint64_t sequence, const std::string &record) {
+            replayRecord(sequence, record);
+        });
+        found = found || last_sequence_ > checkpointed;
+        //a fresh log must not hand out sequence numbers the checkpoint already covers.
+        wal_->truncate(checkpointed);
+    }
+    return found;
+}
+
+template<typename Key, typename Value, int B>
+uint64_t BEpsilonTree<Key, Value, B>::logMessages(LogRecordKind kind, vector<Message> &messages) {
+    std::stringstream record;
+    serialization_context ctxt(*ss, BINARY_FORMAT);
+    write_raw(record, (uint8_t) kind);
+    serialize(record, ctxt, messages);
+    last_sequence_ = wal_->append(record.str(), false);
+    return last_sequence_;
+}
+
+//applies the record through the public operations with the log turned off, so the tree ends up as
+//if it had never stopped.
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::replayRecord(uint64_t sequence, const std::string &image) {
+    std::stringstream record(image);
+    serialization_context ctxt(*ss, BINARY_FORMAT);
+    uint8_t kind;
+    vector <Message> messages;
+    read_raw(record, kind);
+    deserialize(record, ctxt, messages);
+    write_ahead_log *wal = wal_;
+    wal_ = NULL;
+    if (kind == LOG_BATCH) {
+        WriteBatch batch;
+        batch.messages.swap(messages);
+        write(batch);
+    } else {
+        assert(messages.size() == 1);
+        const Message &m = messages[0];
+        if (m.opcode == INSERT) {
+            insert(m.key, m.value);
+        } else if (m.opcode == REMOVE) {
+            remove(m.key);
+        } else {
+            upsert(m.key, m.value);
+        }
+    }
+    wal_ = wal;
+    last_sequence_ = sequence;
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::setTrace(std::iostream *trace) {
+    std::unique_lock<std::mutex> lock(trace_mutex_);
+    trace_ = trace;
+    if (trace_ != NULL) {
+        write_raw(*trace_, (uint64_t) TRACE_MAGIC);
+    }
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::traceMessages(TraceRecordKind kind, const vector<Message> &messages,
+                                                uint64_t count) {
+    std::stringstream record;
+    serialization_context ctxt(*ss, BINARY_FORMAT);
+    write_raw(record, (uint8_t) kind);
+    vector <Message> copy = messages;
+    serialize(record, ctxt, copy);
+    if (kind == TRACE_SCAN) {
+        write_raw(record, count);
+    }
+    std::string image = record.str();
+    std::unique_lock<std::mutex> lock(trace_mutex_);
+    if (trace_ != NULL) {
+        trace_->write(image.data(), image.length());
+    }
+}
+
+//a trace may hold upserts only if this tree has a merge operator, they throw otherwise.
+template<typename Key, typename Value, int B>
+uint64_t BEpsilonTree<Key, Value, B>::replayTrace(std::iostream &trace) {
+    uint64_t magic = 0;
+    read_raw(trace, magic);
+    if (!trace.good() || magic != TRACE_MAGIC) {
+        throw InvalidTraceException();
+    }
+    serialization_context ctxt(*ss, BINARY_FORMAT);
+    uint64_t operations = 0;
+    while (trace.peek() != std::char_traits<char>::eof()) {
+        uint8_t kind;
+        vector <Message> messages;
+        read_raw(trace, kind);
+        deserialize(trace, ctxt, messages);
+        assert(trace.good() && !messages.empty());
+        Value value;
+        if (kind == TRACE_BATCH) {
+            WriteBatch batch;
+            batch.messages.swap(messages);
+            write(batch);
+        } else if (kind == TRACE_POINT_QUERY) {
+            pointQuery(messages[0].key, value);
+        } else if (kind == TRACE_RANGE_QUERY) {
+            rangeQuery(messages[0].key, messages[1].key, [](const Key &, const Value &) {});
+        } else if (kind == TRACE_SCAN) {
+            uint64_t count;
+            read_raw(trace, count);
+            scan(messages[0].key, count, [](const Key &, const Value &) {});
+        } else if (messages[0].opcode == INSERT) {
+            insert(messages[0].key, messages[0].value);
+        } else if (messages[0].opcode == REMOVE) {
+            remove(messages[0].key);
+        } else {
+            upsert(messages[0].key, messages[0].value);
+        }
+        operations++;
+    }
+    return operations;
+}
+
 template<typename Key, typename Value, int B>
 int BEpsilonTree<Key, Value, B>::size() {
+    shared_latch::read_guard guard(latch());
     return size_;
 };
 
+template<typename Key, typename Value, int B>
+TreeStats BEpsilonTree<Key, Value, B>::stats() {
+    shared_latch::read_guard guard(latch());
+    return stats_;
+}
+
+template<typename Key, typename Value, int B>
+TreeLatencies BEpsilonTree<Key, Value, B>::latencies() {
+    shared_latch::read_guard guard(latch());
+    TreeLatencies latencies;
+    latencies.insert = insert_latency_;
+    latencies.remove = remove_latency_;
+    latencies.point_query = point_query_latency_.merged();
+    latencies.flush = flush_latency_;
+    return latencies;
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::writeMetrics(std::ostream &out) {
+    shared_latch::read_guard guard(latch());
+    collectMetrics(out);
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::collectMetrics(std::ostream &out) {
+    write_metric(out, "bepsilon_tree_keys", "gauge", "Keys in the tree.", (uint64_t) size_);
+    write_metric(out, "bepsilon_tree_messages_inserted_total", "counter",
+                 "Messages put into the tree by insert, upsert, remove and batches.", stats_.messages_inserted);
+    //only the levels that were ever reached.
+    int levels = TreeStats::LEVELS;
+    while (levels > 1 && stats_.flushes[levels - 1] == 0) {
+        levels--;
+    }
+    write_metric_family(out, "bepsilon_tree_flushes_total", "counter",
+                        "Buffers flushed, by level in the cascade, 0 is the node that filled up.");
+    for (int i = 0; i < levels; i++) {
+        write_metric_sample(out, "bepsilon_tree_flushes_total", stats_.flushes[i], "level=\"" + to_string(i) + "\"");
+    }
+    write_metric_family(out, "bepsilon_tree_flush_messages_moved_total", "counter",
+                        "Messages pushed into children, by level in the cascade of the flushing node.");
+    for (int i = 0; i < levels; i++) {
+        write_metric_sample(out, "bepsilon_tree_flush_messages_moved_total", stats_.messages_moved[i],
+                            "level=\"" + to_string(i) + "\"");
+    }
+    write_metric(out, "bepsilon_tree_flush_cascades_total", "counter",
+                 "Flushes set off by a single full buffer.", flush_stats_.cascades);
+    write_metric(out, "bepsilon_tree_flush_max_cascade_nodes", "gauge",
+                 "Nodes touched by the largest cascade.", flush_stats_.max_cascade_nodes);
+    write_metric(out, "bepsilon_tree_leaf_applies_total", "counter",
+                 "Leaf buffers applied to the leaf's keys.", stats_.leaf_applies);
+    write_metric(out, "bepsilon_tree_splits_total", "counter", "Nodes split.", stats_.splits);
+    write_metric(out, "bepsilon_tree_merges_total", "counter", "Nodes merged into a sibling.", stats_.merges);
+    write_metric(out, "bepsilon_tree_borrows_total", "counter", "Keys borrowed from a sibling.", stats_.borrows);
+    write_latency_summary(out, "bepsilon_tree_insert_seconds", "Time of an insert.", insert_latency_);
+    write_latency_summary(out, "bepsilon_tree_remove_seconds", "Time of a remove.", remove_latency_);
+    write_latency_summary(out, "bepsilon_tree_point_query_seconds", "Time of a point query.",
+                          point_query_latency_.merged());
+    write_latency_summary(out, "bepsilon_tree_flush_seconds", "Time of a flush cascade.", flush_latency_);
+    ss->write_metrics(out);
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::setStatsDump(const std::string &filename, unsigned interval_ms) {
+    stopStatsDump();
+    if (filename.empty()) {
+        return;
+    }
+    assert(interval_ms > 0);
+    stats_file_ = filename;
+    stats_interval_ms_ = interval_ms;
+    stats_stopping_ = false;
+    stats_running_ = true;
+    ss->set_thread_safe(true);
+    dumpStats();
+    stats_thread_ = std::thread(&BEpsilonTree::statsDumper, this);
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::stopStatsDump() {
+    if (!stats_running_) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(stats_mutex_);
+        stats_stopping_ = true;
+    }
+    stats_wakeup_.notify_one();
+    stats_thread_.join();
+    dumpStats();
+    stats_running_ = false;
+    ss->set_thread_safe(concurrent_);
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::statsDumper() {
+    std::unique_lock<std::mutex> lock(stats_mutex_);
+    while (!stats_wakeup_.wait_for(lock, std::chrono::milliseconds(stats_interval_ms_),
+                                   [this]() { return stats_stopping_; })) {
+        lock.unlock();
+        dumpStats();
+        lock.lock();
+    }
+}
+
+template<typename Key, typename Value, int B>
+void BEpsilonTree<Key, Value, B>::dumpStats() {
+    std::stringstream text;
+    {
+        shared_latch::read_guard guard(&latch_);
+        collectMetrics(text);
+    }
+    write_metrics_file(stats_file_, text.str());
+}
+
 //private o
 
 #endif //BEPSILON_BEPSILON_H
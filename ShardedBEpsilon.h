@@ -0,0 +1,153 @@
+#ifndef BEPSILON_SHARDEDBEPSILON_H
+#define BEPSILON_SHARDEDBEPSILON_H
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include "BEpsilon.h"
+#include "swap_space.hpp"
+#include "backing_store.hpp"
+#include "key_search.hpp"
+
+class InvalidShardSplits : public exception {
+    virtual const char *what() const throw() {
+        return "a sharded tree needs one store per shard and strictly ascending split keys.";
+    }
+};
+
+/*
+ * A front end that partitions the key space into ranges, each one an independent BEpsilonTree with a
+ * swap_space of its own over a backing_store of its own. every insert of a single tree goes through
+ * its root buffer, here writes to different shards share nothing: no node, no swap_space lock and no
+ * store, so they run in parallel on the threads that call them.
+ * shard i holds the keys in [splits[i - 1], splits[i]). the shards are in concurrent reader mode, a
+ * shard takes one writer at a time and any number of readers next to it.
+ * pick the splits so the writes spread evenly, a skewed workload scales only as far as its hottest shard.
+ */
+template<typename Key, typename Value, int B>
+class ShardedBEpsilonTree {
+public:
+    typedef BEpsilonTree<Key, Value, B> Tree;
+
+    //one shard per store, splits holds the stores.size() - 1 keys between them in strictly ascending
+    //order, throws InvalidShardSplits otherwise. every shard caches up to cache_objects nodes.
+    //the tree doesn't take ownership of the stores or of merge.
+    ShardedBEpsilonTree(const vector<backing_store *> &stores, const vector<Key> &splits, uint64_t cache_objects,
+                        const MergeOperator<Value> *merge = NULL)
+            : splits_(splits) {
+        if (stores.empty() || splits.size() != stores.size() - 1) {
+            throw InvalidShardSplits();
+        }
+        for (size_t i = 1; i < splits.size(); i++) {
+            if (!(splits[i - 1] < splits[i])) {
+                throw InvalidShardSplits();
+            }
+        }
+        for (backing_store *store : stores) {
+            shards_.push_back(std::unique_ptr<Shard>(new Shard(store, cache_objects, merge)));
+        }
+    }
+
+    void insert(Key key, Value value) {
+        shardFor(key).insert(key, value);
+    }
+
+    void upsert(Key key, Value delta) {
+        shardFor(key).upsert(key, delta);
+    }
+
+    void remove(Key key) {
+        shardFor(key).remove(key);
+    }
+
+    bool pointQuery(Key key, Value &value) {
+        return shardFor(key).pointQuery(key, value);
+    }
+
+    bool contains(Key key) {
+        return shardFor(key).contains(key);
+    }
+
+    //calls callback(key, value) for every key in [lo, hi] in ascending key order. the shards hold
+    //disjoint ascending ranges, so their scans follow each other. the callback must not change the tree.
+    //throws InvalidKeyRange if hi < lo.
+    void rangeQuery(Key lo, Key hi, std::function<void(const Key &, const Value &)> callback) {
+        if (hi < lo) {
+            throw InvalidKeyRange();
+        }
+        for (size_t i = shardIndex(lo); i <= shardIndex(hi); i++) {
+            shards_[i]->tree.rangeQuery(lo, hi, callback);
+        }
+    }
+
+    int size() {
+        int size = 0;
+        for (auto &shard : shards_) {
+            size += shard->tree.size();
+        }
+        return size;
+    }
+
+    void sync() {
+        for (auto &shard : shards_) {
+            shard->tree.sync();
+        }
+    }
+
+    //a checkpoint per shard, so a crash in between leaves the shards at different points in time.
+    void checkpoint() {
+        for (auto &shard : shards_) {
+            shard->tree.checkpoint();
+        }
+    }
+
+    //opens every shard from its store, the stores and splits must be those of the checkpointed tree.
+    //returns false when no shard had a checkpoint.
+    bool open() {
+        bool found = false;
+        for (auto &shard : shards_) {
+            shard->tree.setConcurrentReaders(false);
+            found = shard->tree.open() || found;
+            shard->tree.setConcurrentReaders(true);
+        }
+        return found;
+    }
+
+    size_t shards() const {
+        return shards_.size();
+    }
+
+    //the shard that holds key.
+    size_t shardIndex(const Key &key) const {
+        return key_search<Key>::upper_bound(splits_.data(), splits_.size(), key);
+    }
+
+    Tree &shard(size_t i) {
+        return shards_[i]->tree;
+    }
+
+    swap_space &shardSwapSpace(size_t i) {
+        return shards_[i]->ss;
+    }
+
+private:
+    class Shard {
+    public:
+        Shard(backing_store *store, uint64_t cache_objects, const MergeOperator<Value> *merge)
+                : ss(store, cache_objects), tree(&ss, merge) {
+            tree.setConcurrentReaders(true);
+        }
+
+        swap_space ss;
+        Tree tree;
+    };
+
+    Tree &shardFor(const Key &key) {
+        return shards_[shardIndex(key)]->tree;
+    }
+
+    vector <Key> splits_;
+    vector <std::unique_ptr<Shard> > shards_;
+};
+
+#endif //BEPSILON_SHARDEDBEPSILON_H
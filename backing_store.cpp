@@ -1,8 +1,151 @@
 #include "backing_store.hpp"
 #include <iostream>
+#include <sstream>
+#include <iterator>
 #include <ext/stdio_filebuf.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <cassert>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+////////////////////////////////////
+// Durability shared by all stores //
+////////////////////////////////////
+static uint64_t now_usecs(void)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+backing_store::backing_store(void)
+  : durability(SYNC_EACH_WRITE),
+    window_bytes(1024 * 1024),
+    window_usecs(10000),
+    unsynced_writes(0),
+    unsynced_bytes(0),
+    unsynced_since(0),
+    codec(NO_COMPRESSION),
+    image_bytes(0),
+    page_bytes(0)
+{}
+
+void backing_store::set_durability(durability_mode mode, uint64_t wbytes, uint64_t wusecs)
+{
+  // Whatever was written under the old mode gets the old mode's
+  // guarantee at the latest now.
+  if (unsynced_writes > 0)
+    sync();
+  durability = mode;
+  window_bytes = wbytes;
+  window_usecs = wusecs;
+}
+
+void backing_store::sync(void)
+{
+  sync_data();
+  unsynced_writes = 0;
+  unsynced_bytes = 0;
+}
+
+void backing_store::wrote(size_t bytes)
+{
+  if (unsynced_writes++ == 0)
+    unsynced_since = now_usecs();
+  unsynced_bytes += bytes;
+
+  switch (durability) {
+  case SYNC_EACH_WRITE:
+    sync();
+    break;
+  case GROUP_COMMIT:
+    if (unsynced_bytes >= window_bytes || now_usecs() - unsynced_since >= window_usecs)
+      sync();
+    break;
+  case NO_SYNC:
+    break;
+  }
+}
+
+///////////////////////
+// Node page encoding //
+///////////////////////
+// Page header: one byte of codec, then the image length.
+static const size_t PAGE_HEADER_BYTES = 1 + sizeof(uint64_t);
+
+void backing_store::set_compression(compression_codec c)
+{
+  codec = c;
+}
+
+void backing_store::encode_page(const std::string &image, std::string &page)
+{
+  uint64_t raw_length = image.length();
+  page.clear();
+  page.reserve(PAGE_HEADER_BYTES + image.length());
+  page.push_back((char)NO_COMPRESSION);
+  page.append((const char *)&raw_length, sizeof(raw_length));
+  if (codec == LZ_COMPRESSION) {
+    lz_compress(image.data(), image.length(), page);
+    if (page.length() < PAGE_HEADER_BYTES + image.length()) {
+      page[0] = (char)LZ_COMPRESSION;
+    } else {
+      page.resize(PAGE_HEADER_BYTES);
+      page.append(image);
+    }
+  } else {
+    page.append(image);
+  }
+  image_bytes += image.length();
+  page_bytes += page.length();
+}
+
+const char * backing_store::decode_page(const char *page, size_t length,
+					std::string &buf, size_t &image_length) const
+{
+  if (length < PAGE_HEADER_BYTES)
+    return NULL;
+  uint64_t raw_length;
+  memcpy(&raw_length, page + 1, sizeof(raw_length));
+  const char *body = page + PAGE_HEADER_BYTES;
+  size_t body_length = length - PAGE_HEADER_BYTES;
+
+  switch ((compression_codec)page[0]) {
+  case NO_COMPRESSION:
+    if (body_length != raw_length)
+      return NULL;
+    image_length = raw_length;
+    return body;
+  case LZ_COMPRESSION:
+    buf.resize(raw_length);
+    if (!lz_decompress(body, body_length, &buf[0], raw_length))
+      return NULL;
+    image_length = raw_length;
+    return buf.data();
+  }
+  return NULL;
+}
+
+//////////////////////////////////////////////////
+// Default whole-object I/O on top of get()/put() //
+//////////////////////////////////////////////////
+void backing_store::read(uint64_t id, std::string &buf)
+{
+  std::iostream *ios = get(id);
+  buf.assign(std::istreambuf_iterator<char>(*ios), std::istreambuf_iterator<char>());
+  put(ios);
+}
+
+void backing_store::write(uint64_t id, const std::string &buf)
+{
+  std::iostream *ios = get(id);
+  ios->write(buf.data(), buf.length());
+  put(ios);
+}
 
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
@@ -12,28 +155,44 @@ one_file_per_object_backing_store::one_file_per_object_backing_store(std::string
     nextid(1)
 {}
 
+one_file_per_object_backing_store::~one_file_per_object_backing_store(void)
+{
+  for (auto it = unsynced.begin(); it != unsynced.end(); ++it)
+    close(it->second);
+}
+
+std::string one_file_per_object_backing_store::filename(uint64_t id) {
+  return root + "/" + std::to_string(id);
+}
+
 uint64_t one_file_per_object_backing_store::allocate(size_t n) {
   uint64_t id = nextid++;
-  std::string filename = root + "/" + std::to_string(id);
-  std::fstream dummy(filename, std::fstream::out);
+  std::fstream dummy(filename(id), std::fstream::out);
   dummy.flush();
   assert(dummy.good());
   return id;
 }
 
 void one_file_per_object_backing_store::deallocate(uint64_t id) {
-  std::string filename = root + "/" + std::to_string(id);
-  assert(unlink(filename.c_str()) == 0);
+  auto it = unsynced.find(id);
+  if (it != unsynced.end()) {
+    close(it->second);
+    unsynced.erase(it);
+  }
+  int r = unlink(filename(id).c_str());
+  assert(r == 0);
 }
 
+// Streams from get() are assumed to have been written to when they
+// are put().  Use read() to read without paying for a sync.
 std::iostream * one_file_per_object_backing_store::get(uint64_t id) {
   __gnu_cxx::stdio_filebuf<char> *fb = new __gnu_cxx::stdio_filebuf<char>;
-  std::string filename = root + "/" + std::to_string(id);
-  fb->open(filename, std::fstream::in | std::fstream::out);
+  fb->open(filename(id), std::fstream::in | std::fstream::out);
   std::fstream *ios = new std::fstream;
   ios->std::ios::rdbuf(fb);
   ios->exceptions(std::fstream::badbit | std::fstream::failbit | std::fstream::eofbit);
   assert(ios->good());
+  open_streams[ios] = id;
   
   return ios;
 }
@@ -42,7 +201,419 @@ void one_file_per_object_backing_store::put(std::iostream *ios)
 {
   ios->flush();
   __gnu_cxx::stdio_filebuf<char> *fb = (__gnu_cxx::stdio_filebuf<char> *)ios->rdbuf();
-  fsync(fb->fd());
+  auto it = open_streams.find(ios);
+  assert(it != open_streams.end());
+  uint64_t id = it->second;
+  open_streams.erase(it);
+  if (unsynced.count(id) == 0)
+    unsynced[id] = dup(fb->fd());
   delete ios;
   delete fb;
+  wrote(0);
+  if (unsynced.size() >= MAX_UNSYNCED_FILES)
+    sync();
+}
+
+void one_file_per_object_backing_store::read(uint64_t id, std::string &buf)
+{
+  int fd = open(filename(id).c_str(), O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  int r = fstat(fd, &st);
+  assert(r == 0);
+  buf.resize(st.st_size);
+  size_t done = 0;
+  while (done < buf.length()) {
+    ssize_t n = ::read(fd, &buf[done], buf.length() - done);
+    assert(n > 0);
+    done += n;
+  }
+  close(fd);
+}
+
+void one_file_per_object_backing_store::write(uint64_t id, const std::string &buf)
+{
+  int fd = open(filename(id).c_str(), O_WRONLY | O_TRUNC);
+  assert(fd >= 0);
+  size_t done = 0;
+  while (done < buf.length()) {
+    ssize_t n = ::write(fd, buf.data() + done, buf.length() - done);
+    assert(n > 0);
+    done += n;
+  }
+  auto it = unsynced.find(id);
+  if (it != unsynced.end()) {
+    close(fd);
+  } else {
+    unsynced[id] = fd;
+  }
+  wrote(buf.length());
+  if (unsynced.size() >= MAX_UNSYNCED_FILES)
+    sync();
+}
+
+void one_file_per_object_backing_store::sync_data(void)
+{
+  for (auto it = unsynced.begin(); it != unsynced.end(); ++it) {
+    fsync(it->second);
+    close(it->second);
+  }
+  unsynced.clear();
+  // New files are only durable once their directory entry is.
+  int dirfd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dirfd >= 0) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+}
+
+// The superblock is a file of its own, replaced by a rename so a
+// crash leaves either the old or the new one.
+void one_file_per_object_backing_store::write_superblock(const std::string &buf)
+{
+  std::string tmp = root + "/superblock.tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  size_t done = 0;
+  while (done < buf.length()) {
+    ssize_t n = ::write(fd, buf.data() + done, buf.length() - done);
+    assert(n > 0);
+    done += n;
+  }
+  fsync(fd);
+  close(fd);
+  int r = rename(tmp.c_str(), (root + "/superblock").c_str());
+  assert(r == 0);
+  sync();
+}
+
+bool one_file_per_object_backing_store::read_superblock(std::string &buf)
+{
+  std::ifstream in(root + "/superblock", std::ios::binary);
+  if (!in)
+    return false;
+  buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Files of objects that were not live any more are left over from the
+// last run.
+void one_file_per_object_backing_store::recover(const std::vector<std::pair<uint64_t, uint64_t> > &live)
+{
+  std::set<uint64_t> keep;
+  for (auto it = live.begin(); it != live.end(); ++it)
+    keep.insert(it->first);
+  nextid = keep.empty() ? 1 : *keep.rbegin() + 1;
+  DIR *dir = opendir(root.c_str());
+  assert(dir != NULL);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char *end;
+    uint64_t id = strtoull(entry->d_name, &end, 10);
+    if (end != entry->d_name && *end == '\0' && id > 0 && keep.count(id) == 0)
+      unlink(filename(id).c_str());
+  }
+  closedir(dir);
+}
+
+/////////////////////////////////////////////////////
+// Implementation of the paged_file_backing_store //
+/////////////////////////////////////////////////////
+static const char paged_file_magic[] = "BEpsilon paged file v1";
+
+static uint64_t pages_for(uint64_t length)
+{
+  return length > 0 ? (length + paged_file_backing_store::PAGE_SIZE - 1) / paged_file_backing_store::PAGE_SIZE : 1;
+}
+
+// Where the header page locates the superblock: its offset, then its
+// length.
+static const off_t paged_file_superblock_offset = 64;
+
+paged_file_backing_store::paged_file_backing_store(std::string filename, uint64_t initial_size,
+						   store_open_mode mode)
+  : file_pages(1),
+    superblock_id(0),
+    superblock_length(0)
+{
+  if (mode == OPEN_STORE) {
+    fd = open(filename.c_str(), O_RDWR);
+    assert(fd >= 0);
+    char magic[sizeof(paged_file_magic)];
+    ssize_t r = pread(fd, magic, sizeof(magic), 0);
+    assert(r == (ssize_t)sizeof(magic) && memcmp(magic, paged_file_magic, sizeof(magic)) == 0);
+    struct stat st;
+    r = fstat(fd, &st);
+    assert(r == 0 && st.st_size >= (off_t)PAGE_SIZE);
+    // Nothing is free until recover() says what is live.
+    file_pages = st.st_size / PAGE_SIZE;
+    uint64_t location[2];
+    r = pread(fd, location, sizeof(location), paged_file_superblock_offset);
+    assert(r == (ssize_t)sizeof(location));
+    superblock_id = location[0];
+    superblock_length = location[1];
+    return;
+  }
+  fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  char header[PAGE_SIZE];
+  memset(header, 0, sizeof(header));
+  memcpy(header, paged_file_magic, sizeof(paged_file_magic));
+  ssize_t r = pwrite(fd, header, sizeof(header), 0);
+  assert(r == (ssize_t)sizeof(header));
+  grow((initial_size + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+paged_file_backing_store::~paged_file_backing_store(void)
+{
+  close(fd);
+}
+
+void paged_file_backing_store::grow(uint64_t min_pages)
+{
+  uint64_t new_pages = file_pages;
+  while (new_pages < file_pages + min_pages)
+    new_pages *= 2;
+  int r = posix_fallocate(fd, file_pages * PAGE_SIZE, (new_pages - file_pages) * PAGE_SIZE);
+  assert(r == 0);
+  uint64_t first = file_pages;
+  file_pages = new_pages;
+  free_pages(first, new_pages - first);
+}
+
+void paged_file_backing_store::free_pages(uint64_t first, uint64_t pages)
+{
+  // Merge with the free extents on either side.
+  auto next = free_by_offset.lower_bound(first);
+  if (next != free_by_offset.end() && first + pages == next->first) {
+    pages += next->second;
+    free_by_size.erase(std::make_pair(next->second, next->first));
+    next = free_by_offset.erase(next);
+  }
+  if (next != free_by_offset.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == first) {
+      first = prev->first;
+      pages += prev->second;
+      free_by_size.erase(std::make_pair(prev->second, prev->first));
+      free_by_offset.erase(prev);
+    }
+  }
+  free_by_offset[first] = pages;
+  free_by_size.insert(std::make_pair(pages, first));
+}
+
+uint64_t paged_file_backing_store::allocate(size_t n) {
+  uint64_t pages = pages_for(n);
+  auto fit = free_by_size.lower_bound(std::make_pair(pages, (uint64_t)0));
+  if (fit == free_by_size.end()) {
+    grow(pages);
+    fit = free_by_size.lower_bound(std::make_pair(pages, (uint64_t)0));
+    assert(fit != free_by_size.end());
+  }
+  uint64_t first = fit->second;
+  uint64_t free_pages_left = fit->first - pages;
+  free_by_size.erase(fit);
+  free_by_offset.erase(first);
+  if (free_pages_left > 0) {
+    free_by_offset[first + pages] = free_pages_left;
+    free_by_size.insert(std::make_pair(free_pages_left, first + pages));
+  }
+
+  uint64_t id = first * PAGE_SIZE;
+  extent &e = extents[id];
+  e.pages = pages;
+  e.length = 0;
+  return id;
+}
+
+void paged_file_backing_store::deallocate(uint64_t id) {
+  auto it = extents.find(id);
+  assert(it != extents.end());
+  free_pages(id / PAGE_SIZE, it->second.pages);
+  extents.erase(it);
+}
+
+void paged_file_backing_store::read(uint64_t id, std::string &buf)
+{
+  auto it = extents.find(id);
+  assert(it != extents.end());
+  buf.resize(it->second.length);
+  if (buf.length() > 0) {
+    ssize_t r = pread(fd, &buf[0], buf.length(), id);
+    assert(r == (ssize_t)buf.length());
+  }
+}
+
+void paged_file_backing_store::write(uint64_t id, const std::string &buf)
+{
+  auto it = extents.find(id);
+  assert(it != extents.end());
+  assert(buf.length() <= it->second.pages * PAGE_SIZE);
+  ssize_t r = pwrite(fd, buf.data(), buf.length(), id);
+  assert(r == (ssize_t)buf.length());
+  it->second.length = buf.length();
+  wrote(buf.length());
+}
+
+void paged_file_backing_store::sync_data(void)
+{
+  fdatasync(fd);
+}
+
+// The new superblock goes to an extent of its own and is synced before
+// the header points at it, with one 16-byte write inside the header
+// page.
+void paged_file_backing_store::write_superblock(const std::string &buf)
+{
+  uint64_t id = allocate(buf.length());
+  write(id, buf);
+  extents.erase(id);
+  sync();
+  uint64_t location[2] = { id, buf.length() };
+  ssize_t r = pwrite(fd, location, sizeof(location), paged_file_superblock_offset);
+  assert(r == (ssize_t)sizeof(location));
+  fdatasync(fd);
+  if (superblock_id > 0)
+    free_pages(superblock_id / PAGE_SIZE, pages_for(superblock_length));
+  superblock_id = id;
+  superblock_length = buf.length();
+}
+
+bool paged_file_backing_store::read_superblock(std::string &buf)
+{
+  if (superblock_id == 0)
+    return false;
+  buf.resize(superblock_length);
+  ssize_t r = pread(fd, &buf[0], buf.length(), superblock_id);
+  assert(r == (ssize_t)buf.length());
+  return true;
+}
+
+void paged_file_backing_store::recover(const std::vector<std::pair<uint64_t, uint64_t> > &live)
+{
+  extents.clear();
+  free_by_offset.clear();
+  free_by_size.clear();
+  for (auto it = live.begin(); it != live.end(); ++it) {
+    extent &e = extents[it->first];
+    e.pages = pages_for(it->second);
+    e.length = it->second;
+  }
+  std::map<uint64_t, uint64_t> used;
+  for (auto it = extents.begin(); it != extents.end(); ++it)
+    used[it->first / PAGE_SIZE] = it->second.pages;
+  if (superblock_id > 0)
+    used[superblock_id / PAGE_SIZE] = pages_for(superblock_length);
+  uint64_t next = 1;
+  for (auto it = used.begin(); it != used.end(); ++it) {
+    assert(it->first >= next && it->first + it->second <= file_pages);
+    if (it->first > next)
+      free_pages(next, it->first - next);
+    next = it->first + it->second;
+  }
+  if (file_pages > next)
+    free_pages(next, file_pages - next);
+}
+
+std::iostream * paged_file_backing_store::get(uint64_t id) {
+  std::string buf;
+  read(id, buf);
+  std::stringstream *ios = new std::stringstream(buf);
+  open_streams[ios] = id;
+  return ios;
+}
+
+void paged_file_backing_store::put(std::iostream *ios)
+{
+  std::stringstream *ss = (std::stringstream *)ios;
+  auto it = open_streams.find(ios);
+  assert(it != open_streams.end());
+  if (ss->tellp() > 0)
+    write(it->second, ss->str());
+  open_streams.erase(it);
+  delete ss;
+}
+
+///////////////////////////////////////////////
+// Implementation of the mmap_backing_store //
+///////////////////////////////////////////////
+mmap_backing_store::mmap_backing_store(std::string filename, uint64_t initial_size, uint64_t max_size,
+				       store_open_mode mode)
+  : paged_file_backing_store(filename, initial_size, mode),
+    mapped_bytes(0),
+    reserved_bytes(max_size),
+    dirty_begin(0),
+    dirty_end(0)
+{
+  void *p = mmap(NULL, reserved_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(p != MAP_FAILED);
+  base = (char *)p;
+  map_file();
+}
+
+mmap_backing_store::~mmap_backing_store(void)
+{
+  munmap(base, reserved_bytes);
+}
+
+// Map whatever part of the file is not mapped yet at its place in the
+// reservation.
+void mmap_backing_store::map_file(void)
+{
+  uint64_t file_bytes = file_pages * PAGE_SIZE;
+  assert(file_bytes <= reserved_bytes);
+  if (file_bytes > mapped_bytes) {
+    void *p = mmap(base + mapped_bytes, file_bytes - mapped_bytes, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, fd, mapped_bytes);
+    assert(p == base + mapped_bytes);
+    mapped_bytes = file_bytes;
+  }
+}
+
+void mmap_backing_store::grow(uint64_t min_pages)
+{
+  paged_file_backing_store::grow(min_pages);
+  map_file();
+}
+
+const char * mmap_backing_store::view(uint64_t id, size_t &length)
+{
+  auto it = extents.find(id);
+  assert(it != extents.end());
+  length = it->second.length;
+  return base + id;
+}
+
+void mmap_backing_store::read(uint64_t id, std::string &buf)
+{
+  size_t length;
+  const char *data = view(id, length);
+  buf.assign(data, length);
+}
+
+void mmap_backing_store::write(uint64_t id, const std::string &buf)
+{
+  auto it = extents.find(id);
+  assert(it != extents.end());
+  assert(buf.length() <= it->second.pages * PAGE_SIZE);
+  memcpy(base + id, buf.data(), buf.length());
+  it->second.length = buf.length();
+  if (dirty_begin == dirty_end) {
+    dirty_begin = id;
+    dirty_end = id + buf.length();
+  } else {
+    dirty_begin = std::min(dirty_begin, id);
+    dirty_end = std::max(dirty_end, id + buf.length());
+  }
+  wrote(buf.length());
+}
+
+void mmap_backing_store::sync_data(void)
+{
+  if (dirty_end > dirty_begin) {
+    int r = msync(base + dirty_begin, dirty_end - dirty_begin, MS_SYNC);
+    assert(r == 0);
+  }
+  dirty_begin = dirty_end = 0;
 }
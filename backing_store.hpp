@@ -7,26 +7,226 @@
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include "compress.hpp"
+
+// When writes reach stable storage.
+typedef enum {
+  SYNC_EACH_WRITE,	// every write is synced before it returns
+  GROUP_COMMIT,		// one sync covers all writes in a byte or time window
+  NO_SYNC		// only an explicit sync() makes writes durable
+} durability_mode;
+
+// Whether a file-backed store starts out empty or keeps what an
+// earlier run left in the file.
+typedef enum {
+  CREATE_STORE,
+  OPEN_STORE
+} store_open_mode;
 
 class backing_store {
 public:
+  backing_store(void);
+
   virtual uint64_t allocate(size_t n) = 0;
   virtual void deallocate(uint64_t id) = 0;
   virtual std::iostream * get(uint64_t id) = 0;
   virtual void            put(std::iostream *ios) = 0;
+
+  // Whole-object I/O.  The defaults go through get() and put();
+  // stores that can do better override them.
+  virtual void read(uint64_t id, std::string &buf);
+  virtual void write(uint64_t id, const std::string &buf);
+
+  // Returns a pointer to the object's bytes in memory, or NULL if the
+  // store cannot hand out views.  A view stays valid until the object
+  // is deallocated.
+  virtual const char * view(uint64_t id, size_t &length) { return NULL; }
+
+  // In GROUP_COMMIT mode a write syncs once window_bytes have been
+  // written or window_usecs have passed since the oldest unsynced
+  // write.  The window is only checked when writing, so callers
+  // should sync() at the points they need to be durable.
+  void set_durability(durability_mode mode,
+		      uint64_t window_bytes = 1024 * 1024,
+		      uint64_t window_usecs = 10000);
+
+  // A durability barrier: every write so far is on stable storage
+  // when this returns.
+  void sync(void);
+
+  // swap_space stores each node image as a page: a header that
+  // records the codec and the image's length, then the image as the
+  // codec left it.  The codec only affects pages encoded from now on,
+  // every page says how to decode it.  An image that doesn't shrink is
+  // stored uncompressed.
+  void set_compression(compression_codec codec);
+  compression_codec compression(void) const { return codec; }
+
+  // Safe to call from several threads at once.
+  void encode_page(const std::string &image, std::string &page);
+
+  // Returns the image, or NULL if the page is corrupt.  An
+  // uncompressed image is returned in place, a compressed one is
+  // decompressed into buf.
+  const char * decode_page(const char *page, size_t length,
+			   std::string &buf, size_t &image_length) const;
+
+  // The superblock is the one record a store keeps where it can find
+  // it again after a restart, swap_space::checkpoint() keeps its object
+  // table there.  write_superblock() replaces the old one atomically
+  // and is durable when it returns; callers sync what it refers to
+  // first.  read_superblock() returns false when there is none.  The
+  // defaults keep it in memory only.
+  virtual void write_superblock(const std::string &buf) { superblock = buf; }
+  virtual bool read_superblock(std::string &buf) { buf = superblock; return !buf.empty(); }
+
+  // After a restart, tells the store which objects are still live, as
+  // (id, length) pairs.  Everything else is free again.
+  virtual void recover(const std::vector<std::pair<uint64_t, uint64_t> > &live) {}
+
+  // Totals over every encoded page, their ratio is the compression ratio.
+  uint64_t image_bytes_encoded(void) const { return image_bytes; }
+  uint64_t page_bytes_encoded(void) const { return page_bytes; }
+
+  virtual ~backing_store(void) {}
+
+protected:
+  // Implementations call this after each write.  Reads never do.
+  void wrote(size_t bytes);
+
+  // Push every outstanding write to stable storage.
+  virtual void sync_data(void) = 0;
+
+private:
+  durability_mode durability;
+  uint64_t	  window_bytes;
+  uint64_t	  window_usecs;
+  uint64_t	  unsynced_writes;
+  uint64_t	  unsynced_bytes;
+  uint64_t	  unsynced_since;
+  compression_codec codec;
+  std::string	  superblock;
+  std::atomic<uint64_t> image_bytes;
+  std::atomic<uint64_t> page_bytes;
 };
 
 class one_file_per_object_backing_store: public backing_store {
 public:
   one_file_per_object_backing_store(std::string rt);
+  ~one_file_per_object_backing_store(void);
   uint64_t	  allocate(size_t n);
   void		  deallocate(uint64_t id);
   std::iostream * get(uint64_t id);
   void            put(std::iostream *ios);
-  
+  void            read(uint64_t id, std::string &buf);
+  void            write(uint64_t id, const std::string &buf);
+  void		  write_superblock(const std::string &buf);
+  bool		  read_superblock(std::string &buf);
+  void		  recover(const std::vector<std::pair<uint64_t, uint64_t> > &live);
+
+protected:
+  void		  sync_data(void);
+
 private:
+  // Files written since the last sync, kept open so sync_data() can
+  // fsync them.  More than this many forces an early sync.
+  static const size_t MAX_UNSYNCED_FILES = 256;
+
+  std::string	filename(uint64_t id);
+
   std::string	root;
   uint64_t	nextid;
+  std::unordered_map<uint64_t, int> unsynced;
+  std::unordered_map<std::iostream *, uint64_t> open_streams;
+};
+
+// Keeps every object in a single preallocated file.  Objects live in
+// page-aligned extents, and an object's id is the byte offset of its
+// extent, so write() is one pwrite and read() is one pread.  Free
+// extents are tracked both by offset (to coalesce neighbours) and by
+// size (for best-fit allocation).  The file grows by doubling when no
+// free extent is large enough.  Page 0 holds a small file header that
+// also locates the superblock, so 0 is never a valid id.  With
+// OPEN_STORE the file is kept, and recover() rebuilds the extents and
+// the free space.
+class paged_file_backing_store: public backing_store {
+public:
+  static const uint64_t PAGE_SIZE = 4096;
+
+  paged_file_backing_store(std::string filename, uint64_t initial_size = 64 * 1024 * 1024,
+			   store_open_mode mode = CREATE_STORE);
+  ~paged_file_backing_store(void);
+  uint64_t	  allocate(size_t n);
+  void		  deallocate(uint64_t id);
+  std::iostream * get(uint64_t id);
+  void            put(std::iostream *ios);
+  void            read(uint64_t id, std::string &buf);
+  void            write(uint64_t id, const std::string &buf);
+  void		  write_superblock(const std::string &buf);
+  bool		  read_superblock(std::string &buf);
+  void		  recover(const std::vector<std::pair<uint64_t, uint64_t> > &live);
+
+protected:
+  void		  sync_data(void);
+
+  class extent {
+  public:
+    uint64_t pages;
+    uint64_t length;
+  };
+
+  virtual void grow(uint64_t min_pages);
+
+  int		fd;
+  uint64_t	file_pages;
+  std::unordered_map<uint64_t, extent> extents;
+
+private:
+  void free_pages(uint64_t first, uint64_t pages);
+
+  // The superblock's extent, it is not an object.
+  uint64_t	superblock_id;
+  uint64_t	superblock_length;
+  std::map<uint64_t, uint64_t> free_by_offset;
+  std::set<std::pair<uint64_t, uint64_t> > free_by_size;
+  std::unordered_map<std::iostream *, uint64_t> open_streams;
+};
+
+// A paged_file_backing_store that also maps the whole file, so
+// objects can be read through view() without any copying.  The
+// constructor reserves max_size bytes of address space up front and
+// the file is mapped into it piece by piece as it grows, so growing
+// never moves the mapping and views handed out earlier stay valid.
+class mmap_backing_store: public paged_file_backing_store {
+public:
+  mmap_backing_store(std::string filename,
+		     uint64_t initial_size = 64 * 1024 * 1024,
+		     uint64_t max_size = 64ULL * 1024 * 1024 * 1024,
+		     store_open_mode mode = CREATE_STORE);
+  ~mmap_backing_store(void);
+  void            read(uint64_t id, std::string &buf);
+  void            write(uint64_t id, const std::string &buf);
+  const char *    view(uint64_t id, size_t &length);
+
+protected:
+  void		  sync_data(void);
+  void grow(uint64_t min_pages);
+
+private:
+  void map_file(void);
+
+  char *	base;
+  uint64_t	mapped_bytes;
+  uint64_t	reserved_bytes;
+  // The part of the mapping written since the last sync.
+  uint64_t	dirty_begin;
+  uint64_t	dirty_end;
 };
 
 #endif // BACKING_STORE_HPP
@@ -0,0 +1,846 @@
+// Benchmarks for the swap_space / BEpsilonTree stack.
+//
+// Usage: ./bench [number of keys] [largest cache, in objects]
+//        ./bench --csv [number of keys]
+//        ./bench --ycsb A-F [records] [operations] [trace file]
+//        ./bench --replay trace-file [B] [cache, in objects] [buffer capacity]
+//
+// Node images are kept in a memory_backing_store so that the numbers
+// measure serialization cost rather than the file system.
+//
+// --csv runs the workload suite instead: sequential and random
+// inserts, point queries, a read/write mix and deletes against the
+// B-epsilon tree at several B, cache sizes and buffer sizes, the same
+// tree as a B+ tree and std::map, one CSV row per run on stdout.
+//
+// --ycsb loads records and runs a YCSB core workload on a tree with
+// B = 16 and a cache of 64 nodes, and records both phases to the trace
+// file when one is given.  --replay runs a trace again on a tree of
+// the given configuration.  Both report ops/s, node reads and writes
+// and the latency percentiles of the tree and its swap_space.
+
+#include <iostream>
+#include <iomanip>
+#include <unordered_map>
+#include <vector>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include "BEpsilon.h"
+#include "ShardedBEpsilon.h"
+#include "swap_space.hpp"
+#include "backing_store.hpp"
+#include "compress.hpp"
+#include "workload.hpp"
+#include <fstream>
+
+#define DEFAULT_BENCH_KEYS (100000)
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsedMicros(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+// A backing_store that keeps every object in a std::string.
+class memory_backing_store : public backing_store {
+public:
+    memory_backing_store() : nextid(1), reads(0), writes(0), bytes_read(0), bytes_written(0) {}
+
+    uint64_t allocate(size_t n) {
+        uint64_t id = nextid++;
+        blocks[id] = std::string();
+        return id;
+    }
+
+    void deallocate(uint64_t id) {
+        blocks.erase(id);
+    }
+
+    std::iostream *get(uint64_t id) {
+        std::stringstream *ss = new std::stringstream(blocks[id]);
+        open[ss] = id;
+        return ss;
+    }
+
+    void put(std::iostream *ios) {
+        std::stringstream *ss = (std::stringstream *) ios;
+        if (ss->tellp() > 0) {
+            blocks[open[ss]] = ss->str();
+        }
+        open.erase(ss);
+        delete ss;
+    }
+
+    void read(uint64_t id, std::string &buf) {
+        buf = blocks[id];
+        reads++;
+        bytes_read += buf.size();
+    }
+
+    void write(uint64_t id, const std::string &buf) {
+        blocks[id] = buf;
+        writes++;
+        bytes_written += buf.size();
+    }
+
+    uint64_t nextid;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    std::unordered_map<uint64_t, std::string> blocks;
+
+protected:
+    void sync_data() {}
+
+private:
+    std::unordered_map<std::iostream *, uint64_t> open;
+};
+
+// the node image a stored page holds.
+static std::string pageImage(const backing_store &store, const std::string &page) {
+    std::string buf;
+    size_t length;
+    const char *image = store.decode_page(page.data(), page.length(), buf, length);
+    return std::string(image, length);
+}
+
+/*
+ * build a tree, evict every node to the store, then decode (load) and re-encode (store)
+ * each stored node image on its own so the numbers are not mixed with tree traversal.
+ */
+template<int B>
+void serializationBench(const char *name, serialization_format format, int keys) {
+    typedef typename BEpsilonTree<int64_t, int64_t, B>::Node Node;
+    memory_backing_store store;
+    swap_space sspace(&store, keys, format);
+    BEpsilonTree<int64_t, int64_t, B> tree(&sspace);
+    for (int i = 0; i < keys; i++) {
+        tree.insert(i, i);
+    }
+    sspace.set_cache_size(1);
+
+    uint64_t nodes = 0, bytes = 0;
+    double load_us = 0, store_us = 0;
+    for (auto it = store.blocks.begin(); it != store.blocks.end(); ++it) {
+        std::string image = pageImage(store, it->second);
+        std::stringstream in(image);
+        std::stringstream out;
+        Node node;
+        serialization_context load_ctxt(sspace, format);
+        bench_clock::time_point start = bench_clock::now();
+        deserialize(in, load_ctxt, node);
+        load_us += elapsedMicros(start);
+
+        // serializing releases the node's pointers again, so the refcounts stay intact.
+        serialization_context store_ctxt(sspace, format);
+        start = bench_clock::now();
+        serialize(out, store_ctxt, node);
+        store_us += elapsedMicros(start);
+
+        nodes++;
+        bytes += image.size();
+    }
+
+    cout << setw(8) << name
+         << setw(6) << B
+         << setw(10) << nodes
+         << setw(16) << fixed << setprecision(1) << (double) bytes / nodes
+         << setw(16) << setprecision(3) << store_us / nodes
+         << setw(16) << setprecision(3) << load_us / nodes << endl;
+}
+
+#define DEFAULT_CACHE_BENCH_OBJECTS (10000000)
+#define CACHE_BENCH_ACCESSES (2000000)
+#define CACHE_BENCH_EVICTIONS (200000)
+#define CACHE_BENCH_PINNED (1000)
+
+// the smallest thing a swap_space can manage, so the numbers are the cache's own cost.
+class bench_object : public serializable {
+public:
+    bench_object(int64_t v = 0) : value(v) {}
+
+    void _serialize(std::iostream &fs, serialization_context &context) {
+        serialize(fs, context, value);
+    }
+
+    void _deserialize(std::iostream &fs, serialization_context &context) {
+        deserialize(fs, context, value);
+    }
+
+    int64_t value;
+};
+
+/*
+ * a full cache of n objects: pin + access + unpin of random resident objects, then allocations that
+ * each evict one object while the CACHE_BENCH_PINNED least recently used objects stay pinned, then
+ * loads of evicted objects that each evict another one.
+ */
+template<class Policy>
+void cacheBench(const char *name, uint64_t n) {
+    // the swap_space leaves its objects behind, so each run gets a policy of its own.
+    Policy policy;
+    memory_backing_store store;
+    swap_space sspace(&store, n);
+    sspace.set_replacement_policy(&policy);
+    std::vector<swap_space::pointer<bench_object> > objects;
+    objects.reserve(n + CACHE_BENCH_EVICTIONS);
+    for (uint64_t i = 0; i < n; i++) {
+        objects.push_back(sspace.allocate(new bench_object(i)));
+    }
+
+    uint64_t seed = 88172645463325252ULL;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < CACHE_BENCH_ACCESSES; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        objects[seed % n]->value++;
+    }
+    double access_ns = elapsedMicros(start) * 1000 / CACHE_BENCH_ACCESSES;
+
+    std::vector<swap_space::pin<bench_object> > pins;
+    for (uint64_t i = 0; i < n && i < CACHE_BENCH_PINNED; i++) {
+        pins.push_back(objects[i].get_pin());
+    }
+    start = bench_clock::now();
+    for (int i = 0; i < CACHE_BENCH_EVICTIONS; i++) {
+        objects.push_back(sspace.allocate(new bench_object(i)));
+    }
+    double evict_ns = elapsedMicros(start) * 1000 / CACHE_BENCH_EVICTIONS;
+    pins.clear();
+
+    start = bench_clock::now();
+    uint64_t loads = 0;
+    for (uint64_t i = 0; i < objects.size() && loads < CACHE_BENCH_EVICTIONS; i++) {
+        if (!objects[i].is_in_memory()) {
+            objects[i]->value++;
+            loads++;
+        }
+    }
+    double load_ns = loads ? elapsedMicros(start) * 1000 / loads : 0;
+
+    cout << setw(8) << name
+         << setw(12) << n
+         << setw(16) << fixed << setprecision(1) << access_ns
+         << setw(16) << evict_ns
+         << setw(16) << load_ns << endl;
+}
+
+/*
+ * compress and decompress every stored node image of a tree with the bundled LZ codec, the ratio is
+ * how much more the compressed tier holds than the same bytes of live nodes would.
+ */
+template<int B>
+void compressionBench(const char *name, serialization_format format, int keys) {
+    memory_backing_store store;
+    swap_space sspace(&store, keys, format);
+    BEpsilonTree<int64_t, int64_t, B> tree(&sspace);
+    for (int i = 0; i < keys; i++) {
+        tree.insert((int64_t) i * 7919 % keys, i);
+    }
+    sspace.set_cache_size(1);
+
+    uint64_t raw = 0, packed = 0;
+    double compress_us = 0, decompress_us = 0;
+    for (auto it = store.blocks.begin(); it != store.blocks.end(); ++it) {
+        std::string image = pageImage(store, it->second), out;
+        bench_clock::time_point start = bench_clock::now();
+        lz_compress(image.data(), image.size(), out);
+        compress_us += elapsedMicros(start);
+        std::string back(image.size(), '\0');
+        start = bench_clock::now();
+        lz_decompress(out.data(), out.size(), &back[0], back.size());
+        decompress_us += elapsedMicros(start);
+        raw += image.size();
+        packed += out.size();
+    }
+    cout << setw(8) << name
+         << setw(6) << B
+         << setw(16) << fixed << setprecision(2) << (double) raw / packed
+         << setw(16) << setprecision(1) << raw / compress_us
+         << setw(16) << raw / decompress_us << endl;
+}
+
+/*
+ * the same tree stored with each page codec, then every key looked up again through a small
+ * cache: the bytes read back from the store against the time to read and decode them.
+ */
+template<int B>
+void pageCompressionBench(const char *name, compression_codec codec, int keys) {
+    memory_backing_store store;
+    store.set_compression(codec);
+    swap_space sspace(&store, 64);
+    BEpsilonTree<int64_t, int64_t, B> tree(&sspace);
+    for (int i = 0; i < keys; i++) {
+        tree.insert((int64_t) i * 7919 % keys, i);
+    }
+    tree.sync();
+    sspace.set_cache_size(16);
+
+    store.bytes_read = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < keys; i++) {
+        int64_t value;
+        tree.pointQuery(i, value);
+    }
+    double us = elapsedMicros(start);
+    cout << setw(8) << name
+         << setw(6) << B
+         << setw(16) << fixed << setprecision(2) << (double) store.image_bytes_encoded() / store.page_bytes_encoded()
+         << setw(16) << store.bytes_read / keys
+         << setw(16) << setprecision(3) << us / keys << endl;
+}
+
+#define SEARCH_BENCH_LOOKUPS (2000000)
+
+/*
+ * intra-node search: the linear scan the tree used to do against key_search, over one sorted
+ * node of n keys with pseudo random search keys.
+ */
+void searchBench(int n) {
+    std::vector<int64_t> keys;
+    for (int i = 0; i < n; i++) {
+        keys.push_back(3 * i);
+    }
+    uint64_t seed = 88172645463325252ULL, sum = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < SEARCH_BENCH_LOOKUPS; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        int64_t key = seed % (3 * n);
+        size_t ix = 0;
+        for (; ix < keys.size() && keys[ix] < key; ix++) {}
+        sum += ix;
+    }
+    double linear_ns = elapsedMicros(start) * 1000 / SEARCH_BENCH_LOOKUPS;
+    start = bench_clock::now();
+    for (int i = 0; i < SEARCH_BENCH_LOOKUPS; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        int64_t key = seed % (3 * n);
+        sum += key_search<int64_t>::lower_bound(keys.data(), keys.size(), key);
+    }
+    double search_ns = elapsedMicros(start) * 1000 / SEARCH_BENCH_LOOKUPS;
+    cout << setw(8) << n
+         << setw(16) << fixed << setprecision(2) << linear_ns
+         << setw(16) << search_ns
+         << (sum == 0 ? " " : "") << endl;
+}
+
+#define BENCH_BATCH_SIZE (1000)
+
+/*
+ * load the same sorted keys with insert(), with write() in batches and with bulkLoad(), through
+ * a small cache, and count the node images each one writes to the store.
+ */
+template<int B>
+void loadBench(int keys) {
+    std::vector<std::pair<int64_t, int64_t> > input;
+    for (int i = 0; i < keys; i++) {
+        input.push_back(std::make_pair(i, i));
+    }
+    const char *methods[] = {"insert", "batch", "bulk"};
+    for (int method = 0; method < 3; method++) {
+        memory_backing_store store;
+        swap_space sspace(&store, 64);
+        BEpsilonTree<int64_t, int64_t, B> tree(&sspace);
+        bench_clock::time_point start = bench_clock::now();
+        if (method == 0) {
+            for (int i = 0; i < keys; i++) {
+                tree.insert(input[i].first, input[i].second);
+            }
+        } else if (method == 1) {
+            typename BEpsilonTree<int64_t, int64_t, B>::WriteBatch batch;
+            for (int i = 0; i < keys; i++) {
+                batch.insert(input[i].first, input[i].second);
+                if (batch.size() == BENCH_BATCH_SIZE || i == keys - 1) {
+                    tree.write(batch);
+                    batch.clear();
+                }
+            }
+        } else {
+            tree.bulkLoad(input.begin(), input.end());
+        }
+        tree.sync();
+        double us = elapsedMicros(start);
+        cout << setw(8) << methods[method]
+             << setw(6) << B
+             << setw(16) << store.nextid - 1
+             << setw(16) << store.blocks.size()
+             << setw(16) << fixed << setprecision(3) << us / keys << endl;
+    }
+}
+
+#define READ_BENCH_MAX_THREADS (32)
+
+/*
+ * point queries on a tree in concurrent reader mode, keys lookups in all split over 1 to
+ * READ_BENCH_MAX_THREADS reader threads, alone and with one thread inserting new keys until the
+ * readers are done. the cache holds about a quarter of the nodes, so readers load and evict too.
+ */
+template<int B>
+void readScalingBench(int keys) {
+    memory_backing_store store;
+    swap_space sspace(&store, 1 << 20);
+    BEpsilonTree<int64_t, int64_t, B> tree(&sspace);
+    for (int i = 0; i < keys; i++) {
+        tree.insert(2 * ((int64_t) i * 7919 % keys), i);
+    }
+    tree.sync();
+    sspace.set_cache_size(std::max<uint64_t>(16, store.blocks.size() / 4));
+    tree.setConcurrentReaders(true);
+
+    int64_t next_key = 1;
+    for (int threads = 1; threads <= READ_BENCH_MAX_THREADS; threads *= 2) {
+        for (int writer = 0; writer < 2; writer++) {
+            std::atomic<int> running(threads);
+            uint64_t writes = 0;
+            std::vector<std::thread> readers;
+            bench_clock::time_point start = bench_clock::now();
+            for (int t = 0; t < threads; t++) {
+                readers.push_back(std::thread([&, t]() {
+                    uint64_t seed = 88172645463325252ULL + t;
+                    for (int i = t; i < keys; i += threads) {
+                        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+                        int64_t value;
+                        tree.pointQuery(2 * (seed % keys), value);
+                    }
+                    running--;
+                }));
+            }
+            while (writer && running > 0) {
+                tree.insert(next_key, next_key);
+                next_key += 2;
+                writes++;
+            }
+            for (size_t t = 0; t < readers.size(); t++) {
+                readers[t].join();
+            }
+            double us = elapsedMicros(start);
+            cout << setw(8) << threads
+                 << setw(8) << (writer ? "yes" : "no")
+                 << setw(6) << B
+                 << setw(16) << fixed << setprecision(0) << keys / us * 1e6
+                 << setw(16) << writes / us * 1e6 << endl;
+        }
+    }
+}
+
+#define WRITE_BENCH_MAX_THREADS (32)
+
+/*
+ * keys inserts in all, split over 1 to WRITE_BENCH_MAX_THREADS threads that each insert random keys
+ * of the whole key space, into one tree and into a tree sharded by key range with one shard per thread.
+ */
+template<int B>
+void shardedWriteBench(int keys) {
+    for (int threads = 1; threads <= WRITE_BENCH_MAX_THREADS; threads *= 2) {
+        for (int sharded = 0; sharded < (threads > 1 ? 2 : 1); sharded++) {
+            int shards = sharded ? threads : 1;
+            std::vector<std::unique_ptr<memory_backing_store> > stores;
+            std::vector<backing_store *> shard_stores;
+            std::vector<int64_t> splits;
+            for (int i = 0; i < shards; i++) {
+                stores.push_back(std::unique_ptr<memory_backing_store>(new memory_backing_store()));
+                shard_stores.push_back(stores.back().get());
+                if (i > 0) {
+                    splits.push_back((int64_t) keys * i / shards);
+                }
+            }
+            ShardedBEpsilonTree<int64_t, int64_t, B> tree(shard_stores, splits, 1 << 20);
+            std::vector<std::thread> writers;
+            bench_clock::time_point start = bench_clock::now();
+            for (int t = 0; t < threads; t++) {
+                writers.push_back(std::thread([&, t]() {
+                    uint64_t seed = 88172645463325252ULL + t;
+                    for (int i = t; i < keys; i += threads) {
+                        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+                        tree.insert(seed % keys, i);
+                    }
+                }));
+            }
+            for (size_t t = 0; t < writers.size(); t++) {
+                writers[t].join();
+            }
+            double us = elapsedMicros(start);
+            cout << setw(8) << threads
+                 << setw(8) << shards
+                 << setw(6) << B
+                 << setw(16) << fixed << setprecision(0) << keys / us * 1e6 << endl;
+        }
+    }
+}
+
+#define DEFAULT_SUITE_KEYS (20000)
+
+// what the workload suite runs against: a tree over its own store, or std::map.
+template<int B>
+class TreeSubject {
+public:
+    TreeSubject(uint64_t cache_objects, size_t buffer_capacity) : sspace(&store, cache_objects), tree(&sspace) {
+        tree.setMessageBufferCapacity(buffer_capacity);
+    }
+
+    void insert(int64_t key, int64_t value) {
+        tree.insert(key, value);
+    }
+
+    void remove(int64_t key) {
+        tree.remove(key);
+    }
+
+    bool pointQuery(int64_t key, int64_t &value) {
+        return tree.pointQuery(key, value);
+    }
+
+    //node images read from and written to the store.
+    uint64_t reads() const {
+        return store.reads;
+    }
+
+    uint64_t writes() const {
+        return store.writes;
+    }
+
+    memory_backing_store store;
+    swap_space sspace;
+    BEpsilonTree<int64_t, int64_t, B> tree;
+};
+
+class MapSubject {
+public:
+    void insert(int64_t key, int64_t value) {
+        map[key] = value;
+    }
+
+    void remove(int64_t key) {
+        map.erase(key);
+    }
+
+    bool pointQuery(int64_t key, int64_t &value) {
+        std::map<int64_t, int64_t>::const_iterator it = map.find(key);
+        if (it == map.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    uint64_t reads() const {
+        return 0;
+    }
+
+    uint64_t writes() const {
+        return 0;
+    }
+
+    std::map<int64_t, int64_t> map;
+};
+
+// the configuration columns of a CSV row.
+struct SuiteRun {
+    const char *structure;
+    int B;
+    double epsilon;
+    uint64_t cache_objects;
+};
+
+/*
+ * times op(i) for i in [0, n) one by one and writes a CSV row with the throughput, the latency
+ * percentiles and the node reads and writes the workload caused.
+ */
+template<class Subject, class Op>
+void timeWorkload(const SuiteRun &run, const char *workload, int keys, Subject *subject, int n, Op op) {
+    latency_histogram latency;
+    uint64_t reads = subject->reads(), writes = subject->writes();
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < n; i++) {
+        latency_timer<latency_histogram> timer(latency);
+        op(i);
+    }
+    double us = elapsedMicros(start);
+    cout << run.structure << "," << workload << "," << keys << "," << run.B << ","
+         << setprecision(2) << run.epsilon << "," << run.cache_objects << "," << n << ","
+         << fixed << setprecision(0) << n / us * 1e6 << setprecision(3)
+         << "," << latency.p50() / 1e3 << "," << latency.p99() / 1e3
+         << "," << latency.p999() / 1e3 << "," << latency.max() / 1e3
+         << "," << subject->reads() - reads << "," << subject->writes() - writes << endl;
+    cout.unsetf(std::ios::fixed);
+}
+
+/*
+ * the suite's workloads, each over keys operations: ascending inserts into one fresh subject, then
+ * into another one random inserts, point queries of present keys, half queries and half inserts of
+ * new keys, and removes of present keys.
+ */
+template<class Subject>
+void suiteWorkloads(const SuiteRun &run, int keys, std::function<Subject *()> make) {
+    std::unique_ptr<Subject> sequential(make());
+    timeWorkload(run, "seq_insert", keys, sequential.get(), keys, [&](int i) {
+        sequential->insert(i, i);
+    });
+    sequential.reset();
+
+    std::vector<int64_t> order(keys);
+    for (int i = 0; i < keys; i++) {
+        order[i] = 2 * i;
+    }
+    uint64_t seed = 88172645463325252ULL;
+    auto next = [&seed]() {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        return seed;
+    };
+    for (int i = keys - 1; i > 0; i--) {
+        std::swap(order[i], order[next() % (i + 1)]);
+    }
+    std::unique_ptr<Subject> subject(make());
+    timeWorkload(run, "rand_insert", keys, subject.get(), keys, [&](int i) {
+        subject->insert(order[i], i);
+    });
+    timeWorkload(run, "point_query", keys, subject.get(), keys, [&](int i) {
+        int64_t value;
+        subject->pointQuery(order[next() % keys], value);
+    });
+    timeWorkload(run, "mixed", keys, subject.get(), keys, [&](int i) {
+        int64_t value;
+        if (next() % 2) {
+            subject->pointQuery(order[next() % keys], value);
+        } else {
+            subject->insert(2 * (next() % keys) + 1, i);
+        }
+    });
+    timeWorkload(run, "delete", keys, subject.get(), keys, [&](int i) {
+        subject->remove(order[keys - 1 - i]);
+    });
+}
+
+template<int B>
+void suiteTree(int keys) {
+    typedef typename BEpsilonTree<int64_t, int64_t, B>::Node Node;
+    uint64_t caches[] = {64, 4096};
+    double epsilons[] = {Node::EPSILON, 0.5};
+    for (uint64_t cache : caches) {
+        for (double epsilon : epsilons) {
+            size_t capacity = std::max<size_t>(2, Node::BLOCK_SIZE * epsilon / Node::MESSAGE_SIZE);
+            SuiteRun run = {"betree", B, epsilon, cache};
+            suiteWorkloads<TreeSubject<B> >(run, keys, [&]() { return new TreeSubject<B>(cache, capacity); });
+        }
+        SuiteRun run = {"bplus", B, 0, cache};
+        suiteWorkloads<TreeSubject<B> >(run, keys, [&]() { return new TreeSubject<B>(cache, 1); });
+    }
+}
+
+void suite(int keys) {
+    cout << "structure,workload,keys,B,epsilon,cache_objects,ops,ops_per_sec,p50_us,p99_us,p999_us,max_us,"
+         << "node_reads,node_writes" << endl;
+    int sizes[] = {keys / 10, keys};
+    for (int n : sizes) {
+        suiteTree<16>(n);
+        suiteTree<64>(n);
+        SuiteRun run = {"std::map", 0, 0, 0};
+        suiteWorkloads<MapSubject>(run, n, []() { return new MapSubject(); });
+    }
+}
+
+#define DEFAULT_YCSB_RECORDS (100000)
+#define DEFAULT_YCSB_OPERATIONS (100000)
+#define DEFAULT_REPLAY_CACHE_OBJECTS (64)
+
+static void reportPhase(const char *phase, uint64_t ops, double us, const memory_backing_store &store,
+                        uint64_t reads, uint64_t writes) {
+    cout << setw(8) << phase
+         << setw(12) << ops
+         << setw(16) << fixed << setprecision(0) << ops / us * 1e6
+         << setw(16) << store.reads - reads
+         << setw(16) << store.writes - writes << endl;
+}
+
+static void reportLatency(const char *name, const latency_histogram &h) {
+    if (h.count() == 0) {
+        return;
+    }
+    cout << setw(12) << name << setw(12) << h.count() << fixed << setprecision(1)
+         << setw(12) << h.p50() / 1e3 << setw(12) << h.p99() / 1e3
+         << setw(12) << h.p999() / 1e3 << setw(12) << h.max() / 1e3 << endl;
+    cout.unsetf(std::ios::fixed);
+}
+
+//the latency histograms of the tree and its swap_space, in microseconds.
+template<int B>
+static void reportLatencies(BEpsilonTree<int64_t, int64_t, B> &tree, swap_space &sspace) {
+    TreeLatencies latencies = tree.latencies();
+    swap_space_latencies cache = sspace.latencies();
+    cout << setw(12) << "latency us" << setw(12) << "count" << setw(12) << "p50" << setw(12) << "p99"
+         << setw(12) << "p999" << setw(12) << "max" << endl;
+    reportLatency("insert", latencies.insert);
+    reportLatency("remove", latencies.remove);
+    reportLatency("pointQuery", latencies.point_query);
+    reportLatency("flush", latencies.flush);
+    reportLatency("load", cache.load);
+    reportLatency("write_back", cache.write_back);
+}
+
+static void phaseHeader() {
+    cout << setw(8) << "phase" << setw(12) << "ops" << setw(16) << "ops/s"
+         << setw(16) << "node reads" << setw(16) << "node writes" << endl;
+}
+
+int ycsb(char name, uint64_t records, uint64_t operations, const char *trace_file) {
+    workload_mix mix;
+    if (!ycsb_workload(name, mix)) {
+        cerr << "no YCSB workload " << name << endl;
+        return 1;
+    }
+    memory_backing_store store;
+    swap_space sspace(&store, DEFAULT_REPLAY_CACHE_OBJECTS);
+    BEpsilonTree<int64_t, int64_t, 16> tree(&sspace);
+    std::fstream trace;
+    if (trace_file != NULL) {
+        trace.open(trace_file, std::ios::out | std::ios::trunc | std::ios::binary);
+        tree.setTrace(&trace);
+    }
+    workload_generator generator(mix, records, 1);
+    cout << "ycsb " << name << ", " << records << " records, " << operations << " operations" << endl;
+    phaseHeader();
+
+    bench_clock::time_point start = bench_clock::now();
+    for (uint64_t r = 0; r < records; r++) {
+        tree.insert(generator.record_key(r), r);
+    }
+    reportPhase("load", records, elapsedMicros(start), store, 0, 0);
+
+    uint64_t reads = store.reads, writes = store.writes;
+    start = bench_clock::now();
+    for (uint64_t i = 0; i < operations; i++) {
+        workload_op op = generator.next();
+        int64_t value;
+        switch (op.opcode) {
+            case READ_OP:
+                tree.pointQuery(op.key, value);
+                break;
+            case UPDATE_OP:
+            case INSERT_OP:
+                tree.insert(op.key, i);
+                break;
+            case SCAN_OP:
+                tree.scan(op.key, op.scan_length, [](const int64_t &, const int64_t &) {});
+                break;
+            case READ_MODIFY_WRITE_OP:
+                value = 0;
+                tree.pointQuery(op.key, value);
+                tree.insert(op.key, value + 1);
+                break;
+        }
+    }
+    reportPhase("run", operations, elapsedMicros(start), store, reads, writes);
+    reportLatencies(tree, sspace);
+    tree.setTrace(NULL);
+    return 0;
+}
+
+template<int B>
+int replay(const char *trace_file, uint64_t cache_objects, size_t buffer_capacity) {
+    std::fstream trace(trace_file, std::ios::in | std::ios::binary);
+    if (!trace.is_open()) {
+        cerr << "can't open " << trace_file << endl;
+        return 1;
+    }
+    memory_backing_store store;
+    swap_space sspace(&store, cache_objects);
+    BEpsilonTree<int64_t, int64_t, B> tree(&sspace);
+    if (buffer_capacity > 0) {
+        tree.setMessageBufferCapacity(buffer_capacity);
+    }
+    cout << "replay " << trace_file << ", B " << B << ", cache " << cache_objects << " objects, buffer "
+         << tree.messageBufferCapacity() << " messages" << endl;
+    phaseHeader();
+    bench_clock::time_point start = bench_clock::now();
+    uint64_t ops = tree.replayTrace(trace);
+    reportPhase("replay", ops, elapsedMicros(start), store, 0, 0);
+    reportLatencies(tree, sspace);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--ycsb") == 0) {
+        return ycsb(argv[2][0],
+                    argc > 3 ? strtoull(argv[3], NULL, 10) : DEFAULT_YCSB_RECORDS,
+                    argc > 4 ? strtoull(argv[4], NULL, 10) : DEFAULT_YCSB_OPERATIONS,
+                    argc > 5 ? argv[5] : NULL);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        int b = argc > 3 ? atoi(argv[3]) : 16;
+        uint64_t cache = argc > 4 ? strtoull(argv[4], NULL, 10) : DEFAULT_REPLAY_CACHE_OBJECTS;
+        size_t capacity = argc > 5 ? strtoull(argv[5], NULL, 10) : 0;
+        switch (b) {
+            case 4: return replay<4>(argv[2], cache, capacity);
+            case 16: return replay<16>(argv[2], cache, capacity);
+            case 64: return replay<64>(argv[2], cache, capacity);
+            default: cerr << "B must be 4, 16 or 64" << endl; return 1;
+        }
+    }
+    if (argc > 1 && strcmp(argv[1], "--csv") == 0) {
+        suite(argc > 2 ? atoi(argv[2]) : DEFAULT_SUITE_KEYS);
+        return 0;
+    }
+    int keys = argc > 1 ? atoi(argv[1]) : DEFAULT_BENCH_KEYS;
+    uint64_t cache_objects = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_CACHE_BENCH_OBJECTS;
+
+    cout << "node serialization, " << keys << " keys" << endl;
+    cout << setw(8) << "format" << setw(6) << "B" << setw(10) << "nodes"
+         << setw(16) << "bytes/node" << setw(16) << "store us/node" << setw(16) << "load us/node" << endl;
+    serializationBench<16>("text", TEXT_FORMAT, keys);
+    serializationBench<16>("binary", BINARY_FORMAT, keys);
+    serializationBench<64>("text", TEXT_FORMAT, keys);
+    serializationBench<64>("binary", BINARY_FORMAT, keys);
+
+    cout << endl << "sorted load, " << keys << " keys" << endl;
+    cout << setw(8) << "method" << setw(6) << "B" << setw(16) << "node writes"
+         << setw(16) << "nodes" << setw(16) << "us/key" << endl;
+    loadBench<16>(keys);
+    loadBench<64>(keys);
+
+    cout << endl << "node image compression, " << keys << " keys" << endl;
+    cout << setw(8) << "format" << setw(6) << "B" << setw(16) << "ratio"
+         << setw(16) << "compress MB/s" << setw(16) << "decompress MB/s" << endl;
+    compressionBench<16>("text", TEXT_FORMAT, keys);
+    compressionBench<16>("binary", BINARY_FORMAT, keys);
+    compressionBench<64>("binary", BINARY_FORMAT, keys);
+
+    cout << endl << "page compression in the store, " << keys << " keys looked up through a small cache" << endl;
+    cout << setw(8) << "codec" << setw(6) << "B" << setw(16) << "ratio"
+         << setw(16) << "bytes read/key" << setw(16) << "us/key" << endl;
+    pageCompressionBench<16>("none", NO_COMPRESSION, keys);
+    pageCompressionBench<16>("lz", LZ_COMPRESSION, keys);
+    pageCompressionBench<64>("none", NO_COMPRESSION, keys);
+    pageCompressionBench<64>("lz", LZ_COMPRESSION, keys);
+
+    cout << endl << "int64_t lower_bound in one node" << endl;
+    cout << setw(8) << "keys" << setw(16) << "linear ns" << setw(16) << "key_search ns" << endl;
+    searchBench(16);
+    searchBench(64);
+    searchBench(256);
+    searchBench(1024);
+
+    cout << endl << "concurrent point queries, " << keys << " lookups, "
+         << std::thread::hardware_concurrency() << " hardware threads" << endl;
+    cout << setw(8) << "readers" << setw(8) << "writer" << setw(6) << "B"
+         << setw(16) << "lookups/s" << setw(16) << "inserts/s" << endl;
+    readScalingBench<16>(keys);
+
+    cout << endl << "concurrent inserts, " << keys << " keys" << endl;
+    cout << setw(8) << "writers" << setw(8) << "shards" << setw(6) << "B" << setw(16) << "inserts/s" << endl;
+    shardedWriteBench<16>(keys);
+
+    cout << endl << "swap_space cache, " << CACHE_BENCH_PINNED << " objects pinned while evicting" << endl;
+    cout << setw(8) << "policy" << setw(12) << "objects" << setw(16) << "access ns"
+         << setw(16) << "evict ns" << setw(16) << "load+evict ns" << endl;
+    for (uint64_t n = 1000; n <= cache_objects; n *= 10) {
+        cacheBench<lru_policy>("lru", n);
+        cacheBench<clock_policy>("clock", n);
+    }
+    return 0;
+}
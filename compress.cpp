@@ -0,0 +1,130 @@
+#include "compress.hpp"
+#include <cstdint>
+#include <cstring>
+
+#define LZ_MIN_MATCH (4)
+#define LZ_HASH_BITS (12)
+#define LZ_MAX_OFFSET (65535)
+
+static inline uint32_t read32(const char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// The part of a length that didn't fit in its nibble.
+static void put_length(std::string &out, size_t length)
+{
+  while (length >= 255) {
+    out.push_back((char)255);
+    length -= 255;
+  }
+  out.push_back((char)length);
+}
+
+static bool get_length(const unsigned char *&ip, const unsigned char *end, size_t &length)
+{
+  unsigned char b;
+  do {
+    if (ip == end)
+      return false;
+    b = *ip++;
+    length += b;
+  } while (b == 255);
+  return true;
+}
+
+static void put_literals(std::string &out, const char *literals, size_t count, unsigned match_nibble)
+{
+  out.push_back((char)(((count < 15 ? count : 15) << 4) | match_nibble));
+  if (count >= 15)
+    put_length(out, count - 15);
+  out.append(literals, count);
+}
+
+void lz_compress(const char *src, size_t n, std::string &out)
+{
+  // Positions + 1 of the last 4-byte prefix with each hash, 0 is empty.
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  out.reserve(out.size() + n + n / 255 + 16);
+
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    uint32_t v = read32(src + i);
+    uint32_t h = lz_hash(v);
+    size_t candidate = table[h];
+    table[h] = (uint32_t)(i + 1);
+    if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET ||
+        read32(src + candidate - 1) != v) {
+      i++;
+      continue;
+    }
+
+    size_t match = candidate - 1;
+    size_t length = LZ_MIN_MATCH;
+    while (i + length < n && src[match + length] == src[i + length])
+      length++;
+
+    size_t extra = length - LZ_MIN_MATCH;
+    size_t offset = i - match;
+    put_literals(out, src + anchor, i - anchor, extra < 15 ? extra : 15);
+    out.push_back((char)(offset & 0xff));
+    out.push_back((char)(offset >> 8));
+    if (extra >= 15)
+      put_length(out, extra - 15);
+
+    i += length;
+    anchor = i;
+  }
+  put_literals(out, src + anchor, n - anchor, 0);
+}
+
+bool lz_decompress(const char *src, size_t n, char *dst, size_t raw_length)
+{
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + n;
+  size_t op = 0;
+
+  while (ip < end) {
+    unsigned token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !get_length(ip, end, literals))
+      return false;
+    if ((size_t)(end - ip) < literals || raw_length - op < literals)
+      return false;
+    memcpy(dst + op, ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return false;
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    size_t length = token & 15;
+    if (length == 15 && !get_length(ip, end, length))
+      return false;
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || raw_length - op < length)
+      return false;
+    const char *from = dst + op - offset;
+    if (offset >= length) {
+      memcpy(dst + op, from, length);
+    } else {
+      // Byte by byte: the match overlaps the bytes it produces.
+      for (size_t k = 0; k < length; k++)
+        dst[op + k] = from[k];
+    }
+    op += length;
+  }
+  return op == raw_length;
+}
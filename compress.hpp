@@ -0,0 +1,35 @@
+// A small LZ77 block codec for node images, with no dependencies.
+//
+// The format follows LZ4's block format: a sequence of
+//
+//   token        high nibble: literal count, low nibble: match length - 4
+//   [255 ...]    more literal count when the nibble is 15
+//   literals
+//   offset       2 bytes, little-endian, 1..65535 back from here
+//   [255 ...]    more match length when the nibble is 15
+//
+// and a last sequence that has only literals.  Matches are found
+// through a hash table of 4-byte prefixes with a single candidate per
+// slot, which is fast and good enough for the long repeats in node
+// images: runs of similar keys, the message opcodes and the pointers.
+
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <cstddef>
+#include <string>
+
+// How a backing store keeps node images, see backing_store::encode_page.
+typedef enum {
+  NO_COMPRESSION,	// pages hold the image as it is
+  LZ_COMPRESSION	// pages hold lz_compress()ed images
+} compression_codec;
+
+// Appends the compressed form of src[0, n) to out.
+void lz_compress(const char *src, size_t n, std::string &out);
+
+// Decompresses exactly raw_length bytes into dst.  Returns false when
+// src is not a valid block of that length.
+bool lz_decompress(const char *src, size_t n, char *dst, size_t raw_length);
+
+#endif // COMPRESS_HPP
@@ -0,0 +1,207 @@
+// Searching inside a node.
+//
+// key_search<Key> finds positions in a sorted array of n keys:
+//
+//   lower_bound(keys, n, key): the first i with !(keys[i] < key)
+//   upper_bound(keys, n, key): the first i with key < keys[i]
+//
+// The generic version is a branch-free binary search, the loop
+// body is a conditional move, and it needs nothing but
+// Key::operator<.
+//
+// int64_t and int32_t keys are specialized.  A range of at most
+// Kernel::range keys is searched by counting the keys that
+// are less than (or not greater than) the search key with
+// compare-and-movemask kernels: AVX2 when the compiler targets it
+// (-mavx2 or -march=native), SSE4.2 for int64_t / SSE2 for
+// int32_t otherwise, and a scalar loop as the last resort.  In a
+// sorted array that count is the position.  Larger nodes are first
+// narrowed down to such a range by the branch-free binary search.
+//
+// branchless_lower_bound also takes a key_of projection, for
+// arrays of records sorted by key, such as message buffers.
+
+#ifndef KEY_SEARCH_HPP
+#define KEY_SEARCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__AVX2__) || defined(__SSE4_2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// The widest range a kernel counts, the scalar one stops earlier.
+#define SIMD_SEARCH_RANGE (32)
+
+template<class T, class Key, class KeyOf>
+inline size_t branchless_lower_bound(const T *a, size_t n, const Key &key, KeyOf key_of)
+{
+  if (n == 0)
+    return 0;
+  const T *base = a;
+  while (n > 1) {
+    size_t half = n / 2;
+    base = key_of(base[half]) < key ? base + half : base;
+    n -= half;
+  }
+  return (base - a) + (key_of(*base) < key);
+}
+
+template<class T, class Key, class KeyOf>
+inline size_t branchless_upper_bound(const T *a, size_t n, const Key &key, KeyOf key_of)
+{
+  if (n == 0)
+    return 0;
+  const T *base = a;
+  while (n > 1) {
+    size_t half = n / 2;
+    base = key < key_of(base[half]) ? base : base + half;
+    n -= half;
+  }
+  return (base - a) + !(key < key_of(*base));
+}
+
+template<class Key>
+struct identity_key {
+  const Key &operator()(const Key &k) const { return k; }
+};
+
+template<class Key>
+struct key_search {
+  static size_t lower_bound(const Key *keys, size_t n, const Key &key) {
+    return branchless_lower_bound(keys, n, key, identity_key<Key>());
+  }
+
+  static size_t upper_bound(const Key *keys, size_t n, const Key &key) {
+    return branchless_upper_bound(keys, n, key, identity_key<Key>());
+  }
+};
+
+// The shared part of the integer specializations: Kernel supplies
+// count_less and count_greater over at most Kernel::range keys.
+template<class Key, class Kernel>
+struct simd_key_search {
+  static size_t lower_bound(const Key *keys, size_t n, const Key &key) {
+    const Key *base = keys;
+    while (n > Kernel::range) {
+      size_t half = n / 2;
+      base = base[half] < key ? base + half : base;
+      n -= half;
+    }
+    return (base - keys) + Kernel::count_less(base, n, key);
+  }
+
+  static size_t upper_bound(const Key *keys, size_t n, const Key &key) {
+    const Key *base = keys;
+    while (n > Kernel::range) {
+      size_t half = n / 2;
+      base = key < base[half] ? base : base + half;
+      n -= half;
+    }
+    return (base - keys) + n - Kernel::count_greater(base, n, key);
+  }
+};
+
+struct int64_kernel {
+#if defined(__AVX2__) || defined(__SSE4_2__)
+  static constexpr size_t range = SIMD_SEARCH_RANGE;
+#else
+  static constexpr size_t range = 8;
+#endif
+
+  static size_t count_less(const int64_t *a, size_t n, int64_t key) {
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi64x(key);
+    for (; i + 4 <= n; i += 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+      count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, v))));
+    }
+#elif defined(__SSE4_2__)
+    __m128i k = _mm_set1_epi64x(key);
+    for (; i + 2 <= n; i += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+      count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v))));
+    }
+#endif
+    for (; i < n; i++)
+      count += a[i] < key;
+    return count;
+  }
+
+  static size_t count_greater(const int64_t *a, size_t n, int64_t key) {
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi64x(key);
+    for (; i + 4 <= n; i += 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+      count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, k))));
+    }
+#elif defined(__SSE4_2__)
+    __m128i k = _mm_set1_epi64x(key);
+    for (; i + 2 <= n; i += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+      count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, k))));
+    }
+#endif
+    for (; i < n; i++)
+      count += key < a[i];
+    return count;
+  }
+};
+
+struct int32_kernel {
+#if defined(__AVX2__) || defined(__SSE2__)
+  static constexpr size_t range = SIMD_SEARCH_RANGE;
+#else
+  static constexpr size_t range = 8;
+#endif
+
+  static size_t count_less(const int32_t *a, size_t n, int32_t key) {
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi32(key);
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+      count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v))));
+    }
+#elif defined(__SSE2__)
+    __m128i k = _mm_set1_epi32(key);
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+      count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, v))));
+    }
+#endif
+    for (; i < n; i++)
+      count += a[i] < key;
+    return count;
+  }
+
+  static size_t count_greater(const int32_t *a, size_t n, int32_t key) {
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi32(key);
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+      count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, k))));
+    }
+#elif defined(__SSE2__)
+    __m128i k = _mm_set1_epi32(key);
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+      count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, k))));
+    }
+#endif
+    for (; i < n; i++)
+      count += key < a[i];
+    return count;
+  }
+};
+
+template<>
+struct key_search<int64_t> : public simd_key_search<int64_t, int64_kernel> {};
+
+template<>
+struct key_search<int32_t> : public simd_key_search<int32_t, int32_kernel> {};
+
+#endif // KEY_SEARCH_HPP
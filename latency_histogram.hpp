@@ -0,0 +1,187 @@
+// Latency histograms in the style of HdrHistogram: every power of two
+// is split into 32 linear buckets, so a value is off by at most 1/32
+// (about 3%) of itself, from a nanosecond to centuries, in a fixed
+// array of counts.  Recording is an index computation and an add.
+//
+// A latency_histogram is for one thread at a time, or for several
+// under a lock they already hold.  Histograms recorded apart, say one
+// per thread, merge into one.  A shared_latency_histogram takes
+// records from any number of threads at once.
+//
+// Time a piece of code with
+//
+//   { latency_timer<latency_histogram> t(h); ... }
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <sstream>
+#include "metrics.hpp"
+
+// steady_clock, in nanoseconds.
+inline uint64_t latency_now(void)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class latency_histogram {
+public:
+  static const int SUB_BUCKET_BITS = 5;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  // Values below 2 * SUB_BUCKETS get a bucket each, every power of two
+  // from there up to 2^63 gets SUB_BUCKETS.
+  static const int BUCKETS = (65 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+  latency_histogram(void) { reset(); }
+
+  void reset(void) {
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    sum = 0;
+    smallest = UINT64_MAX;
+    largest = 0;
+  }
+
+  void record(uint64_t value) {
+    counts[bucket(value)]++;
+    total++;
+    sum += value;
+    if (value < smallest)
+      smallest = value;
+    if (value > largest)
+      largest = value;
+  }
+
+  void merge(const latency_histogram &other) {
+    for (int i = 0; i < BUCKETS; i++)
+      counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    if (other.smallest < smallest)
+      smallest = other.smallest;
+    if (other.largest > largest)
+      largest = other.largest;
+  }
+
+  uint64_t count(void) const { return total; }
+  uint64_t total_value(void) const { return sum; }
+  uint64_t min(void) const { return total ? smallest : 0; }
+  uint64_t max(void) const { return largest; }
+  double mean(void) const { return total ? (double)sum / total : 0; }
+
+  // The value that a fraction q of the records are at or below, e.g.
+  // 0.99 for p99: the top of its bucket, never more than max().  0
+  // when nothing was recorded.
+  uint64_t percentile(double q) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = (uint64_t)std::ceil(q * total);
+    if (rank < 1)
+      rank = 1;
+    if (rank >= total)
+      return largest;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank)
+	return bucket_top(i) < largest ? bucket_top(i) : largest;
+    }
+    return largest;
+  }
+
+  uint64_t p50(void) const { return percentile(0.5); }
+  uint64_t p99(void) const { return percentile(0.99); }
+  uint64_t p999(void) const { return percentile(0.999); }
+
+  // The bucket of value, and the largest value that falls into bucket i.
+  static int bucket(uint64_t value) {
+    if (value < 2 * SUB_BUCKETS)
+      return value;
+    int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + (int)(value >> shift);
+  }
+
+  static uint64_t bucket_top(int i) {
+    if (i < 2 * SUB_BUCKETS)
+      return i;
+    int shift = i / SUB_BUCKETS - 1;
+    uint64_t sub = i - shift * SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+  }
+
+private:
+  uint64_t counts[BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t smallest;
+  uint64_t largest;
+};
+
+// Threads record into one of a few stripes, each under a lock of its
+// own, so they seldom meet.  Reading merges the stripes.
+class shared_latency_histogram {
+public:
+  static const int STRIPES = 8;
+
+  void record(uint64_t value) {
+    stripe &s = stripes[std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPES];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.histogram.record(value);
+  }
+
+  latency_histogram merged(void) {
+    latency_histogram h;
+    for (int i = 0; i < STRIPES; i++) {
+      std::lock_guard<std::mutex> lock(stripes[i].mutex);
+      h.merge(stripes[i].histogram);
+    }
+    return h;
+  }
+
+private:
+  struct stripe {
+    std::mutex mutex;
+    latency_histogram histogram;
+  };
+  stripe stripes[STRIPES];
+};
+
+// Records the nanoseconds from its construction to its destruction.
+template<class Histogram>
+class latency_timer {
+public:
+  latency_timer(Histogram &h) : histogram(h), start(latency_now()) {}
+  ~latency_timer(void) { histogram.record(latency_now() - start); }
+  latency_timer(const latency_timer &) = delete;
+  latency_timer &operator=(const latency_timer &) = delete;
+private:
+  Histogram &histogram;
+  uint64_t start;
+};
+
+// A Prometheus summary of a histogram of nanoseconds, in seconds.
+inline void write_latency_summary(std::ostream &out, const char *name, const char *help,
+				  const latency_histogram &h)
+{
+  static const double quantiles[] = { 0.5, 0.99, 0.999, 1 };
+  write_metric_family(out, name, "summary", help);
+  for (double q : quantiles) {
+    std::ostringstream label;
+    label << "quantile=\"" << q << "\"";
+    write_metric_sample(out, name, h.percentile(q) / 1e9, label.str());
+  }
+  write_metric_sample(out, (std::string(name) + "_sum").c_str(), h.total_value() / 1e9);
+  write_metric_sample(out, (std::string(name) + "_count").c_str(), h.count());
+}
+
+#endif // LATENCY_HISTOGRAM_HPP
@@ -0,0 +1,73 @@
+// Counters in the Prometheus text exposition format, so a node
+// exporter's textfile collector (or anything else that reads the
+// format) can pick them up from a local file.
+//
+// A metric family is one header, then one sample per label set:
+//
+//   # HELP bepsilon_tree_flushes_total Buffers flushed, by cascade level.
+//   # TYPE bepsilon_tree_flushes_total counter
+//   bepsilon_tree_flushes_total{level="0"} 1234
+//   bepsilon_tree_flushes_total{level="1"} 56
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <ostream>
+#include <fstream>
+#include <iomanip>
+
+inline void write_metric_family(std::ostream &out, const char *name, const char *type,
+				const char *help)
+{
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+// labels is what goes between the braces, e.g. level="0", or empty.
+inline void write_metric_sample(std::ostream &out, const char *name, uint64_t value,
+				const std::string &labels = "")
+{
+  out << name;
+  if (!labels.empty())
+    out << "{" << labels << "}";
+  out << " " << value << "\n";
+}
+
+inline void write_metric_sample(std::ostream &out, const char *name, double value,
+				const std::string &labels = "")
+{
+  out << name;
+  if (!labels.empty())
+    out << "{" << labels << "}";
+  out << " " << std::setprecision(17) << value << std::setprecision(6) << "\n";
+}
+
+// A family with a single sample.
+template<class T>
+void write_metric(std::ostream &out, const char *name, const char *type, const char *help,
+		  T value)
+{
+  write_metric_family(out, name, type, help);
+  write_metric_sample(out, name, value);
+}
+
+// Replaces filename with text through a temporary file and a rename,
+// so a reader sees the old dump or the new one, never half of one.
+// Returns false if the file couldn't be written.
+inline bool write_metrics_file(const std::string &filename, const std::string &text)
+{
+  std::string tmp = filename + ".tmp";
+  {
+    std::ofstream out(tmp.c_str(), std::ios::out | std::ios::trunc);
+    out << text;
+    out.flush();
+    if (!out.good())
+      return false;
+  }
+  return std::rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+#endif // METRICS_HPP
@@ -0,0 +1,155 @@
+// Replacement policies for the swap_space cache.
+//
+// A policy only ever sees objects that are in memory and not pinned:
+// the swap_space hands an object to the policy when its last pin is
+// released and takes it back when it is pinned again, evicted or
+// freed.  Every access to an object happens under a pin, so "most
+// recently unpinned" is "most recently used", and pin, access and
+// victim selection are O(1) without any bookkeeping per access.
+//
+// The objects are linked into an intrusive circular list through their
+// replacement_hook, so inserting and removing an object never
+// allocates.
+//
+//   lru_policy:   evicts the object that was unpinned the longest ago.
+//   clock_policy: second chance.  An object that was used again since
+//                 the hand last passed it is skipped once.
+
+#ifndef REPLACEMENT_POLICY_HPP
+#define REPLACEMENT_POLICY_HPP
+
+#include <cstddef>
+#include <cassert>
+
+class replacement_hook {
+public:
+  replacement_hook(void) :
+    prev(NULL),
+    next(NULL),
+    referenced(false)
+  {}
+
+  bool is_linked(void) const { return next != NULL; }
+
+  replacement_hook *prev;
+  replacement_hook *next;
+  bool referenced;
+};
+
+// A circular doubly-linked list with a sentinel head.
+class replacement_list {
+public:
+  replacement_list(void) : count(0) {
+    head.prev = head.next = &head;
+  }
+
+  void push_back(replacement_hook *h) {
+    assert(!h->is_linked());
+    h->prev = head.prev;
+    h->next = &head;
+    head.prev->next = h;
+    head.prev = h;
+    count++;
+  }
+
+  void erase(replacement_hook *h) {
+    assert(h->is_linked());
+    h->prev->next = h->next;
+    h->next->prev = h->prev;
+    h->prev = h->next = NULL;
+    count--;
+  }
+
+  replacement_hook *front(void) {
+    return head.next == &head ? NULL : head.next;
+  }
+
+  // The first of the first k objects that pred accepts, front first,
+  // or NULL.
+  replacement_hook *find_first(size_t k, bool (*pred)(const replacement_hook *)) {
+    for (replacement_hook *h = head.next; h != &head && k > 0; h = h->next, k--)
+      if (pred(h))
+        return h;
+    return NULL;
+  }
+
+  size_t size(void) const { return count; }
+
+private:
+  replacement_hook head;
+  size_t count;
+};
+
+class replacement_policy {
+public:
+  virtual ~replacement_policy(void) {}
+
+  // h was just unpinned and is in memory.
+  virtual void insert(replacement_hook *h) = 0;
+
+  // h is pinned, evicted or freed.
+  virtual void remove(replacement_hook *h) = 0;
+
+  // The object to evict next, it stays in the policy until it is
+  // removed.  NULL when every object in memory is pinned.
+  virtual replacement_hook *victim(void) = 0;
+
+  // The first that pred accepts among the next k objects to evict,
+  // taken roughly in eviction order, or NULL.  The background writer
+  // looks for dirty ones to clean ahead of time, eviction for a clean
+  // one when the victim is dirty.  It stops at the first match and
+  // allocates nothing.
+  virtual replacement_hook *candidate(size_t k, bool (*pred)(const replacement_hook *)) = 0;
+
+  virtual size_t size(void) const = 0;
+};
+
+class lru_policy : public replacement_policy {
+public:
+  void insert(replacement_hook *h) { list.push_back(h); }
+  void remove(replacement_hook *h) { list.erase(h); }
+  replacement_hook *victim(void) { return list.front(); }
+  replacement_hook *candidate(size_t k, bool (*pred)(const replacement_hook *)) {
+    return list.find_first(k, pred);
+  }
+  size_t size(void) const { return list.size(); }
+
+private:
+  replacement_list list;
+};
+
+class clock_policy : public replacement_policy {
+public:
+  void insert(replacement_hook *h) {
+    h->referenced = true;
+    list.push_back(h);
+  }
+
+  void remove(replacement_hook *h) { list.erase(h); }
+
+  // The hand is the front of the list: a referenced object loses its
+  // bit and goes behind the hand.  Each object is passed at most once
+  // per call, so this is amortized O(1).
+  replacement_hook *victim(void) {
+    replacement_hook *h;
+    while ((h = list.front()) != NULL && h->referenced) {
+      h->referenced = false;
+      list.erase(h);
+      list.push_back(h);
+    }
+    return h;
+  }
+
+  // Behind the hand's next stop the order depends on the bits, the
+  // front of the list is close enough.
+  replacement_hook *candidate(size_t k, bool (*pred)(const replacement_hook *)) {
+    return list.find_first(k, pred);
+  }
+
+  size_t size(void) const { return list.size(); }
+
+private:
+  replacement_list list;
+};
+
+#endif // REPLACEMENT_POLICY_HPP
@@ -0,0 +1,98 @@
+// A readers-writer latch: any number of readers at once, or one
+// writer.  C++11 has no std::shared_mutex.
+//
+// Neither side starves the other.  A writer that waits keeps new
+// readers out, and the readers that waited for a writer all get in
+// before the next writer does, so a thread that writes in a loop still
+// lets the readers through after every write.
+
+#ifndef SHARED_LATCH_HPP
+#define SHARED_LATCH_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+class shared_latch {
+public:
+  shared_latch(void) :
+    readers(0),
+    writer(false),
+    waiting_readers(0),
+    waiting_writers(0),
+    admitted(0),
+    writes(0)
+  {}
+
+  void lock_shared(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t seen = writes;
+    waiting_readers++;
+    while (writer || (waiting_writers > 0 && writes == seen))
+      readable.wait(lock);
+    waiting_readers--;
+    if (admitted > 0)
+      admitted--;
+    readers++;
+  }
+
+  void unlock_shared(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (--readers == 0 && waiting_writers > 0)
+      writable.notify_all();
+  }
+
+  void lock(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting_writers++;
+    while (writer || readers > 0 || admitted > 0)
+      writable.wait(lock);
+    waiting_writers--;
+    writer = true;
+  }
+
+  void unlock(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    writer = false;
+    writes++;
+    admitted = waiting_readers;
+    readable.notify_all();
+    writable.notify_all();
+  }
+
+  // Both take a NULL latch for "no latching".
+  class read_guard {
+  public:
+    read_guard(shared_latch *l) : latch(l) { if (latch) latch->lock_shared(); }
+    ~read_guard(void) { if (latch) latch->unlock_shared(); }
+    read_guard(const read_guard &) = delete;
+    read_guard &operator=(const read_guard &) = delete;
+  private:
+    shared_latch *latch;
+  };
+
+  class write_guard {
+  public:
+    write_guard(shared_latch *l) : latch(l) { if (latch) latch->lock(); }
+    ~write_guard(void) { if (latch) latch->unlock(); }
+    write_guard(const write_guard &) = delete;
+    write_guard &operator=(const write_guard &) = delete;
+  private:
+    shared_latch *latch;
+  };
+
+private:
+  std::mutex	mutex;
+  std::condition_variable readable;
+  std::condition_variable writable;
+  uint64_t	readers;
+  bool		writer;
+  uint64_t	waiting_readers;
+  uint64_t	waiting_writers;
+  // Readers that waited for the last writer and are not in yet, the
+  // next writer waits for them.
+  uint64_t	admitted;
+  uint64_t	writes;
+};
+
+#endif // SHARED_LATCH_HPP
@@ -1,44 +1,66 @@
 #include "swap_space.hpp"
+#include "metrics.hpp"
 
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x)
 {
-  fs << x << " ";
+  if (context.format == BINARY_FORMAT)
+    write_raw(fs, x);
+  else
+    fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 {
-  fs >> x;
+  if (context.format == BINARY_FORMAT)
+    read_raw(fs, x);
+  else
+    fs >> x;
   assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, int64_t x)
 {
-  fs << x << " ";
+  if (context.format == BINARY_FORMAT)
+    write_raw(fs, x);
+  else
+    fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x)
 {
-  fs >> x;
+  if (context.format == BINARY_FORMAT)
+    read_raw(fs, x);
+  else
+    fs >> x;
   assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, int x)
 {
-    fs << x << " ";
+    if (context.format == BINARY_FORMAT)
+        write_raw(fs, x);
+    else
+        fs << x << " ";
     assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, int &x)
 {
-    fs >> x;
+    if (context.format == BINARY_FORMAT)
+        read_raw(fs, x);
+    else
+        fs >> x;
     assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, std::string x)
 {
-  fs << x.size() << ",";
+  if (context.format == BINARY_FORMAT)
+    write_raw(fs, (uint64_t)x.size());
+  else
+    fs << x.size() << ",";
   assert(fs.good());
   fs.write(x.data(), x.size());
   assert(fs.good());
@@ -46,95 +68,635 @@ void serialize(std::iostream &fs, serialization_context &context, std::string x)
 
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
 {
-  size_t length;
-  char comma;
-  fs >> length >> comma;
+  uint64_t length;
+  if (context.format == BINARY_FORMAT) {
+    read_raw(fs, length);
+  } else {
+    char comma;
+    fs >> length >> comma;
+  }
   assert(fs.good());
-  char *buf = new char[length];
-  assert(buf);
-  fs.read(buf, length);
+  x.resize(length);
+  fs.read(&x[0], length);
   assert(fs.good());
-  x = std::string(buf, length);
-  delete buf;
 }
 
-bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b) {
-  return a->last_access < b->last_access;
-}
-
-swap_space::swap_space(backing_store *bs, uint64_t n) :
+swap_space::swap_space(backing_store *bs, uint64_t n, serialization_format fmt,
+                       uint64_t max_bytes) :
   backstore(bs),
+  format(fmt),
   max_in_memory_objects(n),
+  max_in_memory_bytes(max_bytes),
   objects(),
-  lru_pqueue(cmp_by_last_access)
+  policy(&default_policy)
 {}
 
+swap_space::~swap_space(void)
+{
+  stop_background_writeback();
+}
+
 swap_space::object::object(swap_space *sspace, serializable * tgt) {
   target = tgt;
   id = sspace->next_id++;
   bsid = 0;
+  bytes = 0;
+  image_bytes = 0;
+  stored_bytes = 0;
+  preserved_snapshot = sspace->last_snapshot;
   is_leaf = false;
   refcount = 1;
-  last_access = sspace->next_access_time++;
   target_is_dirty = true;
+  dirty_generation = 0;
   pincount = 0;
+  loading = false;
 }
 
 void swap_space::set_cache_size(uint64_t sz) {
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
   assert(sz > 0);
   max_in_memory_objects = sz;
   maybe_evict_something();
 }
 
-void swap_space::write_back(swap_space::object *obj)
+void swap_space::set_cache_bytes(uint64_t max_bytes) {
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  max_in_memory_bytes = max_bytes;
+  maybe_evict_something();
+}
+
+void swap_space::measure(swap_space::object *obj)
+{
+  assert(obj->target != NULL);
+  uint64_t bytes = obj->target->_memory_size();
+  if (bytes == 0)
+    bytes = obj->image_bytes;
+  bytes += sizeof(object);
+  current_bytes = current_bytes - obj->bytes + bytes;
+  obj->bytes = bytes;
+  if (current_bytes > peak_bytes)
+    peak_bytes = current_bytes;
+}
+
+swap_space_stats swap_space::stats(void)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  swap_space_stats s;
+  s.hits = hit_count;
+  s.misses = miss_count;
+  s.loads = load_count;
+  s.compressed_hits = compressed_hit_count;
+  s.bytes_read = bytes_read;
+  s.write_backs = write_back_count;
+  s.background_writes = background_write_count;
+  s.bytes_written = bytes_written;
+  s.evictions = eviction_count;
+  s.dirty_evictions = dirty_eviction_count;
+  s.pin_waits = pin_wait_count;
+  s.pin_wait_ns = pin_wait_ns;
+  s.resident_objects = current_in_memory_objects;
+  s.resident_bytes = current_bytes;
+  s.compressed_bytes = current_compressed_bytes;
+  s.snapshot_bytes = version_bytes;
+  return s;
+}
+
+swap_space_latencies swap_space::latencies(void)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  swap_space_latencies l;
+  l.load = load_latency;
+  l.write_back = write_back_latency;
+  return l;
+}
+
+void swap_space::write_metrics(std::ostream &out)
+{
+  swap_space_stats s = stats();
+  swap_space_latencies l = latencies();
+  write_metric(out, "bepsilon_cache_hits_total", "counter",
+               "Object accesses that found the object in memory.", s.hits);
+  write_metric(out, "bepsilon_cache_misses_total", "counter",
+               "Object accesses that had to load the object.", s.misses);
+  write_metric(out, "bepsilon_cache_loads_total", "counter",
+               "Objects read from the backing store.", s.loads);
+  write_metric(out, "bepsilon_cache_compressed_hits_total", "counter",
+               "Objects loaded from the compressed tier.", s.compressed_hits);
+  write_metric(out, "bepsilon_cache_read_bytes_total", "counter",
+               "Bytes of the pages read from the backing store.", s.bytes_read);
+  write_metric(out, "bepsilon_cache_write_backs_total", "counter",
+               "Object images written to the backing store.", s.write_backs);
+  write_metric(out, "bepsilon_cache_background_writes_total", "counter",
+               "Object images the background writer wrote and kept.", s.background_writes);
+  write_metric(out, "bepsilon_cache_written_bytes_total", "counter",
+               "Bytes of the pages written to the backing store.", s.bytes_written);
+  write_metric(out, "bepsilon_cache_evictions_total", "counter",
+               "Objects dropped from memory.", s.evictions);
+  write_metric(out, "bepsilon_cache_dirty_evictions_total", "counter",
+               "Evicted objects that were dirty.", s.dirty_evictions);
+  write_metric(out, "bepsilon_cache_pin_waits_total", "counter",
+               "Pins that waited for another thread.", s.pin_waits);
+  write_metric(out, "bepsilon_cache_pin_wait_seconds_total", "counter",
+               "Time pins spent waiting for another thread.", s.pin_wait_ns / 1e9);
+  write_metric(out, "bepsilon_cache_resident_objects", "gauge",
+               "Objects in memory.", s.resident_objects);
+  write_metric(out, "bepsilon_cache_resident_bytes", "gauge",
+               "Bytes of the objects in memory.", s.resident_bytes);
+  write_metric(out, "bepsilon_cache_compressed_bytes", "gauge",
+               "Bytes in the compressed tier.", s.compressed_bytes);
+  write_metric(out, "bepsilon_cache_snapshot_bytes", "gauge",
+               "Bytes of the copies kept for snapshots, on the backing store.", s.snapshot_bytes);
+  write_latency_summary(out, "bepsilon_cache_load_seconds",
+                        "Time from a miss to the object in memory.", l.load);
+  write_latency_summary(out, "bepsilon_cache_write_back_seconds",
+                        "Time to write an object image to the backing store.", l.write_back);
+}
+
+void swap_space::set_replacement_policy(replacement_policy *p)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  if (p == NULL)
+    p = &default_policy;
+  if (p == policy)
+    return;
+  replacement_hook *h;
+  while ((h = policy->victim()) != NULL) {
+    policy->remove(h);
+    p->insert(h);
+  }
+  policy = p;
+}
+
+void swap_space::sync(void)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  write_dirty();
+  std::unique_lock<std::mutex> io = io_guard();
+  backstore->sync();
+}
+
+void swap_space::write_dirty(void)
+{
+  for (auto it = objects.begin(); it != objects.end(); ++it) {
+    object *obj = it->second;
+    if (obj->target && obj->target_is_dirty) {
+      write_back(obj, false);
+    } else if (!obj->target && obj->target_is_dirty) {
+      // In the compressed tier, it keeps its compressed copy.
+      std::string image;
+      decompress(obj, image);
+      write_image(obj, image);
+    }
+  }
+}
+
+uint64_t swap_space::take_snapshot(void)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  live_snapshots.insert(++last_snapshot);
+  return last_snapshot;
+}
+
+// A copy keyed k, with the previous copy of the object keyed p, is read
+// by the snapshots numbered (p, k].  It goes once none of them is live.
+// Only copies keyed from snapshot up to the next live snapshot can go:
+// that one reads every later copy.  Of those, the ones whose range
+// starts at or after the previous live snapshot have no reader left.
+void swap_space::release_snapshot(uint64_t snapshot)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  auto s = live_snapshots.find(snapshot);
+  assert(s != live_snapshots.end());
+  s = live_snapshots.erase(s);
+  uint64_t next = s == live_snapshots.end() ? UINT64_MAX : *s;
+  uint64_t previous = s == live_snapshots.begin() ? 0 : *std::prev(s);
+  auto k = versions_by_snapshot.lower_bound(snapshot);
+  while (k != versions_by_snapshot.end() && k->first < next) {
+    std::vector<uint64_t> &ids = k->second;
+    size_t kept = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+      auto v = versions.find(ids[i]);
+      auto it = v->second.find(k->first);
+      assert(it != v->second.end());
+      uint64_t from = it == v->second.begin() ? 0 : std::prev(it)->first;
+      if (from < previous) {
+        ids[kept++] = ids[i];
+        continue;
+      }
+      version_bytes -= it->second.bytes;
+      {
+        std::unique_lock<std::mutex> io = io_guard();
+        backstore->deallocate(it->second.bsid);
+      }
+      v->second.erase(it);
+      if (v->second.empty())
+        versions.erase(v);
+    }
+    ids.resize(kept);
+    if (ids.empty())
+      k = versions_by_snapshot.erase(k);
+    else
+      ++k;
+  }
+}
+
+// Copies obj as it is now, before it is changed or freed, for the live
+// snapshots that have no copy of it yet, onto a block of its own.  It
+// may be in memory, in the compressed tier or only on the backing
+// store, whose page is copied as it is.
+void swap_space::preserve(swap_space::object *obj)
+{
+  std::string page;
+  if (obj->target) {
+    serialization_context ctxt(*this, format);
+    ctxt.detach = false;
+    std::stringstream sstream;
+    serialize(sstream, ctxt, *obj->target);
+    backstore->encode_page(sstream.str(), page);
+  } else if (obj->is_linked()) {
+    std::string image;
+    decompress(obj, image);
+    backstore->encode_page(image, page);
+  }
+  std::unique_lock<std::mutex> io = io_guard();
+  if (page.empty()) {
+    size_t length;
+    const char *data = backstore->view(obj->bsid, length);
+    if (data != NULL)
+      page.assign(data, length);
+    else
+      backstore->read(obj->bsid, page);
+  }
+  uint64_t newest = *live_snapshots.rbegin();
+  version copy;
+  copy.bsid = backstore->allocate(page.length());
+  copy.bytes = page.length();
+  backstore->write(copy.bsid, page);
+  version_bytes += copy.bytes;
+  versions[obj->id][newest] = copy;
+  versions_by_snapshot[newest].push_back(obj->id);
+  obj->preserved_snapshot = newest;
+}
+
+// A block of the last checkpoint is reused only after the next one.
+// Called under the io lock.
+void swap_space::free_block(uint64_t bsid)
+{
+  if (checkpoint_blocks.count(bsid) > 0)
+    deferred_frees.push_back(bsid);
+  else
+    backstore->deallocate(bsid);
+}
+
+// superblock: magic, version, format, next id, the object table (id,
+// bsid, stored_bytes, image_bytes, refcount, is_leaf for each object)
+// and the caller's state.  It goes through the store's page encoding
+// like any object image.
+static const uint64_t SUPERBLOCK_MAGIC = 0x4b4c425245505553ULL; // "SUPERBLK"
+static const uint32_t SUPERBLOCK_VERSION = 1;
+
+void swap_space::checkpoint(const std::string &state)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  write_dirty();
+
+  std::stringstream sb;
+  write_raw(sb, SUPERBLOCK_MAGIC);
+  write_raw(sb, SUPERBLOCK_VERSION);
+  write_raw(sb, (uint8_t)format);
+  write_raw(sb, next_id);
+  write_raw(sb, (uint64_t)objects.size());
+  for (auto it = objects.begin(); it != objects.end(); ++it) {
+    object *obj = it->second;
+    assert(obj->bsid > 0);
+    write_raw(sb, obj->id);
+    write_raw(sb, obj->bsid);
+    write_raw(sb, obj->stored_bytes);
+    write_raw(sb, obj->image_bytes);
+    write_raw(sb, obj->refcount);
+    write_raw(sb, (uint8_t)obj->is_leaf);
+  }
+  write_raw(sb, (uint64_t)state.length());
+  sb.write(state.data(), state.length());
+  std::string page;
+  backstore->encode_page(sb.str(), page);
+
+  std::unique_lock<std::mutex> io = io_guard();
+  backstore->sync();
+  backstore->write_superblock(page);
+
+  // The last checkpoint is superseded, what it alone referred to is free.
+  for (size_t i = 0; i < deferred_frees.size(); i++)
+    backstore->deallocate(deferred_frees[i]);
+  deferred_frees.clear();
+  checkpoint_blocks.clear();
+  for (auto it = objects.begin(); it != objects.end(); ++it)
+    checkpoint_blocks.insert(it->second->bsid);
+}
+
+bool swap_space::open(std::string &state)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  assert(objects.empty());
+  std::unique_lock<std::mutex> io = io_guard();
+  std::vector<std::pair<uint64_t, uint64_t> > live;
+  std::string page, buf;
+  if (!backstore->read_superblock(page)) {
+    backstore->recover(live);
+    return false;
+  }
+  size_t length;
+  const char *data = backstore->decode_page(page.data(), page.length(), buf, length);
+  assert(data != NULL);
+  view_streambuf vsb(data, length);
+  std::iostream sb(&vsb);
+
+  uint64_t magic, last_id, count;
+  uint32_t version;
+  uint8_t fmt;
+  read_raw(sb, magic);
+  read_raw(sb, version);
+  assert(magic == SUPERBLOCK_MAGIC && version == SUPERBLOCK_VERSION);
+  // The images are in the format they were written in.
+  read_raw(sb, fmt);
+  format = (serialization_format)fmt;
+  read_raw(sb, last_id);
+  read_raw(sb, count);
+  for (uint64_t i = 0; i < count; i++) {
+    object *obj = new object(this, NULL);
+    uint8_t leaf;
+    read_raw(sb, obj->id);
+    read_raw(sb, obj->bsid);
+    read_raw(sb, obj->stored_bytes);
+    read_raw(sb, obj->image_bytes);
+    read_raw(sb, obj->refcount);
+    read_raw(sb, leaf);
+    obj->is_leaf = leaf;
+    obj->target_is_dirty = false;
+    objects[obj->id] = obj;
+    checkpoint_blocks.insert(obj->bsid);
+    live.push_back(std::make_pair(obj->bsid, obj->stored_bytes));
+  }
+  uint64_t state_length;
+  read_raw(sb, state_length);
+  state.resize(state_length);
+  sb.read(&state[0], state_length);
+  assert(sb.good() || state_length == 0);
+  next_id = last_id;
+  backstore->recover(live);
+  return true;
+}
+
+// Takes the image of a clean object that is evicted, the pointers in
+// it still have to hand their references over but the bytes are
+// already on the backing store.
+class discard_streambuf : public std::streambuf {
+protected:
+  std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+  int overflow(int c) { return traits_type::not_eof(c); }
+};
+
+void swap_space::write_back(swap_space::object *obj, bool evict)
 {
   assert(objects.count(obj->id) > 0);
 
   debug(std::cout << "Writing back " << obj->id
-	<< " (" << obj->target << ") "
-	<< "with last access time " << obj->last_access << std::endl);
+	<< " (" << obj->target << ")" << std::endl);
 
   // This calls _serialize on all the pointers in this object,
   // which keeps refcounts right later on when we delete them all.
   // In the future, we may also use this to implement in-memory
   // evictions, i.e. where we first "evict" an object by
   // compressing it and keeping the compressed version in memory.
-  serialization_context ctxt(*this);
+  serialization_context ctxt(*this, format);
+  ctxt.detach = evict;
+  if (!obj->target_is_dirty) {
+    assert(evict && obj->bsid > 0);
+    discard_streambuf discard;
+    std::iostream sink(&discard);
+    serialize(sink, ctxt, *obj->target);
+    obj->is_leaf = ctxt.is_leaf;
+    return;
+  }
+  std::stringstream sstream;
+  serialize(sstream, ctxt, *obj->target);
+  obj->is_leaf = ctxt.is_leaf;
+
+  write_image(obj, sstream.str());
+}
+
+void swap_space::write_image(swap_space::object *obj, const std::string &image)
+{
+  uint64_t start = latency_now();
+  std::string page;
+  backstore->encode_page(image, page);
+  std::unique_lock<std::mutex> io = io_guard();
+  uint64_t bsid = backstore->allocate(page.length());
+  backstore->write(bsid, page);
+  write_back_count++;
+  bytes_written += page.length();
+  write_back_latency.record(latency_now() - start);
+  obj->image_bytes = image.length();
+  obj->stored_bytes = page.length();
+  if (obj->bsid > 0)
+    free_block(obj->bsid);
+  obj->bsid = bsid;
+  obj->target_is_dirty = false;
+}
+
+// Out of the policy when the object is in memory, out of the
+// compressed tier otherwise.
+void swap_space::unlink(swap_space::object *obj)
+{
+  if (obj->target) {
+    policy->remove(obj);
+  } else {
+    compressed_tier.erase(obj);
+    current_compressed_bytes -= obj->compressed.size();
+    std::string().swap(obj->compressed);
+  }
+}
+
+// Takes the image of an object that is being evicted, its pointers
+// hand their references over, and keeps it compressed.  A dirty object
+// stays dirty: the backing store doesn't have this image yet.
+void swap_space::compress_out(swap_space::object *obj)
+{
+  serialization_context ctxt(*this, format);
+  ctxt.detach = true;
   std::stringstream sstream;
   serialize(sstream, ctxt, *obj->target);
   obj->is_leaf = ctxt.is_leaf;
+  std::string image = sstream.str();
+  obj->image_bytes = image.length();
+  lz_compress(image.data(), image.length(), obj->compressed);
+  obj->compressed.shrink_to_fit();
+  compressed_tier.push_back(obj);
+  current_compressed_bytes += obj->compressed.size();
+}
 
+void swap_space::decompress(swap_space::object *obj, std::string &image)
+{
+  image.resize(obj->image_bytes);
+  bool ok = lz_decompress(obj->compressed.data(), obj->compressed.length(),
+                          &image[0], image.length());
+  assert(ok);
+  (void)ok;
+}
+
+// Out of the compressed tier and onto the backing store.
+void swap_space::demote(swap_space::object *obj)
+{
   if (obj->target_is_dirty) {
-    std::string buffer = sstream.str();
-    uint64_t bsid = backstore->allocate(buffer.length());
-    std::iostream *out = backstore->get(bsid);
-    out->write(buffer.data(), buffer.length());
-    backstore->put(out);
-    if (obj->bsid > 0)
-      backstore->deallocate(obj->bsid);
-    obj->bsid = bsid;
-    obj->target_is_dirty = false;
+    std::string image;
+    decompress(obj, image);
+    write_image(obj, image);
   }
+  unlink(obj);
+}
+
+void swap_space::set_compressed_cache_bytes(uint64_t max_bytes)
+{
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  max_compressed_bytes = max_bytes;
+  replacement_hook *h;
+  while (current_compressed_bytes > max_compressed_bytes &&
+         (h = compressed_tier.front()) != NULL)
+    demote(static_cast<object *>(h));
+}
+
+// The policy's victim, unless it is dirty while the background writer
+// runs: then the first clean one of the next low_water candidates.
+// While the writer keeps the victim clean that is O(1).  The search
+// stops at the first clean candidate, and one that finds none isn't
+// repeated until the writer has cleaned something.  A dirty victim
+// wakes the writer up.
+swap_space::object *swap_space::pick_victim(void)
+{
+  object *obj = static_cast<object *>(policy->victim());
+  if (obj != NULL && obj->target_is_dirty && writer_running && clean_candidates) {
+    replacement_hook *h = policy->candidate(writeback_low_water, is_clean);
+    if (h != NULL)
+      return static_cast<object *>(h);
+    clean_candidates = false;
+  }
+  if (obj != NULL && obj->target_is_dirty) {
+    dirty_eviction_count++;
+    if (writer_running)
+      writer_wakeup.notify_one();
+  }
+  return obj;
 }
 
 void swap_space::maybe_evict_something(void)
 {
-  while (current_in_memory_objects > max_in_memory_objects) {
-    object *obj = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it)
-      if ((*it)->pincount == 0) {
-	obj = *it;
-	break;
-      }
+  std::unique_lock<std::recursive_mutex> guard = state_guard();
+  while (current_in_memory_objects > max_in_memory_objects ||
+         (max_in_memory_bytes > 0 && current_bytes > max_in_memory_bytes)) {
+    object *obj = pick_victim();
     if (obj == NULL)
       return;
-    lru_pqueue.erase(obj);
+    policy->remove(obj);
 
-    write_back(obj);
+    if (max_compressed_bytes > 0)
+      compress_out(obj);
+    else
+      write_back(obj, true);
     
     delete obj->target;
     obj->target = NULL;
     current_in_memory_objects--;
+    current_bytes -= obj->bytes;
+    obj->bytes = 0;
+    eviction_count++;
   }
+  replacement_hook *h;
+  while (current_compressed_bytes > max_compressed_bytes &&
+         (h = compressed_tier.front()) != NULL)
+    demote(static_cast<object *>(h));
 }
 
+
+void swap_space::start_background_writeback(uint64_t low_water, unsigned interval_ms)
+{
+  assert(low_water > 0);
+  stop_background_writeback();
+  writeback_low_water = low_water;
+  writeback_interval_ms = interval_ms;
+  writer_stopping = false;
+  writer_running = true;
+  writer = std::thread(&swap_space::background_writeback, this);
+}
+
+void swap_space::stop_background_writeback(void)
+{
+  if (!writer_running)
+    return;
+  {
+    std::unique_lock<std::recursive_mutex> guard(state_mutex);
+    writer_stopping = true;
+  }
+  writer_wakeup.notify_one();
+  writer.join();
+  writer_running = false;
+}
+
+// The image is taken under the state lock: the object is unpinned, so
+// nothing changes it, and pinning it has to wait for the lock.  The
+// write itself runs without the state lock.  The image replaces the
+// object's block only if the object wasn't dirtied again in the
+// meantime, otherwise the new block is dropped.
+void swap_space::background_writeback(void)
+{
+  std::unique_lock<std::recursive_mutex> state(state_mutex);
+  while (!writer_stopping) {
+    object *obj = static_cast<object *>(policy->candidate(writeback_low_water, is_dirty));
+    if (obj == NULL) {
+      writer_wakeup.wait_for(state, std::chrono::milliseconds(writeback_interval_ms));
+      continue;
+    }
+
+    uint64_t id = obj->id;
+    uint64_t generation = obj->dirty_generation;
+    serialization_context ctxt(*this, format);
+    ctxt.detach = false;
+    std::stringstream sstream;
+    serialize(sstream, ctxt, *obj->target);
+    state.unlock();
+
+    uint64_t start = latency_now();
+    std::string buffer = sstream.str();
+    std::string page;
+    backstore->encode_page(buffer, page);
+    uint64_t bsid;
+    {
+      std::unique_lock<std::mutex> io(io_mutex);
+      bsid = backstore->allocate(page.length());
+      backstore->write(bsid, page);
+    }
+    uint64_t elapsed = latency_now() - start;
+
+    state.lock();
+    auto it = objects.find(id);
+    std::unique_lock<std::mutex> io(io_mutex);
+    // Written either way, the block is dropped right away if it's stale.
+    write_back_count++;
+    bytes_written += page.length();
+    write_back_latency.record(elapsed);
+    if (it != objects.end() && it->second->target_is_dirty &&
+        it->second->dirty_generation == generation) {
+      obj = it->second;
+      if (obj->bsid > 0)
+        free_block(obj->bsid);
+      obj->bsid = bsid;
+      obj->image_bytes = buffer.length();
+      obj->stored_bytes = page.length();
+      obj->is_leaf = ctxt.is_leaf;
+      obj->target_is_dirty = false;
+      background_write_count++;
+      clean_candidates = true;
+    } else {
+      backstore->deallocate(bsid);
+    }
+  }
+}
@@ -43,12 +43,35 @@
 // memory.  Thus, during the execution of some_method(), it is safe to
 // dereference "this" and any other plain C++ pointers in the object.
 
+// start_background_writeback() starts a thread that writes dirty
+// objects out before they are evicted, so eviction can usually just
+// drop a clean object.  The swap_space itself is still used by one
+// thread at a time; the writer shares its state under a lock that is
+// only taken while the writer runs.
+
+// Going through a non-const pointer or pin marks the object dirty, so
+// it is written back when it is evicted.  Readers use a const pointer
+// or p.read_pin(), which only give const access and leave the object
+// clean.  A clean object is evicted without writing anything.
+
 // Objects are automatically garbage collected.  The garbage collector
 // uses reference counting.
 
-// The current system uses LRU to select items to swap.  The swap
-// space has a user-specified in-memory cache size it.  The cache size
-// can be adjusted dynamically.
+// The swap space has a user-specified in-memory cache size: a number
+// of objects and, optionally, a number of bytes.  Objects are evicted
+// while either one is exceeded.  An object's bytes are what its
+// _memory_size() reports, measured whenever its last pin is released,
+// or the size of its last on-disk image when it doesn't report one.
+// Both limits can be adjusted dynamically.
+
+// With set_compressed_cache_bytes() an evicted object first goes to a
+// second, compressed tier in memory (see compress.hpp), with a byte
+// budget of its own.  Loading it from there needs no I/O.  Only when
+// it falls out of that tier, oldest first, is it written to the
+// backing store, and only if the store doesn't have it already.
+
+// A replacement_policy picks the object to evict among the unpinned
+// ones, LRU unless another one is set; see replacement_policy.hpp.
 
 // Don't try to get your hands on an unwrapped pointer to the object
 // or anything that is swapped in/out as part of the object.  It can
@@ -63,49 +86,102 @@
 // a few basic types and STL containers.  Feel free to add more and
 // submit patches as you need them.
 
-// The current implementation serializes to a textual file format.
-// This is just a convenience.  It would be nice to be able to swap in
-// different formats.
+// Two on-disk formats are supported, selected when the swap_space is
+// constructed.  The textual format labels every field and is handy
+// for debugging.  The binary format writes native-endian fixed-width
+// integers and length-prefixed arrays, and copies arrays of
+// arithmetic types with a single write, so that eviction and reload
+// cost about as much as a memcpy.  Binary images are not portable
+// between hosts of different endianness.
 
 #ifndef SWAP_SPACE_HPP
 #define SWAP_SPACE_HPP
 
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
-#include <vector>
 #include <set>
+#include <vector>
 #include <functional>
+#include <type_traits>
 #include <sstream>
 #include <cassert>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <ostream>
 #include "backing_store.hpp"
+#include "replacement_policy.hpp"
+#include "compress.hpp"
+#include "latency_histogram.hpp"
 #include "debug.hpp"
 
 class swap_space;
 
+typedef enum {
+    TEXT_FORMAT,
+    BINARY_FORMAT
+} serialization_format;
+
 class serialization_context {
 public:
-    serialization_context(swap_space &sspace) :
+    serialization_context(swap_space &sspace, serialization_format fmt = TEXT_FORMAT) :
             ss(sspace),
-            is_leaf(true)
+            is_leaf(true),
+            format(fmt),
+            detach(true),
+            weak(false),
+            locked(true)
     {}
     swap_space &ss;
     bool is_leaf;
+    serialization_format format;
+    // Set when the object is serialized because it is about to be
+    // evicted: its swap_space::pointers then hand their reference over
+    // to the serialized copy.  Cleared when the object stays in memory.
+    bool detach;
+    // Set when an old version is read for a snapshot: its
+    // swap_space::pointers only name objects and hold no references.
+    bool weak;
+    // Cleared when the object is loaded without the state lock, the
+    // object table isn't looked at then.
+    bool locked;
 };
 
 class serializable {
 public:
     virtual void _serialize(std::iostream &fs, serialization_context &context) = 0;
     virtual void _deserialize(std::iostream &fs, serialization_context &context) = 0;
+    // The bytes this object takes in memory, counted against the byte
+    // budget of its swap_space.  0 means unknown.
+    virtual uint64_t _memory_size(void) const { return 0; }
     virtual ~serializable(void) {};
 };
 
+// Raw native-endian reads and writes used by the binary format.
+template<class T> void write_raw(std::iostream &fs, const T &x)
+{
+    fs.write((const char *)&x, sizeof(T));
+    assert(fs.good());
+}
+
+template<class T> void read_raw(std::iostream &fs, T &x)
+{
+    fs.read((char *)&x, sizeof(T));
+    assert(fs.good());
+}
+
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x);
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x);
 
 void serialize(std::iostream &fs, serialization_context &context, int64_t x);
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x);
 
+void serialize(std::iostream &fs, serialization_context &context, int x);
+void deserialize(std::iostream &fs, serialization_context &context, int &x);
+
 void serialize(std::iostream &fs, serialization_context &context, std::string x);
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x);
 
@@ -113,6 +189,15 @@ template<class Key, class Value> void serialize(std::iostream &fs,
                                                 serialization_context &context,
                                                 std::map<Key, Value> &mp)
 {
+    if (context.format == BINARY_FORMAT) {
+        write_raw(fs, (uint64_t)mp.size());
+        for (auto it = mp.begin(); it != mp.end(); ++it) {
+            Key k = it->first;
+            serialize(fs, context, k);
+            serialize(fs, context, it->second);
+        }
+        return;
+    }
     fs << "map " << mp.size() << " {" << std::endl;
     assert(fs.good());
     for (auto it = mp.begin(); it != mp.end(); ++it) {
@@ -129,6 +214,18 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
                                                   serialization_context &context,
                                                   std::map<Key, Value> &mp)
 {
+    if (context.format == BINARY_FORMAT) {
+        uint64_t size;
+        read_raw(fs, size);
+        for (uint64_t i = 0; i < size; i++) {
+            Key k;
+            Value v;
+            deserialize(fs, context, k);
+            deserialize(fs, context, v);
+            mp[k] = v;
+        }
+        return;
+    }
     std::string dummy;
     int size = 0;
     fs >> dummy >> size >> dummy;
@@ -144,10 +241,61 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
     fs >> dummy;
 }
 
+// Arrays of arithmetic types are copied in one piece in the binary
+// format; anything else is written element by element.
+template<class Key> void serialize_array(std::iostream &fs,
+                                         serialization_context &context,
+                                         std::vector<Key> &v,
+                                         std::true_type)
+{
+    fs.write((const char *)v.data(), v.size() * sizeof(Key));
+    assert(fs.good());
+}
+
+template<class Key> void serialize_array(std::iostream &fs,
+                                         serialization_context &context,
+                                         std::vector<Key> &v,
+                                         std::false_type)
+{
+    for (auto it = v.begin(); it != v.end(); ++it)
+        serialize(fs, context, (*it));
+}
+
+template<class Key> void deserialize_array(std::iostream &fs,
+                                           serialization_context &context,
+                                           std::vector<Key> &v,
+                                           uint64_t size,
+                                           std::true_type)
+{
+    size_t base = v.size();
+    v.resize(base + size);
+    fs.read((char *)(v.data() + base), size * sizeof(Key));
+    assert(fs.good());
+}
+
+template<class Key> void deserialize_array(std::iostream &fs,
+                                           serialization_context &context,
+                                           std::vector<Key> &v,
+                                           uint64_t size,
+                                           std::false_type)
+{
+    v.reserve(v.size() + size);
+    for (uint64_t i = 0; i < size; i++) {
+        // In place: copying a swap_space::pointer takes the state lock.
+        v.emplace_back();
+        deserialize(fs, context, v.back());
+    }
+}
+
 template<class Key> void serialize(std::iostream &fs,
                                    serialization_context &context,
                                    std::vector<Key> &v)
 {
+    if (context.format == BINARY_FORMAT) {
+        write_raw(fs, (uint64_t)v.size());
+        serialize_array(fs, context, v, typename std::is_arithmetic<Key>::type());
+        return;
+    }
     fs << "vector " << v.size() << " {" << std::endl;
     assert(fs.good());
     for (auto it = v.begin(); it != v.end(); ++it) {
@@ -161,6 +309,12 @@ template<class Key> void deserialize(std::iostream &fs,
                                      serialization_context &context,
                                      std::vector<Key> &v)
 {
+    if (context.format == BINARY_FORMAT) {
+        uint64_t size;
+        read_raw(fs, size);
+        deserialize_array(fs, context, v, size, typename std::is_arithmetic<Key>::type());
+        return;
+    }
     std::string dummy;
     int size = 0;
     fs >> dummy >> size >> dummy;
@@ -175,16 +329,19 @@ template<class Key> void deserialize(std::iostream &fs,
 
 template<class X> void serialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-    fs << "pointer ";
+    if (context.format == TEXT_FORMAT)
+        fs << "pointer ";
     serialize(fs, context, *x);
 }
 
 template<class X> void deserialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-    std::string dummy;
     x = new X;
-    fs >> dummy;
-    assert (dummy == "pointer");
+    if (context.format == TEXT_FORMAT) {
+        std::string dummy;
+        fs >> dummy;
+        assert (dummy == "pointer");
+    }
     deserialize(fs, context, *x);
 }
 
@@ -198,9 +355,60 @@ template<class X> void deserialize(std::iostream &fs, serialization_context &con
     x._deserialize(fs, context);
 }
 
+// A read-only streambuf over a range of memory.  swap_space::load
+// uses it to deserialize objects straight out of a backing store's
+// view without copying the bytes into a stream first.
+class view_streambuf : public std::streambuf {
+public:
+    view_streambuf(const char *data, size_t length) {
+        char *p = const_cast<char *>(data);
+        setg(p, p, p + length);
+    }
+};
+
+// What a swap_space has done since it was created, see
+// swap_space::stats().  A hit is an access to an object in memory, a
+// miss one that had to load it: from the compressed tier (a compressed
+// hit) or from the backing store (a load).  Bytes are those of the
+// pages on the store.
+struct swap_space_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t loads = 0;
+    uint64_t compressed_hits = 0;
+    uint64_t bytes_read = 0;
+    // Images written to the backing store, by eviction, sync,
+    // checkpoint or the background writer.
+    uint64_t write_backs = 0;
+    uint64_t background_writes = 0;
+    uint64_t bytes_written = 0;
+    // Objects dropped from memory, and those of them that were dirty.
+    uint64_t evictions = 0;
+    uint64_t dirty_evictions = 0;
+    // Pins that waited for another thread, and how long in total.
+    uint64_t pin_waits = 0;
+    uint64_t pin_wait_ns = 0;
+    uint64_t resident_objects = 0;
+    uint64_t resident_bytes = 0;
+    uint64_t compressed_bytes = 0;
+    uint64_t snapshot_bytes = 0;
+};
+
+// How long loads and write-backs took, in nanoseconds.  A load is
+// counted from the miss to the object in memory, from the compressed
+// tier or the backing store; a write-back from the image to the page
+// on the store.
+struct swap_space_latencies {
+    latency_histogram load;
+    latency_histogram write_back;
+};
+
 class swap_space {
 public:
-    swap_space(backing_store *bs, uint64_t n);
+    // n objects and, when max_bytes isn't 0, max_bytes bytes in memory.
+    swap_space(backing_store *bs, uint64_t n, serialization_format fmt = BINARY_FORMAT,
+               uint64_t max_bytes = 0);
+    ~swap_space(void);
 
     template<class Referent> class pointer;
 
@@ -216,19 +424,13 @@ public:
     class pin {
     public:
         const Referent * operator->(void) const {
-            assert(ss->objects.count(target) > 0);
-            debug(std::cout << "Accessing (constly) " << target
-                            << " (" << ss->objects[target]->target << ")" << std::endl);
-            access(target, false);
-            return (const Referent *)ss->objects[target]->target;
+            debug(std::cout << "Accessing (constly) " << target << std::endl);
+            return access(target, false);
         }
 
         Referent * operator->(void) {
-            assert(ss->objects.count(target) > 0);
-            debug(std::cout << "Accessing " << target
-                            << " (" << ss->objects[target]->target << ")" << std::endl);
-            access(target, true);
-            return (Referent *)ss->objects[target]->target;
+            debug(std::cout << "Accessing " << target << std::endl);
+            return access(target, true);
         }
 
         pin(const pointer<Referent> *p)
@@ -243,6 +445,13 @@ public:
                   target(0)
         {}
 
+        pin(const pin &other)
+                : ss(NULL),
+                  target(0)
+        {
+            dopin(other.ss, other.target);
+        }
+
         ~pin(void) {
             unpin();
         }
@@ -252,6 +461,7 @@ public:
                 unpin();
                 dopin(other.ss, other.target);
             }
+            return *this;
         }
 
     private:
@@ -259,8 +469,14 @@ public:
             debug(std::cout << "Unpinning " << target
                             << " (" << ss->objects[target]->target << ")" << std::endl);
             if (target > 0) {
+                std::unique_lock<std::recursive_mutex> guard = ss->state_guard();
                 assert(ss->objects.count(target) > 0);
-                ss->objects[target]->pincount--;
+                object *obj = ss->objects[target];
+                if (--obj->pincount == 0 && obj->target) {
+                    // Whatever changed the object did so under a pin.
+                    ss->measure(obj);
+                    ss->policy->insert(obj);
+                }
                 ss->maybe_evict_something();
             }
             ss = NULL;
@@ -272,22 +488,51 @@ public:
             ss = newss;
             target = newtarget;
             if (target > 0) {
+                std::unique_lock<std::recursive_mutex> guard = ss->pin_guard();
                 assert(ss->objects.count(target) > 0);
                 debug(std::cout << "Pinning " << target
                                 << " (" << ss->objects[target]->target << ")" << std::endl);
-                ss->objects[target]->pincount++;
+                object *obj = ss->objects[target];
+                if (obj->pincount++ == 0 && obj->target && obj->is_linked())
+                    ss->policy->remove(obj);
             }
         }
 
-        void access(uint64_t tgt, bool dirty) const {
+        friend class swap_space;
+
+        pin(swap_space *newss, uint64_t newtarget)
+                : ss(NULL),
+                  target(0)
+        {
+            dopin(newss, newtarget);
+        }
+
+        // The object stays in memory while it is pinned, so the
+        // pointer is good after the lock is gone.
+        Referent *access(uint64_t tgt, bool dirty) const {
+            std::unique_lock<std::recursive_mutex> guard = ss->state_guard();
             assert(ss->objects.count(tgt) > 0);
             object *obj = ss->objects[tgt];
-            ss->lru_pqueue.erase(obj);
-            obj->last_access = ss->next_access_time++;
-            ss->lru_pqueue.insert(obj);
-            obj->target_is_dirty |= dirty;
-            ss->load<Referent>(tgt);
+            if (obj->target)
+                ss->hit_count++;
+            else
+                ss->miss_count++;
+            if (ss->thread_safe)
+                ss->load_unlocked<Referent>(obj, guard);
+            else
+                ss->load<Referent>(tgt);
+            // Marked once it is in memory: a dirty object that isn't is
+            // taken to be in the compressed tier.
+            if (dirty) {
+                if (ss->needs_preserving(obj))
+                    ss->preserve(obj);
+                // A write of an older image that is still in flight
+                // must not mark this one clean.
+                obj->target_is_dirty = true;
+                obj->dirty_generation++;
+            }
             ss->maybe_evict_something();
+            return (Referent *)obj->target;
         }
 
         swap_space *ss;
@@ -308,7 +553,8 @@ public:
         pointer(const pointer &other) {
             ss = other.ss;
             target = other.target;
-            if (target > 0) {
+            if (target > 0 && ss != NULL) {
+                std::unique_lock<std::recursive_mutex> guard = ss->state_guard();
                 assert(ss->objects.count(target) > 0);
                 ss->objects[target]->refcount++;
             }
@@ -319,17 +565,25 @@ public:
         }
 
         void depoint(void) {
-            if (target == 0)
+            // A weak pointer has an object id but no swap space.
+            if (target == 0 || ss == NULL) {
+                target = 0;
                 return;
+            }
+            std::unique_lock<std::recursive_mutex> guard = ss->state_guard();
             assert(ss->objects.count(target) > 0);
 
             object *obj = ss->objects[target];
             assert(obj->refcount > 0);
             if ((--obj->refcount) == 0) {
                 debug(std::cout << "Erasing " << target << std::endl);
+                if (ss->needs_preserving(obj))
+                    ss->preserve(obj);
                 // Load it into memory so we can recursively free stuff
+                // A dirty object in the compressed tier may never have
+                // reached the store.
                 if (obj->target == NULL) {
-                    assert(obj->bsid > 0);
+                    assert(obj->bsid > 0 || obj->is_linked());
                     if (!obj->is_leaf) {
                         ss->load<Referent>(target);
                     } else {
@@ -337,12 +591,17 @@ public:
                     }
                 }
                 ss->objects.erase(target);
-                ss->lru_pqueue.erase(obj);
-                if (obj->target)
+                if (obj->is_linked())
+                    ss->unlink(obj);
+                if (obj->target) {
                     delete obj->target;
-                ss->current_in_memory_objects--;
-                if (obj->bsid > 0)
-                    ss->backstore->deallocate(obj->bsid);
+                    ss->current_in_memory_objects--;
+                    ss->current_bytes -= obj->bytes;
+                }
+                if (obj->bsid > 0) {
+                    std::unique_lock<std::mutex> io = ss->io_guard();
+                    ss->free_block(obj->bsid);
+                }
                 delete obj;
             }
             target = 0;
@@ -350,21 +609,30 @@ public:
 
         pointer & operator=(const pointer &other) {
             if (&other != this) {
-                depoint();
-                ss = other.ss;
-                target = other.target;
-                if (target > 0) {
-                    assert(ss->objects.count(target) > 0);
-                    ss->objects[target]->refcount++;
+                // Take the new reference first, other may live
+                // inside the object we are about to release.
+                swap_space *newss = other.ss;
+                uint64_t newtarget = other.target;
+                if (newtarget > 0 && newss != NULL) {
+                    std::unique_lock<std::recursive_mutex> guard = newss->state_guard();
+                    assert(newss->objects.count(newtarget) > 0);
+                    newss->objects[newtarget]->refcount++;
                 }
+                depoint();
+                ss = newss;
+                target = newtarget;
             }
             return *this;
         }
 
-        bool isNull(){
+        bool isNull() const {
             return target == 0 && ss==NULL;
         }
 
+        uint64_t object_id(void) const {
+            return target;
+        }
+
         bool operator==(const pointer &other) const {
             return ss == other.ss && target == other.target;
         }
@@ -394,6 +662,11 @@ public:
             return pin<Referent>(this);
         }
 
+        // Const access only, the object stays clean.
+        const pin<Referent> read_pin(void) const {
+            return pin<Referent>(this);
+        }
+
         bool is_in_memory(void) const {
             assert(ss->objects.count(target) > 0);
             return target > 0 && ss->objects[target]->target != NULL;
@@ -405,30 +678,47 @@ public:
         }
 
         void _serialize(std::iostream &fs, serialization_context &context) {
-            if(isNull()){
+            if (context.format == BINARY_FORMAT) {
+                // Object id 0 is never handed out, so it encodes NULL.
+                write_raw(fs, isNull() ? (uint64_t)0 : target);
+                if (isNull())
+                    return;
+            } else if(isNull()){
                 fs << "NULL" << std::endl;
                 return;
+            } else {
+                fs << "NodePointer ";
+                fs << target << std::endl;
             }
-            fs << "NodePointer ";
             assert(target > 0);
             assert(context.ss.objects.count(target) > 0);
-            fs << target << std::endl;
-            target = 0;
+            if (context.detach)
+                target = 0;
             assert(fs.good());
             context.is_leaf = false;
         }
 
         void _deserialize(std::iostream &fs, serialization_context &context) {
-            std::string dummy;
-            fs >> dummy;
-            if(dummy == "NULL"){
-                return;
-            }
             assert(target == 0);
+            if (context.format == BINARY_FORMAT) {
+                uint64_t id;
+                read_raw(fs, id);
+                if (id == 0)
+                    return;
+                target = id;
+            } else {
+                std::string dummy;
+                fs >> dummy;
+                if(dummy == "NULL"){
+                    return;
+                }
+                fs >> target;
+                assert(fs.good());
+            }
+            if (context.weak)
+                return;
             ss = &context.ss;
-            fs >> target;
-            assert(fs.good());
-            assert(context.ss.objects.count(target) > 0);
+            assert(!context.locked || context.ss.objects.count(target) > 0);
             // We just created a new reference to this object and
             // invalidated the on-disk reference, so the total refcount
             // stays the same.
@@ -441,6 +731,7 @@ public:
         // Only callable through swap_space::allocate(...)
         pointer(swap_space *sspace, Referent *tgt)
         {
+            std::unique_lock<std::recursive_mutex> guard = sspace->state_guard();
             ss = sspace;
             target = sspace->next_id++;
             object *o = new object(sspace, tgt);
@@ -448,20 +739,156 @@ public:
             target = o->id;
             assert(ss->objects.count(target) == 0);
             ss->objects[target] = o;
-            ss->lru_pqueue.insert(o);
             ss->current_in_memory_objects++;
+            ss->measure(o);
+            // Writing out the object we were just handed would only
+            // store an image that the caller is about to change.
+            o->pincount++;
             ss->maybe_evict_something();
+            if (--o->pincount == 0)
+                ss->policy->insert(o);
         }
 
     };
 
+    void set_cache_size(uint64_t sz);
+
+    // 0 lifts the byte limit.
+    void set_cache_bytes(uint64_t max_bytes);
+
+    uint64_t resident_bytes(void) const { return current_bytes; }
+    uint64_t peak_resident_bytes(void) const { return peak_bytes; }
+    uint64_t cache_bytes(void) const { return max_in_memory_bytes; }
+
+    // The policy is not owned by the swap space and must outlive it,
+    // NULL goes back to the built-in LRU.  The unpinned objects are
+    // handed over in their current order.
+    void set_replacement_policy(replacement_policy *p);
+
+    // Starts a thread that keeps the next low_water eviction
+    // candidates clean, by writing back the dirty ones among them every
+    // interval_ms milliseconds or as soon as eviction meets a dirty
+    // object.  Eviction then picks a clean candidate when there is one.
+    // An object changed while its image is being written stays dirty.
+    void start_background_writeback(uint64_t low_water, unsigned interval_ms = 10);
+    void stop_background_writeback(void);
+
+    // Objects written back by the background thread, and dirty objects
+    // that eviction had to write itself.
+    uint64_t background_writes(void) const { return background_write_count; }
+    uint64_t dirty_evictions(void) const { return dirty_eviction_count; }
+
+    // A consistent copy of the counters.  From another thread only
+    // while the swap space is thread safe or the background writer
+    // runs: otherwise nothing takes the state lock that guards them.
+    swap_space_stats stats(void);
+
+    // A copy of the histograms, from another thread on the same terms.
+    swap_space_latencies latencies(void);
+
+    // The counters and latencies in the Prometheus text format, see
+    // metrics.hpp.
+    void write_metrics(std::ostream &out);
+
+    // Lets several threads pin objects and copy and drop pointers at
+    // once, each such call takes the state lock.  A miss reads and
+    // deserializes the object without it, so misses on different
+    // objects overlap; threads that miss on the same object wait for
+    // the first one.  What the objects hold is up to the caller: many
+    // threads may read an object, a thread that changes one must have
+    // it to itself.  Set it while no other thread uses the swap space.
+    void set_thread_safe(bool on) { thread_safe = on; }
+    bool is_thread_safe(void) const { return thread_safe; }
+
+    // 0, the default, turns the compressed tier off and moves what is
+    // in it to the backing store.
+    void set_compressed_cache_bytes(uint64_t max_bytes);
+
+    uint64_t compressed_cache_bytes(void) const { return max_compressed_bytes; }
+    uint64_t compressed_bytes(void) const { return current_compressed_bytes; }
+    // Loads served from the compressed tier.
+    uint64_t compressed_hits(void) const { return compressed_hit_count; }
+
+    // Writes back every dirty object, without evicting it, and then
+    // syncs the backing store.  A durability barrier for the whole
+    // swap space.
+    void sync(void);
+
+    // Writes back every dirty object and then a superblock with the
+    // object table and the caller's state, see
+    // backing_store::write_superblock().  Until the next checkpoint is
+    // complete the blocks this one refers to are not reused, so a crash
+    // at any point leaves the last checkpoint intact.  The superblock
+    // keeps the references of pointers serialized into state; after
+    // open() deserialize them from state to take them back.  Other
+    // pointers that are not inside objects, such as cursors, should be
+    // gone or their objects are never freed after a restart.
+    void checkpoint(const std::string &state);
+
+    // Snapshots.  While a snapshot is live, an object that is about to
+    // be changed or freed is copied first, once per snapshot at most,
+    // and read_snapshot() gives the copy in place of the object.  So a
+    // snapshot reads every object that existed when it was taken as it
+    // was then, under its old id.  The copies are pages on the backing
+    // store, so they take none of the memory budgets, and go away with
+    // the last snapshot that can read them.  Releasing a snapshot only
+    // looks at the copies it may have been the last reader of.
+    uint64_t take_snapshot(void);
+    void release_snapshot(uint64_t snapshot);
+
+    // Copies object id, as snapshot sees it, into r, which must be new.
+    // The pointers of a copy taken from an old version are weak: only
+    // their object_id() means anything.
+    template<class Referent>
+    void read_snapshot(uint64_t snapshot, uint64_t id, Referent &r) {
+        std::unique_lock<std::recursive_mutex> guard = state_guard();
+        auto v = versions.find(id);
+        if (v != versions.end()) {
+            auto it = v->second.lower_bound(snapshot);
+            if (it != v->second.end()) {
+                std::unique_lock<std::mutex> io = io_guard();
+                std::string page, buffer;
+                size_t length;
+                const char *data = backstore->view(it->second.bsid, length);
+                if (data == NULL) {
+                    backstore->read(it->second.bsid, page);
+                    data = page.data();
+                    length = page.length();
+                }
+                data = backstore->decode_page(data, length, buffer, length);
+                assert(data != NULL);
+                view_streambuf sb(data, length);
+                std::iostream in(&sb);
+                serialization_context ctxt(*this, format);
+                ctxt.weak = true;
+                deserialize(in, ctxt, r);
+                return;
+            }
+        }
+        // Loaded under the lock we hold, the pin's own access would
+        // let go of it while reading.
+        const pin<Referent> p(this, id);
+        load<Referent>(id);
+        r = *(const Referent *)objects[id]->target;
+    }
+
+    // The bytes of the copies kept for snapshots, on the backing store.
+    uint64_t snapshot_bytes(void) const { return version_bytes; }
+
+    // Picks up the last checkpoint of the backing store on an empty
+    // swap space: the object table comes back and the objects are
+    // loaded as they are used.  state is what was handed to
+    // checkpoint().  Returns false when there is no checkpoint; either
+    // way the store learns which of its blocks are live.
+    bool open(std::string &state);
+
 private:
     backing_store *backstore;
+    serialization_format format;
 
     uint64_t next_id = 1;
-    uint64_t next_access_time = 0;
 
-    class object {
+    class object : public replacement_hook {
     public:
 
         object(swap_space *sspace, serializable * tgt);
@@ -469,40 +896,257 @@ private:
         serializable * target;
         uint64_t id;
         uint64_t bsid;
+        // Counted against the byte budget while target is in memory.
+        uint64_t bytes;
+        uint64_t image_bytes;
+        // The length of the page at bsid.
+        uint64_t stored_bytes;
+        // The newest snapshot that has a copy of this object, or that
+        // was taken before it existed.
+        uint64_t preserved_snapshot;
         bool is_leaf;
         uint64_t refcount;
-        uint64_t last_access;
         bool target_is_dirty;
+        // Bumped whenever the object is dirtied.
+        uint64_t dirty_generation;
+        // The image while the object is in the compressed tier, it is
+        // image_bytes long uncompressed.
+        std::string compressed;
         uint64_t pincount;
+        // Set while a thread loads the object without the state lock.
+        bool loading;
     };
 
-    static bool cmp_by_last_access(object *a, object *b);
-
     template<class Referent>
     void load(uint64_t tgt) {
         assert(objects.count(tgt) > 0);
         if (objects[tgt]->target == NULL) {
+            uint64_t start = latency_now();
             object *obj = objects[tgt];
             debug(std::cout << "Loading " << obj->id << std::endl);
-            std::iostream *in = backstore->get(obj->bsid);
+            std::string buffer;
+            size_t length;
             Referent *r = new Referent();
-            serialization_context ctxt(*this);
-            deserialize(*in, ctxt, *r);
-            backstore->put(in);
+            if (obj->is_linked()) {
+                decompress(obj, buffer);
+                view_streambuf sb(buffer.data(), buffer.length());
+                std::iostream in(&sb);
+                serialization_context ctxt(*this, format);
+                deserialize(in, ctxt, *r);
+                length = buffer.length();
+                unlink(obj);
+                compressed_hit_count++;
+            } else {
+                load_count++;
+                // A view stays valid only as long as nobody else uses the store.
+                std::unique_lock<std::mutex> io = io_guard();
+                std::string page;
+                const char *data = backstore->view(obj->bsid, length);
+                if (data == NULL) {
+                    backstore->read(obj->bsid, page);
+                    data = page.data();
+                    length = page.length();
+                }
+                bytes_read += length;
+                data = backstore->decode_page(data, length, buffer, length);
+                assert(data != NULL);
+                view_streambuf sb(data, length);
+                std::iostream in(&sb);
+                serialization_context ctxt(*this, format);
+                deserialize(in, ctxt, *r);
+            }
             obj->target = r;
+            obj->image_bytes = length;
             current_in_memory_objects++;
+            measure(obj);
+            load_latency.record(latency_now() - start);
         }
     }
 
-    void set_cache_size(uint64_t sz);
+    // load() for a thread safe swap space, state holds the state lock
+    // once.  The object is read and deserialized without the lock and
+    // installed under it again.  It is pinned, so it stays put
+    // meanwhile, except that the compressed tier may demote it: the
+    // compressed image is copied first.
+    template<class Referent>
+    void load_unlocked(object *obj, std::unique_lock<std::recursive_mutex> &state) {
+        while (obj->loading)
+            loaded.wait(state);
+        if (obj->target != NULL)
+            return;
+        uint64_t start = latency_now();
+        debug(std::cout << "Loading " << obj->id << std::endl);
+        obj->loading = true;
+        bool from_tier = obj->is_linked();
+        uint64_t bsid = obj->bsid;
+        size_t length = obj->image_bytes;
+        std::string image, buffer;
+        if (from_tier)
+            image = obj->compressed;
+        state.unlock();
+
+        const char *data;
+        if (from_tier) {
+            buffer.resize(length);
+            bool ok = lz_decompress(image.data(), image.length(), &buffer[0], length);
+            assert(ok);
+            (void)ok;
+            data = buffer.data();
+        } else {
+            {
+                std::unique_lock<std::mutex> io = io_guard();
+                backstore->read(bsid, image);
+            }
+            data = backstore->decode_page(image.data(), image.length(), buffer, length);
+            assert(data != NULL);
+        }
+        Referent *r = new Referent();
+        {
+            view_streambuf sb(data, length);
+            std::iostream in(&sb);
+            serialization_context ctxt(*this, format);
+            ctxt.locked = false;
+            deserialize(in, ctxt, *r);
+        }
+
+        state.lock();
+        if (from_tier) {
+            if (obj->is_linked())
+                unlink(obj);
+            compressed_hit_count++;
+        } else {
+            load_count++;
+            bytes_read += image.length();
+        }
+        obj->target = r;
+        obj->image_bytes = length;
+        current_in_memory_objects++;
+        measure(obj);
+        load_latency.record(latency_now() - start);
+        obj->loading = false;
+        loaded.notify_all();
+    }
 
-    void write_back(object *obj);
+    void write_back(object *obj, bool evict);
     void maybe_evict_something(void);
+    void measure(object *obj);
+    object *pick_victim(void);
+    // For replacement_policy::candidate().
+    static bool is_clean(const replacement_hook *h) {
+        return !static_cast<const object *>(h)->target_is_dirty;
+    }
+    static bool is_dirty(const replacement_hook *h) {
+        return static_cast<const object *>(h)->target_is_dirty;
+    }
+    void unlink(object *obj);
+    void compress_out(object *obj);
+    void decompress(object *obj, std::string &image);
+    void demote(object *obj);
+    void write_image(object *obj, const std::string &image);
+    void write_dirty(void);
+    void free_block(uint64_t bsid);
+    bool needs_preserving(object *obj) const {
+        return !live_snapshots.empty() && *live_snapshots.rbegin() > obj->preserved_snapshot;
+    }
+    void preserve(object *obj);
+    void background_writeback(void);
+
+    // Both are taken only while the background writer runs or the
+    // swap space is thread safe: the state lock for the objects, their
+    // pins and references and the replacement policy, the io lock for
+    // the backing store.  The state lock comes first.
+    std::unique_lock<std::recursive_mutex> state_guard(void) {
+        std::unique_lock<std::recursive_mutex> lock(state_mutex, std::defer_lock);
+        if (writer_running || thread_safe)
+            lock.lock();
+        return lock;
+    }
+
+    // The state guard, counting the time a pin waits for it.
+    std::unique_lock<std::recursive_mutex> pin_guard(void) {
+        std::unique_lock<std::recursive_mutex> lock(state_mutex, std::defer_lock);
+        if ((writer_running || thread_safe) && !lock.try_lock()) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            lock.lock();
+            pin_wait_count++;
+            pin_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+        return lock;
+    }
+
+    std::unique_lock<std::mutex> io_guard(void) {
+        std::unique_lock<std::mutex> lock(io_mutex, std::defer_lock);
+        if (writer_running || thread_safe)
+            lock.lock();
+        return lock;
+    }
 
     uint64_t max_in_memory_objects;
     uint64_t current_in_memory_objects = 0;
+    uint64_t max_in_memory_bytes;
+    uint64_t current_bytes = 0;
+    uint64_t peak_bytes = 0;
     std::unordered_map<uint64_t, object *> objects;
-    std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+    lru_policy default_policy;
+    replacement_policy *policy;
+
+    std::recursive_mutex state_mutex;
+    std::mutex io_mutex;
+    std::condition_variable_any writer_wakeup;
+    // Signalled when load_unlocked() has installed an object.
+    std::condition_variable_any loaded;
+    std::thread writer;
+    bool writer_running = false;
+    bool thread_safe = false;
+    bool writer_stopping = false;
+    uint64_t writeback_low_water = 0;
+    unsigned writeback_interval_ms = 0;
+    uint64_t background_write_count = 0;
+    uint64_t dirty_eviction_count = 0;
+    // Cleared when eviction found no clean candidate, set again once
+    // the writer cleans one.
+    bool clean_candidates = true;
+
+    // Counted under the state lock.
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+    uint64_t load_count = 0;
+    uint64_t bytes_read = 0;
+    uint64_t write_back_count = 0;
+    uint64_t bytes_written = 0;
+    uint64_t eviction_count = 0;
+    uint64_t pin_wait_count = 0;
+    uint64_t pin_wait_ns = 0;
+    latency_histogram load_latency;
+    latency_histogram write_back_latency;
+
+    // The compressed tier, oldest first.  Its objects are not in
+    // memory, so the hook they use for the policy is free.
+    replacement_list compressed_tier;
+    uint64_t max_compressed_bytes = 0;
+    uint64_t current_compressed_bytes = 0;
+    uint64_t compressed_hit_count = 0;
+
+    // The blocks the last checkpoint refers to, and those of them that
+    // were freed since.
+    std::unordered_set<uint64_t> checkpoint_blocks;
+    std::vector<uint64_t> deferred_frees;
+
+    // Snapshots are numbered from 1 on.  An object's copies are keyed
+    // by the newest snapshot that was live when the copy was made; a
+    // snapshot reads the first copy at or after its own number, or the
+    // object itself when there is none.  versions_by_snapshot lists
+    // the objects with a copy under each key.
+    struct version {
+        uint64_t bsid;
+        uint64_t bytes;
+    };
+    uint64_t last_snapshot = 0;
+    std::multiset<uint64_t> live_snapshots;
+    std::unordered_map<uint64_t, std::map<uint64_t, version> > versions;
+    std::map<uint64_t, std::vector<uint64_t> > versions_by_snapshot;
+    uint64_t version_bytes = 0;
 };
 
 #endif // SWAP_SPACE_HPP
@@ -1,15 +1,22 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <fstream>
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include "BEpsilon.h"
+#include "ShardedBEpsilon.h"
 #include "swap_space.hpp"
 #include "backing_store.hpp"
+#include "compress.hpp"
+#include "workload.hpp"
 #include <thread>         // std::this_thread::sleep_for
 #include <chrono>         // std::chrono::seconds
+#include <atomic>
+#include <condition_variable>
 #define DEFAULT_TEST_CACHE_SIZE (70000)
 
 void printVector(vector<int> vector) {
@@ -21,6 +28,49 @@ void printVector(vector<int> vector) {
 
 void insertTest(int);
 
+void serializationFormatTest(serialization_format, int);
+
+void pagedFileStoreTest(int);
+
+void mmapStoreTest(int);
+
+void durabilityTest(int);
+
+void rangeQueryTest(int);
+
+void upsertTest(int);
+
+void bulkLoadTest(int);
+
+void writeBatchTest(int);
+
+void keySearchTest();
+
+void flushPolicyTest(int);
+
+void replacementPolicyTest(int);
+
+void byteBudgetTest(int);
+
+void readOnlyTest(int);
+
+void backgroundWritebackTest(int);
+
+void compressedTierTest(int);
+
+void compressedStoreTest(int);
+
+void persistenceTest(int);
+
+void writeAheadLogTest(int);
+void snapshotTest(int);
+void concurrentReadersTest(int);
+void shardedTreeTest(int);
+void messageBufferCapacityTest(int);
+void workloadTest(int);
+void statsTest(int);
+void latencyTest(int);
+
 void removeLeftToRightTest(int);
 
 void removeRightToLeftTest(int);
@@ -48,7 +98,93 @@ public:
     }
 };
 
+// read() waits until the test opens the gate.
+class GatedStore : public paged_file_backing_store {
+public:
+    GatedStore(std::string filename)
+            : paged_file_backing_store(filename), open(false), reading(false) {}
+
+    void read(uint64_t id, std::string &buf) {
+        std::unique_lock<std::mutex> lock(mutex);
+        reading = true;
+        changed.notify_all();
+        changed.wait(lock, [this]() { return open; });
+        reading = false;
+        lock.unlock();
+        paged_file_backing_store::read(id, buf);
+    }
+
+    void waitForReader() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return reading; });
+    }
+
+    void openGate() {
+        std::unique_lock<std::mutex> lock(mutex);
+        open = true;
+        changed.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool open;
+    bool reading;
+};
+
+class SyncCountingStore : public paged_file_backing_store {
+public:
+    SyncCountingStore(std::string filename)
+            : paged_file_backing_store(filename), syncs(0), writes(0), deallocations(0) {}
+
+    void write(uint64_t id, const std::string &buf) {
+        writes++;
+        paged_file_backing_store::write(id, buf);
+    }
+
+    void deallocate(uint64_t id) {
+        deallocations++;
+        paged_file_backing_store::deallocate(id);
+    }
+
+    int syncs;
+    int writes;
+    int deallocations;
+
+protected:
+    void sync_data() {
+        syncs++;
+        paged_file_backing_store::sync_data();
+    }
+};
+
 int main() {
+    keySearchTest();
+    serializationFormatTest(TEXT_FORMAT, 2000);
+    serializationFormatTest(BINARY_FORMAT, 2000);
+    pagedFileStoreTest(2000);
+    mmapStoreTest(2000);
+    durabilityTest(1000);
+    rangeQueryTest(1500);
+    upsertTest(300);
+    bulkLoadTest(3000);
+    writeBatchTest(2000);
+    flushPolicyTest(3000);
+    messageBufferCapacityTest(2000);
+    replacementPolicyTest(2000);
+    byteBudgetTest(3000);
+    readOnlyTest(2000);
+    backgroundWritebackTest(3000);
+    compressedTierTest(2000);
+    compressedStoreTest(3000);
+    persistenceTest(3000);
+    writeAheadLogTest(2000);
+    snapshotTest(3000);
+    concurrentReadersTest(2000);
+    shardedTreeTest(4000);
+    workloadTest(2000);
+    statsTest(3000);
+    latencyTest(3000);
     insertTest(60000);
 //    removeLeftToRightTest(1000);
 //    removeRightToLeftTest(500);
@@ -117,6 +253,7 @@ void insertTest(int size) {
     cout << "entered insertTest..." << endl;
     uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
     one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
     swap_space sspace(&ofpobs, cache_size);
     BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
 
@@ -131,10 +268,390 @@ void insertTest(int size) {
     cout << "done." << endl;
 }
 
+template<typename Key>
+void checkKeySearch(const vector<Key> &keys, Key key) {
+    size_t lower = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    size_t upper = std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+    assert(key_search<Key>::lower_bound(keys.data(), keys.size(), key) == lower);
+    assert(key_search<Key>::upper_bound(keys.data(), keys.size(), key) == upper);
+}
+
+void keySearchTest() {
+    cout << "entered keySearchTest..." << endl;
+    // sizes around the SIMD range and the vector widths, with runs of equal keys.
+    for (int n = 0; n < 3 * SIMD_SEARCH_RANGE; n++) {
+        vector<int64_t> keys64;
+        vector<int32_t> keys32;
+        vector<double> keys_double;
+        for (int i = 0; i < n; i++) {
+            keys64.push_back(2 * (i - n / 2) - (i % 5 == 0));
+            keys32.push_back(keys64.back());
+            keys_double.push_back(keys64.back());
+        }
+        std::sort(keys64.begin(), keys64.end());
+        std::sort(keys32.begin(), keys32.end());
+        std::sort(keys_double.begin(), keys_double.end());
+        for (int key = -n - 2; key <= n + 2; key++) {
+            checkKeySearch<int64_t>(keys64, key);
+            checkKeySearch<int32_t>(keys32, key);
+            checkKeySearch<double>(keys_double, key + 0.5);
+        }
+        checkKeySearch<int64_t>(keys64, INT64_MIN);
+        checkKeySearch<int64_t>(keys64, INT64_MAX);
+        checkKeySearch<int32_t>(keys32, INT32_MIN);
+        checkKeySearch<int32_t>(keys32, INT32_MAX);
+    }
+    cout << "done." << endl;
+}
+
+// a tiny cache forces every node through write_back and load.
+void serializationFormatTest(serialization_format format, int size) {
+    cout << "entered serializationFormatTest..." << endl;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10, format);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, i * 2);
+    }
+    for (int i = 0; i < size; i += 2) {
+        tree.remove(i);
+    }
+    for (int i = 0; i < size; i++) {
+        int64_t value = -1;
+        bool found = tree.pointQuery(i, value);
+        assert(found == (i % 2 == 1));
+        assert(!found || value == i * 2);
+    }
+    cout << "done." << endl;
+}
+
+void pagedFileStoreTest(int size) {
+    cout << "entered pagedFileStoreTest..." << endl;
+    // start with a single data page so the file has to grow and extents get reused.
+    paged_file_backing_store pfbs("dd/paged.db", paged_file_backing_store::PAGE_SIZE);
+    pfbs.set_durability(NO_SYNC);
+    swap_space sspace(&pfbs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, i);
+    }
+    for (int i = 0; i < size; i += 3) {
+        tree.remove(i);
+    }
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i) == (i % 3 != 0));
+    }
+    cout << "done." << endl;
+}
+
+void mmapStoreTest(int size) {
+    cout << "entered mmapStoreTest..." << endl;
+    // a small initial mapping makes the store grow while nodes are being loaded from it.
+    mmap_backing_store mbs("dd/mmap.db", mmap_backing_store::PAGE_SIZE);
+    mbs.set_durability(NO_SYNC);
+    swap_space sspace(&mbs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, i + 1);
+        if (i % 100 == 0) {
+            int64_t value;
+            assert(tree.pointQuery(i / 2, value) && value == i / 2 + 1);
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        assert(tree.pointQuery(i, value) && value == i + 1);
+    }
+    cout << "done." << endl;
+}
+
+void durabilityTest(int size) {
+    cout << "entered durabilityTest..." << endl;
+    SyncCountingStore store("dd/durability.db");
+    swap_space sspace(&store, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+
+    store.set_durability(NO_SYNC);
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, i);
+    }
+    assert(store.writes > 0 && store.syncs == 0);
+    tree.sync();
+    assert(store.syncs == 1);
+
+    // a byte window large enough for several node images per sync.
+    store.set_durability(GROUP_COMMIT, 4096, 1000000000);
+    int writes_before = store.writes;
+    for (int i = size; i < 2 * size; i++) {
+        tree.insert(i, i);
+    }
+    assert(store.syncs > 1 && store.syncs - 1 < store.writes - writes_before);
+
+    store.set_durability(SYNC_EACH_WRITE);
+    int syncs_before = store.syncs;
+    writes_before = store.writes;
+    for (int i = 2 * size; i < 3 * size; i++) {
+        tree.insert(i, i);
+    }
+    assert(store.syncs - syncs_before == store.writes - writes_before);
+
+    for (int i = 0; i < 3 * size; i++) {
+        assert(tree.contains(i));
+    }
+    cout << "done." << endl;
+}
+
+void rangeQueryTest(int size) {
+    cout << "entered rangeQueryTest..." << endl;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    map<int64_t, int64_t> expected;
+
+    for (int i = 0; i < size; i++) {
+        tree.insert(2 * i, i);
+        expected[2 * i] = i;
+    }
+    for (int i = 0; i < size; i += 3) {
+        tree.remove(2 * i);
+        expected.erase(2 * i);
+    }
+    for (int i = 1; i < size; i += 5) {
+        tree.insert(2 * i, -i);
+        expected[2 * i] = -i;
+    }
+
+    int ranges[][2] = {{-10, 4 * size}, {0, 0}, {7, 7}, {101, 355}, {2 * size - 40, 2 * size + 40}};
+    for (auto &range : ranges) {
+        vector<pair<int64_t, int64_t> > found;
+        tree.rangeQuery(range[0], range[1], [&found](const int64_t &key, const int64_t &value) {
+            found.push_back(make_pair(key, value));
+        });
+        vector<pair<int64_t, int64_t> > wanted(expected.lower_bound(range[0]), expected.upper_bound(range[1]));
+        assert(found == wanted);
+    }
+
+    BEpsilonTree<int64_t,int64_t,3>::Cursor cursor = tree.cursor();
+    assert(cursor.seek(7) && cursor.key() == 8 && cursor.value() == 4);
+    assert(cursor.next() && cursor.key() == 10);
+    assert(!cursor.seek(2 * size));
+
+    bool thrown = false;
+    try {
+        tree.rangeQuery(5, 4, [](const int64_t &, const int64_t &) {});
+    } catch (InvalidKeyRange &e) {
+        thrown = true;
+    }
+    assert(thrown);
+    cout << "done." << endl;
+}
+
+void upsertTest(int size) {
+    cout << "entered upsertTest..." << endl;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    CounterMerge<int64_t> counter;
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace, &counter);
+    map<int64_t, int64_t> expected;
+
+    for (int round = 1; round <= 3; round++) {
+        for (int i = 0; i < size; i++) {
+            tree.upsert(i, round);
+            expected[i] += round;
+        }
+        for (int i = round; i < size; i += 11) {
+            tree.remove(i);
+            expected.erase(i);
+        }
+        for (int i = round; i < size; i += 13) {
+            tree.insert(i, 1000);
+            expected[i] = 1000;
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        bool found = tree.pointQuery(i, value);
+        assert(found == (expected.count(i) == 1));
+        assert(!found || value == expected[i]);
+    }
+    vector<pair<int64_t, int64_t> > all;
+    tree.rangeQuery(0, size, [&all](const int64_t &key, const int64_t &value) {
+        all.push_back(make_pair(key, value));
+    });
+    vector<pair<int64_t, int64_t> > wanted(expected.begin(), expected.end());
+    assert(all == wanted);
+
+    MaxMerge<int> max_merge;
+    BEpsilonTree<int,int,3> max_tree(&sspace, &max_merge);
+    map<int, int> expected_max;
+    for (int i = 0; i < size; i++) {
+        max_tree.upsert(i % 10, i % 97);
+        expected_max[i % 10] = max(expected_max[i % 10], i % 97);
+    }
+    for (int i = 0; i < 10; i++) {
+        int value;
+        assert(max_tree.pointQuery(i, value) && value == expected_max[i]);
+    }
+
+    AppendMerge<std::string> append;
+    BEpsilonTree<int,std::string,3> log_tree(&sspace, &append);
+    log_tree.upsert(1, "a");
+    log_tree.upsert(1, "b");
+    log_tree.insert(2, "x");
+    log_tree.upsert(2, "y");
+    std::string text;
+    assert(log_tree.pointQuery(1, text) && text == "ab");
+    assert(log_tree.pointQuery(2, text) && text == "xy");
+
+    BEpsilonTree<int64_t,int64_t,3> plain(&sspace);
+    bool thrown = false;
+    try {
+        plain.upsert(1, 1);
+    } catch (NoMergeOperatorException &e) {
+        thrown = true;
+    }
+    assert(thrown);
+    cout << "done." << endl;
+}
+
+void bulkLoadTest(int size) {
+    cout << "entered bulkLoadTest..." << endl;
+    SyncCountingStore store("dd/bulkload.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    vector<pair<int64_t, int64_t> > input;
+    for (int i = 0; i < size; i++) {
+        input.push_back(make_pair(3 * i, i));
+    }
+
+    tree.bulkLoad(input.begin(), input.end());
+    tree.sync();
+    // a rewritten node would have released its previous image.
+    assert(store.writes > 0 && store.deallocations == 0);
+    assert(tree.size() == size);
+    for (int i = 0; i < 3 * size; i++) {
+        int64_t value;
+        bool found = tree.pointQuery(i, value);
+        assert(found == (i % 3 == 0));
+        assert(!found || value == i / 3);
+    }
+    vector<pair<int64_t, int64_t> > all;
+    tree.rangeQuery(0, 3 * size, [&all](const int64_t &key, const int64_t &value) {
+        all.push_back(make_pair(key, value));
+    });
+    assert(all == input);
+
+    // the loaded tree takes updates like one built by insert.
+    for (int i = 0; i < size / 10; i += 2) {
+        tree.remove(3 * i);
+        tree.insert(3 * i + 1, -i);
+    }
+    for (int i = 0; i < size / 10; i++) {
+        assert(tree.contains(3 * i) == (i % 2 == 1));
+        assert(tree.contains(3 * i + 1) == (i % 2 == 0));
+    }
+
+    bool thrown = false;
+    try {
+        tree.bulkLoad(input.begin(), input.end());
+    } catch (BulkLoadException &e) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    BEpsilonTree<int64_t,int64_t,3> unsorted(&sspace);
+    std::swap(input[10], input[11]);
+    thrown = false;
+    try {
+        unsorted.bulkLoad(input.begin(), input.end());
+    } catch (BulkLoadException &e) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    map<int, int> small;
+    for (int i = 0; i < size / 10; i++) {
+        small[i] = 2 * i;
+    }
+    BEpsilonTree<int,int,16> half_full(&sspace);
+    half_full.bulkLoad(small.begin(), small.end(), 0.5);
+    for (int i = 0; i < size / 10; i++) {
+        int value;
+        assert(half_full.pointQuery(i, value) && value == 2 * i);
+    }
+    cout << "done." << endl;
+}
+
+void writeBatchTest(int size) {
+    cout << "entered writeBatchTest..." << endl;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    CounterMerge<int64_t> counter;
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace, &counter);
+    BEpsilonTree<int64_t,int64_t,3>::WriteBatch batch;
+    map<int64_t, int64_t> expected;
+
+    for (int start = 0; start < size; start += 250) {
+        batch.clear();
+        for (int i = start; i < start + 250; i++) {
+            batch.insert(i, i);
+            expected[i] = i;
+        }
+        // later operations on a key win over earlier ones in the same batch.
+        for (int i = start; i < start + 250; i += 7) {
+            batch.remove(i);
+            expected.erase(i);
+        }
+        for (int i = start; i < start + 250; i += 5) {
+            batch.upsert(i, 100);
+            expected[i] += 100;
+        }
+        for (int i = start - 250; i < start; i += 9) {
+            if (i >= 0) {
+                batch.remove(i);
+                expected.erase(i);
+            }
+        }
+        tree.write(batch);
+    }
+    vector<pair<int64_t, int64_t> > all;
+    tree.rangeQuery(0, size, [&all](const int64_t &key, const int64_t &value) {
+        all.push_back(make_pair(key, value));
+    });
+    vector<pair<int64_t, int64_t> > wanted(expected.begin(), expected.end());
+    assert(all == wanted);
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i) == (expected.count(i) == 1));
+    }
+
+    // a batch that can't be applied leaves the tree untouched.
+    BEpsilonTree<int64_t,int64_t,3> plain(&sspace);
+    batch.clear();
+    batch.insert(1, 1);
+    batch.upsert(2, 2);
+    bool thrown = false;
+    try {
+        plain.write(batch);
+    } catch (NoMergeOperatorException &e) {
+        thrown = true;
+    }
+    assert(thrown && !plain.contains(1) && plain.size() == 0);
+    cout << "done." << endl;
+}
+
 void removeLeftToRightTest(int size) {
     cout << "entered removeLeftToRightTest..." << endl;
     uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
     one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
     swap_space sspace(&ofpobs, cache_size);
     BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
 
@@ -157,6 +674,7 @@ void removeRightToLeftTest(int size) {
     cout << "entered removeRightToLeftTest..." << endl;
     uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
     one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
     swap_space sspace(&ofpobs, cache_size);
     BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
 
@@ -308,3 +826,1110 @@ void removeRightToLeftTest(int size) {
 //    cout << "done." << endl;
 //}
 
+// the same scattered inserts and removes under each flush policy, through a small cache.
+void flushPolicyTest(int size) {
+    cout << "entered flushPolicyTest..." << endl;
+    HeaviestChildrenFlush two(2);
+    AllChildrenFlush all;
+    const FlushPolicy *policies[] = {NULL, &two, &all};
+    for (int policy = 0; policy < 3; policy++) {
+        one_file_per_object_backing_store ofpobs("dd");
+        ofpobs.set_durability(NO_SYNC);
+        swap_space sspace(&ofpobs, 10);
+        BEpsilonTree<int64_t,int64_t,4> tree(&sspace);
+        tree.setFlushPolicy(policies[policy]);
+        map<int64_t, int64_t> expected;
+        for (int i = 0; i < size; i++) {
+            int64_t key = (i * 7919) % size;
+            tree.insert(key, i);
+            expected[key] = i;
+            if (i % 3 == 0) {
+                int64_t gone = (i * 104729) % size;
+                tree.remove(gone);
+                expected.erase(gone);
+            }
+        }
+        vector<pair<int64_t, int64_t> > found;
+        tree.rangeQuery(0, size, [&found](const int64_t &key, const int64_t &value) {
+            found.push_back(make_pair(key, value));
+        });
+        vector<pair<int64_t, int64_t> > wanted(expected.begin(), expected.end());
+        assert(found == wanted);
+
+        const FlushStats &stats = tree.flushStats();
+        assert(stats.cascades > 0 && stats.flushes >= stats.cascades);
+        assert(stats.nodes_touched >= stats.cascades && stats.messages_moved > 0);
+        assert(stats.max_cascade_nodes >= stats.last_cascade_nodes);
+        cout << "policy " << policy << ": " << stats.flushes << " flushes, "
+             << (double) stats.nodes_touched / stats.cascades << " nodes per cascade" << endl;
+    }
+    cout << "done." << endl;
+}
+
+void replacementPolicyTest(int size) {
+    cout << "entered replacementPolicyTest..." << endl;
+    replacement_hook h[4];
+    lru_policy lru;
+    for (int i = 0; i < 4; i++) {
+        lru.insert(&h[i]);
+    }
+    // pinning h[0] takes it out, unpinning makes it the most recent.
+    lru.remove(&h[0]);
+    lru.insert(&h[0]);
+    assert(lru.victim() == &h[1]);
+    lru.remove(&h[1]);
+    assert(lru.victim() == &h[2] && lru.size() == 3);
+    while (lru.victim() != NULL) {
+        lru.remove(lru.victim());
+    }
+
+    clock_policy clock;
+    for (int i = 0; i < 4; i++) {
+        clock.insert(&h[i]);
+    }
+    // the first sweep clears every bit, the second chance is spent.
+    assert(clock.victim() == &h[0]);
+    clock.remove(&h[0]);
+    clock.remove(&h[2]);
+    clock.insert(&h[2]);
+    assert(clock.victim() == &h[1]);
+    clock.remove(&h[1]);
+    assert(clock.victim() == &h[3]);
+    clock.remove(&h[3]);
+    assert(clock.victim() == &h[2]);
+    clock.remove(&h[2]);
+    assert(clock.victim() == NULL && clock.size() == 0);
+
+    // the same tree under each policy, switched while the cache is full.
+    clock_policy tree_clock;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    for (int i = 0; i < size; i++) {
+        if (i == size / 3) {
+            sspace.set_replacement_policy(&tree_clock);
+        } else if (i == 2 * size / 3) {
+            sspace.set_replacement_policy(NULL);
+        }
+        tree.insert((i * 7919) % size, i);
+    }
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i));
+    }
+    cout << "done." << endl;
+}
+
+// no object limit to speak of, the byte budget alone keeps the cache small.
+void byteBudgetTest(int size) {
+    cout << "entered byteBudgetTest..." << endl;
+    const uint64_t budget = 16 * 1024;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 1000000, BINARY_FORMAT, budget);
+    BEpsilonTree<int64_t,int64_t,16> tree(&sspace);
+    for (int i = 0; i < size; i++) {
+        tree.insert((i * 7919) % size, i);
+        assert(sspace.resident_bytes() <= budget);
+    }
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i));
+    }
+    assert(sspace.resident_bytes() > 0 && sspace.peak_resident_bytes() >= sspace.resident_bytes());
+
+    // a larger budget keeps more of the tree, lowering it evicts right away.
+    sspace.set_cache_bytes(0);
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i));
+    }
+    uint64_t everything = sspace.resident_bytes();
+    assert(everything > budget && sspace.peak_resident_bytes() >= everything);
+    sspace.set_cache_bytes(budget);
+    assert(sspace.resident_bytes() <= budget && sspace.cache_bytes() == budget);
+    cout << "done." << endl;
+}
+
+// once everything is written back, queries through a small cache must not write anything again.
+void readOnlyTest(int size) {
+    cout << "entered readOnlyTest..." << endl;
+    SyncCountingStore store("dd/readonly.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    for (int i = 0; i < size; i++) {
+        tree.insert((i * 7919) % size, i);
+    }
+    tree.sync();
+    int writes = store.writes;
+
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        assert(tree.pointQuery(i, value) && tree.contains(i));
+    }
+    int count = 0;
+    tree.rangeQuery(0, size, [&count](const int64_t &key, const int64_t &value) {
+        count++;
+    });
+    assert(count == size);
+    tree.sync();
+    assert(store.writes == writes);
+    cout << "done." << endl;
+}
+
+// the writer cleans nodes while the tree keeps changing and re-dirtying them.
+void backgroundWritebackTest(int size) {
+    cout << "entered backgroundWritebackTest..." << endl;
+    SyncCountingStore store("dd/writeback.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 20);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    sspace.start_background_writeback(8, 1);
+    map<int64_t, int64_t> expected;
+    for (int i = 0; i < size; i++) {
+        int64_t key = (i * 7919) % size;
+        tree.insert(key, i);
+        expected[key] = i;
+        if (i % 5 == 0) {
+            tree.remove((i * 104729) % size);
+            expected.erase((i * 104729) % size);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(sspace.background_writes() > 0);
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i) == (expected.count(i) == 1));
+    }
+    sspace.stop_background_writeback();
+
+    // what the writer left clean is really on the store: drop the cache and read it all back.
+    tree.sync();
+    sspace.set_cache_size(1);
+    sspace.set_cache_size(20);
+    vector<pair<int64_t, int64_t> > found;
+    tree.rangeQuery(0, size, [&found](const int64_t &key, const int64_t &value) {
+        found.push_back(make_pair(key, value));
+    });
+    vector<pair<int64_t, int64_t> > wanted(expected.begin(), expected.end());
+    assert(found == wanted);
+    cout << "done." << endl;
+}
+
+void checkCompression(const std::string &raw) {
+    std::string packed;
+    lz_compress(raw.data(), raw.size(), packed);
+    std::string unpacked(raw.size(), '\0');
+    assert(lz_decompress(packed.data(), packed.size(), &unpacked[0], unpacked.size()));
+    assert(unpacked == raw);
+    unpacked.resize(raw.size() + 1);
+    assert(!lz_decompress(packed.data(), packed.size(), &unpacked[0], unpacked.size()));
+}
+
+void compressedTierTest(int size) {
+    cout << "entered compressedTierTest..." << endl;
+    checkCompression("");
+    checkCompression("abc");
+    checkCompression(std::string(100000, 'x'));
+    std::string mixed;
+    for (int i = 0; i < 20000; i++) {
+        mixed += (char) (i % 7 == 0 ? rand() : 'a' + i % 13);
+    }
+    checkCompression(mixed);
+    std::string noise;
+    for (int i = 0; i < 5000; i++) {
+        noise += (char) rand();
+    }
+    checkCompression(noise);
+
+    // the whole tree fits in the compressed tier: nothing reaches the store before a sync.
+    SyncCountingStore store("dd/compressed.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 10);
+    sspace.set_compressed_cache_bytes(4 * 1024 * 1024);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    for (int i = 0; i < size; i++) {
+        tree.insert((i * 7919) % size, i);
+    }
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i));
+    }
+    assert(store.writes == 0 && sspace.compressed_hits() > 0);
+    assert(sspace.compressed_bytes() > 0 && sspace.compressed_bytes() <= sspace.compressed_cache_bytes());
+
+    // after the sync the tier holds clean images, dropping it writes nothing more.
+    tree.sync();
+    int writes = store.writes;
+    assert(writes > 0);
+    sspace.set_compressed_cache_bytes(0);
+    assert(sspace.compressed_bytes() == 0 && store.writes == writes);
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, -i);
+    }
+
+    // a tier too small for the tree spills to the store on its own.
+    sspace.set_compressed_cache_bytes(2048);
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        assert(tree.pointQuery(i, value) && value == -i);
+    }
+    assert(store.writes > writes && sspace.compressed_bytes() <= 2048);
+
+    // dirty objects that were only ever compressed are freed without touching the store.
+    SyncCountingStore small("dd/compressed-free.db");
+    small.set_durability(NO_SYNC);
+    swap_space boys(&small, 1);
+    boys.set_compressed_cache_bytes(1024 * 1024);
+    {
+        swap_space::pointer<Boy> first = boys.allocate(new Boy());
+        swap_space::pointer<Boy> second = boys.allocate(new Boy());
+        assert(!first.is_in_memory() && boys.compressed_bytes() > 0);
+    }
+    assert(boys.compressed_bytes() == 0 && small.writes == 0);
+    cout << "done." << endl;
+}
+
+void compressedStoreTest(int size) {
+    cout << "entered compressedStoreTest..." << endl;
+    paged_file_backing_store pages("dd/pages.db");
+    pages.set_durability(NO_SYNC);
+    pages.set_compression(LZ_COMPRESSION);
+    std::string image(10000, 'x'), page, buf;
+    size_t length;
+    pages.encode_page(image, page);
+    assert(page.length() < image.length() / 10);
+    const char *data = pages.decode_page(page.data(), page.length(), buf, length);
+    assert(data != NULL && std::string(data, length) == image);
+    page[1]++;
+    assert(pages.decode_page(page.data(), page.length(), buf, length) == NULL);
+    // noise doesn't shrink and is stored as it is, decoding it is a view into the page.
+    image.clear();
+    for (int i = 0; i < 1000; i++) {
+        image += (char) rand();
+    }
+    pages.encode_page(image, page);
+    data = pages.decode_page(page.data(), page.length(), buf, length);
+    assert(data == page.data() + page.length() - image.length() && std::string(data, length) == image);
+
+    // nodes are written half compressed and half not, and read back through views.
+    mmap_backing_store mbs("dd/mmap-compressed.db");
+    mbs.set_durability(NO_SYNC);
+    mbs.set_compression(LZ_COMPRESSION);
+    swap_space sspace(&mbs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    for (int i = 0; i < size; i++) {
+        if (i == size / 2) {
+            mbs.set_compression(NO_COMPRESSION);
+        }
+        tree.insert((i * 7919) % size, i);
+    }
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        assert(tree.pointQuery((i * 7919) % size, value) && value == i);
+    }
+    assert(mbs.page_bytes_encoded() < mbs.image_bytes_encoded());
+    cout << "done." << endl;
+}
+
+template<class Store>
+void checkReopened(Store &store, int size, int expected_size) {
+    swap_space sspace(&store, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    assert(tree.open());
+    // only the superblock is read.
+    assert(sspace.resident_bytes() == 0 && tree.size() == expected_size);
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        assert(tree.pointQuery(i, value) == (i < expected_size) && (i >= expected_size || value == i + 1));
+    }
+    // changes after the checkpoint are gone again after the next restart.
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, -1);
+    }
+}
+
+void persistenceTest(int size) {
+    cout << "entered persistenceTest..." << endl;
+    {
+        paged_file_backing_store store("dd/persist.db");
+        store.set_durability(NO_SYNC);
+        swap_space sspace(&store, 10);
+        BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+        assert(!tree.open());
+        for (int i = 0; i < size / 2; i++) {
+            tree.insert(i, i + 1);
+        }
+        tree.checkpoint();
+        for (int i = size / 2; i < size; i++) {
+            tree.insert(i, i + 1);
+        }
+        tree.checkpoint();
+        for (int i = 0; i < size; i++) {
+            tree.insert(i, -1);
+        }
+    }
+    {
+        paged_file_backing_store store("dd/persist.db", paged_file_backing_store::PAGE_SIZE, OPEN_STORE);
+        store.set_durability(NO_SYNC);
+        checkReopened(store, size, size);
+    }
+    {
+        // the same file through a mapping, and a checkpoint of a reopened tree.
+        mmap_backing_store store("dd/persist.db", paged_file_backing_store::PAGE_SIZE,
+                                 64ULL * 1024 * 1024 * 1024, OPEN_STORE);
+        store.set_durability(NO_SYNC);
+        swap_space sspace(&store, 10);
+        BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+        assert(tree.open());
+        for (int i = size / 3; i < size; i++) {
+            tree.remove(i);
+        }
+        tree.checkpoint();
+    }
+    {
+        paged_file_backing_store store("dd/persist.db", paged_file_backing_store::PAGE_SIZE, OPEN_STORE);
+        store.set_durability(NO_SYNC);
+        checkReopened(store, size, size / 3);
+    }
+
+    mkdir("dd/persist", 0755);
+    {
+        one_file_per_object_backing_store store("dd/persist");
+        store.set_durability(NO_SYNC);
+        swap_space sspace(&store, 10);
+        BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+        assert(!tree.open());
+        for (int i = 0; i < size; i++) {
+            tree.insert(i, i + 1);
+        }
+        tree.checkpoint();
+    }
+    {
+        one_file_per_object_backing_store store("dd/persist");
+        store.set_durability(NO_SYNC);
+        checkReopened(store, size, size);
+    }
+    {
+        one_file_per_object_backing_store store("dd/persist");
+        store.set_durability(NO_SYNC);
+        checkReopened(store, size, size);
+    }
+    cout << "done." << endl;
+}
+
+// the operations of writeAheadLogTest from first on, applied to expected as well.
+void logOperations(BEpsilonTree<int64_t,int64_t,3> &tree, map<int64_t, int64_t> &expected, int first, int size) {
+    for (int i = first; i < size; i++) {
+        tree.insert(i, i);
+        expected[i] = i;
+        if (i % 7 == 0) {
+            tree.upsert(i / 2, 100);
+            expected[i / 2] += 100;
+        }
+        if (i % 11 == 0) {
+            tree.remove(i / 3);
+            expected.erase(i / 3);
+        }
+    }
+    BEpsilonTree<int64_t,int64_t,3>::WriteBatch batch;
+    for (int i = first; i < size; i += 5) {
+        batch.remove(i);
+        expected.erase(i);
+    }
+    tree.write(batch);
+}
+
+void writeAheadLogTest(int size) {
+    cout << "entered writeAheadLogTest..." << endl;
+    {
+        write_ahead_log wal("dd/records.wal");
+        assert(wal.append("one") == 1 && wal.append("") == 2 && wal.append("three") == 3);
+    }
+    {
+        // a torn record at the end is dropped when the log is opened.
+        std::ofstream torn("dd/records.wal", std::ios::app | std::ios::binary);
+        torn << "garbage after the last record";
+    }
+    {
+        write_ahead_log wal("dd/records.wal", OPEN_STORE);
+        assert(wal.last_sequence() == 3);
+        vector<std::string> records;
+        wal.replay(1, [&](uint64_t seq, const std::string &record) { records.push_back(record); });
+        assert(records.size() == 2 && records[0] == "" && records[1] == "three");
+        wal.truncate(2);
+        records.clear();
+        wal.replay(0, [&](uint64_t seq, const std::string &record) { records.push_back(record); });
+        assert(records.size() == 1 && records[0] == "three");
+        wal.truncate(3);
+        assert(wal.append("four") == 4);
+    }
+
+    CounterMerge<int64_t> counter;
+    map<int64_t, int64_t> expected;
+    int tree_size;
+    {
+        paged_file_backing_store store("dd/logged.db");
+        store.set_durability(NO_SYNC);
+        swap_space sspace(&store, 10);
+        write_ahead_log wal("dd/tree.wal");
+        wal.set_durability(GROUP_COMMIT);
+        BEpsilonTree<int64_t,int64_t,3> tree(&sspace, &counter);
+        tree.setWriteAheadLog(&wal);
+        logOperations(tree, expected, 0, size / 2);
+        tree.checkpoint();
+        assert(wal.bytes() == 16);
+        // nothing of this is checkpointed, it comes back from the log alone.
+        logOperations(tree, expected, size / 2, size);
+        wal.sync();
+        tree_size = tree.size();
+    }
+    {
+        paged_file_backing_store store("dd/logged.db", paged_file_backing_store::PAGE_SIZE, OPEN_STORE);
+        store.set_durability(NO_SYNC);
+        swap_space sspace(&store, 10);
+        write_ahead_log wal("dd/tree.wal", OPEN_STORE);
+        BEpsilonTree<int64_t,int64_t,3> tree(&sspace, &counter);
+        tree.setWriteAheadLog(&wal);
+        assert(tree.open());
+        assert(tree.size() == tree_size);
+        for (int i = 0; i < size; i++) {
+            int64_t value;
+            bool found = tree.pointQuery(i, value);
+            assert(found == (expected.count(i) == 1));
+            assert(!found || value == expected[i]);
+        }
+    }
+
+    // appenders on several threads share syncs.
+    write_ahead_log wal("dd/shared.wal");
+    vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&wal]() {
+            for (int i = 0; i < 50; i++) {
+                wal.append("record");
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    int records = 0;
+    wal.replay(0, [&](uint64_t seq, const std::string &record) { assert(record == "record"); records++; });
+    assert(records == 200 && wal.last_sequence() == 200 && wal.syncs() <= 200);
+
+    // appenders that wait for durability only after letting go of a lock of their own, as the tree's
+    // writers do, share one sync.
+    write_ahead_log deferred("dd/deferred.wal");
+    vector<uint64_t> sequences(4);
+    threads.clear();
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&deferred, &sequences, t]() {
+            sequences[t] = deferred.append("record", false);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    threads.clear();
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&deferred, &sequences, t]() {
+            deferred.wait_durable(sequences[t]);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    assert(deferred.last_sequence() == 4 && deferred.syncs() == 1);
+
+    // writers on several threads log under the tree's latch and sync after it, so they share syncs.
+    paged_file_backing_store store("dd/shared-logged.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 10);
+    write_ahead_log logged("dd/shared-tree.wal");
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    tree.setWriteAheadLog(&logged);
+    tree.setConcurrentReaders(true);
+    threads.clear();
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&tree, t]() {
+            for (int i = t; i < 400; i += 4) {
+                tree.insert(i, i);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    assert(tree.size() == 400 && logged.last_sequence() == 400 && logged.syncs() < 400);
+    cout << "done." << endl;
+}
+
+void checkSnapshot(const BEpsilonTree<int64_t,int64_t,3>::Snapshot &snapshot, const map<int64_t, int64_t> &expected,
+                   int size) {
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        bool found = snapshot.pointQuery(i, value);
+        assert(found == (expected.count(i) == 1));
+        assert(!found || value == expected.at(i));
+    }
+    int ranges[][2] = {{-10, 2 * size}, {5, 5}, {size / 3, size / 2}};
+    for (auto &range : ranges) {
+        vector<pair<int64_t, int64_t> > found;
+        snapshot.rangeQuery(range[0], range[1], [&found](const int64_t &key, const int64_t &value) {
+            found.push_back(make_pair(key, value));
+        });
+        vector<pair<int64_t, int64_t> > wanted(expected.lower_bound(range[0]), expected.upper_bound(range[1]));
+        assert(found == wanted);
+    }
+}
+
+void snapshotTest(int size) {
+    cout << "entered snapshotTest..." << endl;
+    SyncCountingStore store("dd/snapshot.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 10);
+    CounterMerge<int64_t> counter;
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace, &counter);
+    map<int64_t, int64_t> expected;
+    for (int i = 0; i < size; i += 2) {
+        tree.insert(i, i);
+        expected[i] = i;
+    }
+    {
+        BEpsilonTree<int64_t,int64_t,3>::Snapshot first = tree.snapshot();
+        map<int64_t, int64_t> first_expected = expected;
+        for (int i = 0; i < size; i += 3) {
+            tree.remove(i);
+            expected.erase(i);
+        }
+        BEpsilonTree<int64_t,int64_t,3>::Snapshot second = tree.snapshot();
+        map<int64_t, int64_t> second_expected = expected;
+        for (int i = 0; i < size; i++) {
+            tree.upsert(i, 7);
+            expected[i] += 7;
+        }
+        assert(sspace.snapshot_bytes() > 0);
+        assert(first.size() == (int)first_expected.size());
+        checkSnapshot(first, first_expected, size);
+        checkSnapshot(second, second_expected, size);
+
+        // the callback may change the tree under a scan of the snapshot.
+        int seen = 0;
+        second.rangeQuery(0, size, [&](const int64_t &key, const int64_t &value) {
+            tree.insert(key, -1);
+            expected[key] = -1;
+            seen++;
+        });
+        assert(seen == (int)second_expected.size());
+        checkSnapshot(second, second_expected, size);
+
+        // a copy shares the snapshot.
+        first = second;
+        checkSnapshot(first, second_expected, size);
+        checkSnapshot(tree.snapshot(), expected, size);
+    }
+    assert(sspace.snapshot_bytes() == 0);
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        bool found = tree.pointQuery(i, value);
+        assert(found == (expected.count(i) == 1));
+        assert(!found || value == expected[i]);
+    }
+
+    // snapshots released out of order leave the others what they read, the copies go off the store.
+    typedef BEpsilonTree<int64_t,int64_t,3>::Snapshot Snapshot;
+    int deallocations = store.deallocations;
+    std::unique_ptr<Snapshot> older(new Snapshot(tree.snapshot()));
+    map<int64_t, int64_t> older_expected = expected;
+    for (int i = 0; i < size; i += 5) {
+        tree.insert(i, i + 1);
+        expected[i] = i + 1;
+    }
+    std::unique_ptr<Snapshot> middle(new Snapshot(tree.snapshot()));
+    for (int i = 0; i < size; i += 7) {
+        tree.remove(i);
+        expected.erase(i);
+    }
+    std::unique_ptr<Snapshot> newer(new Snapshot(tree.snapshot()));
+    map<int64_t, int64_t> newer_expected = expected;
+    for (int i = 0; i < size; i++) {
+        tree.upsert(i, 1);
+        expected[i] += 1;
+    }
+    uint64_t bytes = sspace.snapshot_bytes();
+    middle.reset();
+    assert(sspace.snapshot_bytes() < bytes);
+    checkSnapshot(*older, older_expected, size);
+    checkSnapshot(*newer, newer_expected, size);
+    older.reset();
+    checkSnapshot(*newer, newer_expected, size);
+    newer.reset();
+    assert(sspace.snapshot_bytes() == 0 && store.deallocations > deallocations);
+    cout << "done." << endl;
+}
+
+// readers look up the even keys, which the writer leaves alone, while it inserts and removes odd ones.
+void concurrentReadersTest(int size) {
+    cout << "entered concurrentReadersTest..." << endl;
+    paged_file_backing_store store("dd/concurrent.db");
+    store.set_durability(NO_SYNC);
+    swap_space sspace(&store, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    for (int i = 0; i < size; i += 2) {
+        tree.insert(i, i);
+    }
+    tree.setConcurrentReaders(true);
+    BEpsilonTree<int64_t,int64_t,3>::Snapshot before = tree.snapshot();
+
+    std::atomic<bool> writing(true);
+    std::atomic<int> lookups(0);
+    vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.push_back(std::thread([&, t]() {
+            uint64_t seed = t + 1;
+            do {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                int64_t key = 2 * ((seed >> 33) % (size / 2));
+                int64_t value;
+                assert(tree.pointQuery(key, value) && value == key);
+                assert(before.pointQuery(key, value) && value == key && !before.contains(key + 1));
+                lookups++;
+            } while (writing || lookups < 1000);
+        }));
+    }
+    for (int i = 1; i < size; i += 2) {
+        tree.insert(i, i);
+        if (i % 3 == 0) {
+            tree.remove(i);
+        }
+    }
+    writing = false;
+    for (size_t t = 0; t < readers.size(); t++) {
+        readers[t].join();
+    }
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        bool found = tree.pointQuery(i, value);
+        assert(found == (i % 2 == 0 || i % 3 != 0));
+        assert(!found || value == i);
+    }
+
+    // a miss waiting on the store doesn't hold up a hit on another thread.
+    GatedStore gated("dd/gated.db");
+    gated.set_durability(NO_SYNC);
+    swap_space boys(&gated, 1);
+    boys.set_thread_safe(true);
+    swap_space::pointer<Boy> evicted = boys.allocate(new Boy());
+    swap_space::pointer<Boy> resident = boys.allocate(new Boy());
+    assert(!evicted.is_in_memory() && resident.is_in_memory());
+    std::thread miss([&evicted]() { evicted->print(); });
+    gated.waitForReader();
+    resident->print();
+    gated.openGate();
+    miss.join();
+    cout << "done." << endl;
+}
+
+void checkSharded(ShardedBEpsilonTree<int64_t,int64_t,3> &tree, const map<int64_t, int64_t> &expected, int size) {
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        bool found = tree.pointQuery(i, value);
+        assert(found == (expected.count(i) == 1));
+        assert(!found || value == expected.at(i));
+    }
+    int ranges[][2] = {{-10, 2 * size}, {size / 4 - 3, size / 4 + 3}, {size / 3, 3 * size / 4}};
+    for (auto &range : ranges) {
+        vector<pair<int64_t, int64_t> > found;
+        tree.rangeQuery(range[0], range[1], [&found](const int64_t &key, const int64_t &value) {
+            found.push_back(make_pair(key, value));
+        });
+        vector<pair<int64_t, int64_t> > wanted(expected.lower_bound(range[0]), expected.upper_bound(range[1]));
+        assert(found == wanted);
+    }
+}
+
+void shardedTreeTest(int size) {
+    cout << "entered shardedTreeTest..." << endl;
+    vector<int64_t> splits = {size / 4, size / 2, 3 * size / 4};
+    CounterMerge<int64_t> counter;
+    map<int64_t, int64_t> expected;
+    int tree_size;
+    {
+        vector<std::unique_ptr<paged_file_backing_store> > stores;
+        vector<backing_store *> shard_stores;
+        for (int i = 0; i < 4; i++) {
+            stores.push_back(std::unique_ptr<paged_file_backing_store>(
+                    new paged_file_backing_store("dd/shard" + std::to_string(i) + ".db")));
+            stores.back()->set_durability(NO_SYNC);
+            shard_stores.push_back(stores.back().get());
+        }
+        ShardedBEpsilonTree<int64_t,int64_t,3> tree(shard_stores, splits, 10, &counter);
+        assert(tree.shards() == 4 && tree.shardIndex(size / 4 - 1) == 0 && tree.shardIndex(size / 4) == 1);
+
+        // every thread writes keys of every shard.
+        vector<std::thread> writers;
+        for (int t = 0; t < 4; t++) {
+            writers.push_back(std::thread([&tree, t, size]() {
+                for (int i = t; i < size; i += 4) {
+                    tree.insert(i, i);
+                    tree.upsert(i, 1);
+                    if (i % 5 == 0) {
+                        tree.remove(i);
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < writers.size(); t++) {
+            writers[t].join();
+        }
+        for (int i = 0; i < size; i++) {
+            if (i % 5 != 0) {
+                expected[i] = i + 1;
+            }
+        }
+        checkSharded(tree, expected, size);
+        assert(tree.shard(0).size() > 0 && tree.shard(3).size() > 0);
+        tree.checkpoint();
+        tree_size = tree.size();
+    }
+    {
+        vector<std::unique_ptr<paged_file_backing_store> > stores;
+        vector<backing_store *> shard_stores;
+        for (int i = 0; i < 4; i++) {
+            stores.push_back(std::unique_ptr<paged_file_backing_store>(new paged_file_backing_store(
+                    "dd/shard" + std::to_string(i) + ".db", paged_file_backing_store::PAGE_SIZE, OPEN_STORE)));
+            stores.back()->set_durability(NO_SYNC);
+            shard_stores.push_back(stores.back().get());
+        }
+        ShardedBEpsilonTree<int64_t,int64_t,3> tree(shard_stores, splits, 10, &counter);
+        assert(tree.open());
+        assert(tree.size() == tree_size);
+        checkSharded(tree, expected, size);
+    }
+
+    paged_file_backing_store store("dd/unsharded.db");
+    store.set_durability(NO_SYNC);
+    vector<backing_store *> one_store(2, &store);
+    bool thrown = false;
+    try {
+        ShardedBEpsilonTree<int64_t,int64_t,3> tree(one_store, vector<int64_t>(), 10);
+    } catch (InvalidShardSplits &e) {
+        thrown = true;
+    }
+    assert(thrown);
+    cout << "done." << endl;
+}
+
+void messageBufferCapacityTest(int size) {
+    cout << "entered messageBufferCapacityTest..." << endl;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    uint64_t flushes[2];
+    size_t capacities[] = {1, 20};
+    for (int c = 0; c < 2; c++) {
+        BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+        tree.setMessageBufferCapacity(capacities[c]);
+        assert(tree.messageBufferCapacity() == capacities[c]);
+        map<int64_t, int64_t> expected;
+        for (int i = 0; i < size; i++) {
+            int64_t key = i * 7919 % size;
+            tree.insert(key, i);
+            expected[key] = i;
+            if (i % 4 == 0) {
+                tree.remove(i / 2);
+                expected.erase(i / 2);
+            }
+        }
+        for (int i = 0; i < size; i++) {
+            int64_t value;
+            bool found = tree.pointQuery(i, value);
+            assert(found == (expected.count(i) == 1));
+            assert(!found || value == expected[i]);
+        }
+        flushes[c] = tree.flushStats().flushes;
+    }
+    // with room for one message every operation flushes all the way down, a B+ tree.
+    assert(flushes[0] > flushes[1]);
+    cout << "done." << endl;
+}
+
+void workloadTest(int size) {
+    cout << "entered workloadTest..." << endl;
+    workload_mix mix;
+    assert(!ycsb_workload('G', mix));
+    for (char name = 'A'; name <= 'F'; name++) {
+        assert(ycsb_workload(name, mix));
+        workload_generator first(mix, size, 7), second(mix, size, 7);
+        int reads = 0, inserts = 0;
+        for (int i = 0; i < size; i++) {
+            workload_op a = first.next(), b = second.next();
+            assert(a.opcode == b.opcode && a.key == b.key && a.scan_length == b.scan_length);
+            assert(a.opcode != SCAN_OP || (a.scan_length >= 1 && a.scan_length <= 100));
+            reads += a.opcode == READ_OP;
+            inserts += a.opcode == INSERT_OP;
+        }
+        assert(first.records() == (uint64_t) (size + inserts));
+        if (name == 'A' || name == 'F') {
+            assert(reads > size * 0.45 && reads < size * 0.55);
+        } else if (name == 'C') {
+            assert(reads == size);
+        }
+    }
+
+    // the most popular record of a zipfian workload takes far more than its share.
+    const key_distribution distributions[] = {UNIFORM_KEYS, ZIPFIAN_KEYS, LATEST_KEYS, SEQUENTIAL_KEYS};
+    for (key_distribution distribution : distributions) {
+        workload_mix reads_only = {1, 0, 0, 0, 0, distribution, 0, true};
+        workload_generator generator(reads_only, size, 3);
+        map<uint64_t, int> hits;
+        int most = 0;
+        for (int i = 0; i < 10 * size; i++) {
+            workload_op op = generator.next();
+            assert(op.key < (uint64_t) size);
+            most = max(most, ++hits[op.key]);
+        }
+        if (distribution == ZIPFIAN_KEYS || distribution == LATEST_KEYS) {
+            assert(most > size / 2);
+        } else {
+            assert(most < 40);
+        }
+        if (distribution == LATEST_KEYS) {
+            assert(hits[size - 1] == most);
+        }
+    }
+
+    // a recorded trace runs again on a tree of another B and buffer size to the same contents.
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    CounterMerge<int64_t> counter;
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace, &counter);
+    std::stringstream trace;
+    tree.setTrace(&trace);
+    assert(ycsb_workload('A', mix));
+    workload_generator generator(mix, size, 11);
+    for (int r = 0; r < size; r++) {
+        tree.insert(generator.record_key(r), r);
+    }
+    uint64_t operations = size;
+    for (int i = 0; i < size; i++) {
+        workload_op op = generator.next();
+        int64_t value;
+        if (op.opcode == READ_OP) {
+            tree.pointQuery(op.key, value);
+        } else if (i % 3 == 0) {
+            tree.upsert(op.key, 1);
+        } else {
+            tree.remove(op.key);
+        }
+        operations++;
+    }
+    BEpsilonTree<int64_t,int64_t,3>::WriteBatch batch;
+    batch.insert(5, 5);
+    batch.remove(generator.record_key(0));
+    tree.write(batch);
+    vector<pair<int64_t, int64_t> > scanned;
+    tree.scan(INT64_MIN, 10, [&scanned](const int64_t &key, const int64_t &value) {
+        scanned.push_back(make_pair(key, value));
+    });
+    tree.rangeQuery(0, 100, [](const int64_t &, const int64_t &) {});
+    operations += 3;
+    tree.setTrace(NULL);
+    tree.insert(6, 6);
+
+    BEpsilonTree<int64_t,int64_t,4> replayed(&sspace, &counter);
+    replayed.setMessageBufferCapacity(1);
+    assert(replayed.replayTrace(trace) == operations);
+    vector<pair<int64_t, int64_t> > all, replayed_all;
+    tree.remove(6);
+    tree.rangeQuery(INT64_MIN, INT64_MAX, [&all](const int64_t &key, const int64_t &value) {
+        all.push_back(make_pair(key, value));
+    });
+    replayed.rangeQuery(INT64_MIN, INT64_MAX, [&replayed_all](const int64_t &key, const int64_t &value) {
+        replayed_all.push_back(make_pair(key, value));
+    });
+    assert(all == replayed_all);
+    assert(scanned.size() == 10 && std::equal(scanned.begin(), scanned.end(), all.begin()));
+
+    std::stringstream garbage("not a trace");
+    bool thrown = false;
+    try {
+        replayed.replayTrace(garbage);
+    } catch (InvalidTraceException &e) {
+        thrown = true;
+    }
+    assert(thrown);
+    cout << "done." << endl;
+}
+
+// the value of an unlabeled sample in a Prometheus text dump, -1 if it isn't there.
+double metricValue(const std::string &text, const std::string &name) {
+    std::stringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, name.size() + 1, name + " ") == 0) {
+            return std::stod(line.substr(name.size() + 1));
+        }
+    }
+    return -1;
+}
+
+std::string readFile(const std::string &filename) {
+    std::ifstream in(filename.c_str());
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+void statsTest(int size) {
+    cout << "entered statsTest..." << endl;
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    tree.setStatsDump("dd/metrics.prom", 3600 * 1000);
+    std::string text = readFile("dd/metrics.prom");
+    assert(metricValue(text, "bepsilon_tree_messages_inserted_total") == 0);
+    assert(metricValue(text, "bepsilon_cache_hits_total") == 0);
+
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, i);
+    }
+    TreeStats stats = tree.stats();
+    assert(stats.messages_inserted == (uint64_t) size);
+    assert(stats.splits > 0 && stats.leaf_applies > 0 && stats.flushes[0] > 0 && stats.flushes[1] > 0);
+    uint64_t flushes = 0, moved = 0;
+    for (int level = 0; level < TreeStats::LEVELS; level++) {
+        flushes += stats.flushes[level];
+        moved += stats.messages_moved[level];
+    }
+    assert(flushes == tree.flushStats().flushes && moved == tree.flushStats().messages_moved);
+
+    swap_space_stats before = sspace.stats();
+    for (int i = 0; i < size; i++) {
+        int64_t value;
+        assert(tree.pointQuery(i, value) && value == i);
+    }
+    swap_space_stats after = sspace.stats();
+    assert(after.hits > before.hits && after.misses > before.misses);
+    assert(after.loads > before.loads && after.bytes_read > before.bytes_read);
+    assert(after.loads == after.misses - after.compressed_hits);
+    assert(after.write_backs > 0 && after.bytes_written > 0);
+    assert(after.evictions > 0 && after.dirty_evictions <= after.evictions);
+    assert(after.resident_objects <= 10 && after.pin_waits == 0);
+
+    // the removes reach the leaves right away, the internal buffers would keep most of them.
+    tree.setMessageBufferCapacity(1);
+    for (int i = 0; i < size - 10; i++) {
+        tree.remove(i);
+    }
+    stats = tree.stats();
+    assert(stats.messages_inserted == (uint64_t) (2 * size - 10));
+    assert(stats.merges > 0 && stats.borrows > 0);
+
+    // not due yet, the file still holds the first dump.
+    assert(readFile("dd/metrics.prom") == text);
+    // stopping the dumps writes a last one, which stays.
+    tree.setStatsDump("", 0);
+    text = readFile("dd/metrics.prom");
+    assert(metricValue(text, "bepsilon_tree_messages_inserted_total") == 2 * size - 10);
+    assert(metricValue(text, "bepsilon_tree_keys") == 10);
+    assert(metricValue(text, "bepsilon_tree_splits_total") == tree.stats().splits);
+    assert(metricValue(text, "bepsilon_cache_loads_total") == sspace.stats().loads);
+    assert(text.find("bepsilon_tree_flushes_total{level=\"1\"}") != std::string::npos);
+    assert(text.find("# TYPE bepsilon_cache_evictions_total counter") != std::string::npos);
+    tree.insert(size, size);
+    assert(readFile("dd/metrics.prom") == text);
+
+    // the timer dumps on its own, with no write to set it off; the tree stops it when it goes.
+    tree.setStatsDump("dd/metrics.prom", 5);
+    tree.insert(size + 1, size + 1);
+    for (int wait = 0; metricValue(readFile("dd/metrics.prom"), "bepsilon_tree_keys") != 12; wait++) {
+        assert(wait < 10000);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    cout << "done." << endl;
+}
+
+void latencyTest(int size) {
+    cout << "entered latencyTest..." << endl;
+    // every value lands in a bucket whose top is at most 1/32 above it.
+    for (uint64_t v = 1; v != 0; v = v * 3 + 1) {
+        int bucket = latency_histogram::bucket(v);
+        assert(bucket < latency_histogram::BUCKETS);
+        assert(latency_histogram::bucket_top(bucket) >= v);
+        assert(latency_histogram::bucket_top(bucket) - v <= v / 32);
+        assert(bucket == 0 || latency_histogram::bucket_top(bucket - 1) < v);
+        if (v > UINT64_MAX / 3) {
+            break;
+        }
+    }
+    assert(latency_histogram::bucket(UINT64_MAX) == latency_histogram::BUCKETS - 1);
+
+    // 1..size, half of them recorded by each of two threads and merged.
+    latency_histogram halves[2];
+    std::thread odd([&halves, size]() {
+        for (int v = 1; v <= size; v += 2) {
+            halves[0].record(v);
+        }
+    });
+    for (int v = 2; v <= size; v += 2) {
+        halves[1].record(v);
+    }
+    odd.join();
+    latency_histogram all = halves[0];
+    all.merge(halves[1]);
+    assert(all.count() == (uint64_t) size && all.min() == 1 && all.max() == (uint64_t) size);
+    assert(all.total_value() == (uint64_t) size * (size + 1) / 2);
+    assert(all.p50() >= (uint64_t) size / 2 && all.p50() <= (uint64_t) (size / 2 + size / 64));
+    assert(all.p99() >= (uint64_t) (size * 0.99) && all.p99() <= size * 0.99 + size / 32);
+    assert(all.p999() >= all.p99() && all.p999() <= all.max() && all.percentile(1) == all.max());
+    assert(latency_histogram().p99() == 0);
+
+    shared_latency_histogram shared;
+    vector<std::thread> recorders;
+    for (int t = 0; t < 4; t++) {
+        recorders.push_back(std::thread([&shared, size]() {
+            for (int v = 1; v <= size; v++) {
+                shared.record(v);
+            }
+        }));
+    }
+    for (size_t t = 0; t < recorders.size(); t++) {
+        recorders[t].join();
+    }
+    assert(shared.merged().count() == 4 * (uint64_t) size && shared.merged().max() == (uint64_t) size);
+
+    one_file_per_object_backing_store ofpobs("dd");
+    ofpobs.set_durability(NO_SYNC);
+    swap_space sspace(&ofpobs, 10);
+    BEpsilonTree<int64_t,int64_t,3> tree(&sspace);
+    for (int i = 0; i < size; i++) {
+        tree.insert(i, i);
+    }
+    for (int i = 0; i < size; i++) {
+        assert(tree.contains(i));
+    }
+    for (int i = 0; i < size / 2; i++) {
+        tree.remove(i);
+    }
+    TreeLatencies latencies = tree.latencies();
+    assert(latencies.insert.count() == (uint64_t) size && latencies.remove.count() == (uint64_t) size / 2);
+    assert(latencies.point_query.count() == (uint64_t) size);
+    assert(latencies.flush.count() == tree.flushStats().cascades);
+    // a cascade runs inside the insert or remove that set it off.
+    assert(latencies.flush.max() <= std::max(latencies.insert.max(), latencies.remove.max()));
+    assert(latencies.insert.p50() <= latencies.insert.p99() && latencies.insert.p99() <= latencies.insert.p999());
+    assert(latencies.insert.p999() <= latencies.insert.max() && latencies.insert.min() > 0);
+
+    swap_space_latencies cache = sspace.latencies();
+    swap_space_stats stats = sspace.stats();
+    assert(cache.load.count() >= stats.loads && cache.load.count() > 0);
+    assert(cache.write_back.count() == stats.write_backs && cache.write_back.count() > 0);
+
+    std::stringstream metrics;
+    tree.writeMetrics(metrics);
+    assert(metricValue(metrics.str(), "bepsilon_tree_insert_seconds_count") == size);
+    assert(metricValue(metrics.str(), "bepsilon_cache_write_back_seconds_count") == stats.write_backs);
+    assert(metrics.str().find("bepsilon_tree_point_query_seconds{quantile=\"0.99\"}") != std::string::npos);
+    cout << "done." << endl;
+}
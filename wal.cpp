@@ -0,0 +1,281 @@
+#include "wal.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+static const uint64_t wal_magic = 0x31474f4c4c415742ULL; // "BWALLOG1"
+
+static uint64_t now_usecs(void)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct crc32_table {
+  uint32_t entry[256];
+
+  crc32_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+	c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      entry[i] = c;
+    }
+  }
+};
+
+static uint32_t crc32(uint32_t crc, const char *p, size_t n)
+{
+  static const crc32_table table;
+  crc = ~crc;
+  for (size_t i = 0; i < n; i++)
+    crc = table.entry[(crc ^ (uint8_t)p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void read_file(int fd, std::string &data)
+{
+  struct stat st;
+  int r = fstat(fd, &st);
+  assert(r == 0);
+  data.resize(st.st_size);
+  size_t done = 0;
+  while (done < data.length()) {
+    ssize_t n = pread(fd, &data[done], data.length() - done, done);
+    assert(n > 0);
+    done += n;
+  }
+}
+
+static void write_all(int fd, const char *p, size_t n, uint64_t offset)
+{
+  size_t done = 0;
+  while (done < n) {
+    ssize_t w = pwrite(fd, p + done, n - done, offset + done);
+    assert(w > 0);
+    done += w;
+  }
+}
+
+// Calls f for every intact record from offset on, returns where the
+// intact records end.
+template<class F>
+static size_t scan_records(const std::string &data, size_t offset, F f)
+{
+  while (offset + 16 <= data.length()) {
+    uint32_t length, checksum;
+    uint64_t seq;
+    memcpy(&length, &data[offset], 4);
+    memcpy(&checksum, &data[offset + 4], 4);
+    memcpy(&seq, &data[offset + 8], 8);
+    if (length > data.length() - offset - 16 ||
+	crc32(0, &data[offset + 8], 8 + length) != checksum)
+      break;
+    f(seq, &data[offset + 16], length);
+    offset += 16 + length;
+  }
+  return offset;
+}
+
+write_ahead_log::write_ahead_log(std::string fname, store_open_mode mode)
+  : filename(fname),
+    first_sequence(1),
+    next_sequence(1),
+    file_bytes(HEADER_BYTES),
+    durability(SYNC_EACH_WRITE),
+    window_bytes(1024 * 1024),
+    window_usecs(10000),
+    unsynced_bytes(0),
+    unsynced_since(0),
+    syncing(false),
+    synced_sequence(0),
+    sync_count(0)
+{
+  fd = open(filename.c_str(), O_RDWR | O_CREAT | (mode == CREATE_STORE ? O_TRUNC : 0), 0644);
+  assert(fd >= 0);
+  std::string data;
+  read_file(fd, data);
+  uint64_t magic = 0;
+  if (data.length() >= HEADER_BYTES)
+    memcpy(&magic, &data[0], 8);
+  if (magic != wal_magic) {
+    assert(data.empty());
+    write_header(1);
+    fdatasync(fd);
+    return;
+  }
+  memcpy(&first_sequence, &data[8], 8);
+  next_sequence = first_sequence;
+  file_bytes = scan_records(data, HEADER_BYTES, [&](uint64_t seq, const char *, size_t) {
+      next_sequence = seq + 1;
+    });
+  if (file_bytes < data.length()) {
+    int r = ftruncate(fd, file_bytes);
+    assert(r == 0);
+    fdatasync(fd);
+  }
+  synced_sequence = next_sequence - 1;
+}
+
+write_ahead_log::~write_ahead_log(void)
+{
+  close(fd);
+}
+
+void write_ahead_log::write_header(uint64_t first)
+{
+  uint64_t header[2] = { wal_magic, first };
+  write_all(fd, (const char *)header, sizeof(header), 0);
+}
+
+void write_ahead_log::set_durability(durability_mode mode, uint64_t wbytes, uint64_t wusecs)
+{
+  sync();
+  std::unique_lock<std::mutex> lock(mutex);
+  durability = mode;
+  window_bytes = wbytes;
+  window_usecs = wusecs;
+}
+
+uint64_t write_ahead_log::append(const std::string &record, bool wait)
+{
+  std::string buf(RECORD_HEADER_BYTES + record.length(), '\0');
+  uint32_t length = record.length();
+  memcpy(&buf[0], &length, 4);
+  memcpy(&buf[RECORD_HEADER_BYTES], record.data(), record.length());
+
+  std::unique_lock<std::mutex> lock(mutex);
+  uint64_t seq = next_sequence++;
+  memcpy(&buf[8], &seq, 8);
+  uint32_t checksum = crc32(0, &buf[8], 8 + record.length());
+  memcpy(&buf[4], &checksum, 4);
+  write_all(fd, buf.data(), buf.length(), file_bytes);
+  file_bytes += buf.length();
+
+  if (unsynced_bytes == 0)
+    unsynced_since = now_usecs();
+  unsynced_bytes += buf.length();
+  if (wait)
+    make_durable(seq, lock);
+  return seq;
+}
+
+void write_ahead_log::wait_durable(uint64_t seq)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  make_durable(seq, lock);
+}
+
+void write_ahead_log::make_durable(uint64_t seq, std::unique_lock<std::mutex> &lock)
+{
+  switch (durability) {
+  case SYNC_EACH_WRITE:
+    sync_to(seq, lock);
+    break;
+  case GROUP_COMMIT:
+    if (unsynced_bytes >= window_bytes || now_usecs() - unsynced_since >= window_usecs)
+      sync_to(seq, lock);
+    break;
+  case NO_SYNC:
+    break;
+  }
+}
+
+void write_ahead_log::sync(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  sync_to(next_sequence - 1, lock);
+}
+
+// The first waiter syncs everything appended so far without the lock,
+// the others wait for it and find their records covered.
+void write_ahead_log::sync_to(uint64_t seq, std::unique_lock<std::mutex> &lock)
+{
+  while (synced_sequence < seq) {
+    if (syncing) {
+      synced.wait(lock);
+      continue;
+    }
+    syncing = true;
+    uint64_t target = next_sequence - 1;
+    lock.unlock();
+    fdatasync(fd);
+    lock.lock();
+    syncing = false;
+    synced_sequence = std::max(synced_sequence, target);
+    if (target == next_sequence - 1)
+      unsynced_bytes = 0;
+    sync_count++;
+    synced.notify_all();
+  }
+}
+
+void write_ahead_log::replay(uint64_t after, std::function<void(uint64_t, const std::string &)> apply)
+{
+  std::string data;
+  uint64_t first;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    read_file(fd, data);
+    first = first_sequence;
+  }
+  scan_records(data, HEADER_BYTES, [&](uint64_t seq, const char *p, size_t n) {
+      if (seq > after && seq >= first)
+	apply(seq, std::string(p, n));
+    });
+}
+
+// With nothing left to keep, the header moves past upto before the
+// records go, so a crash in between leaves only records that are
+// skipped.  Otherwise the records that stay are copied to a new file
+// that replaces the old one.
+void write_ahead_log::truncate(uint64_t upto)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (syncing)
+    synced.wait(lock);
+  next_sequence = std::max(next_sequence, upto + 1);
+  if (upto < first_sequence)
+    return;
+
+  std::string data, kept;
+  read_file(fd, data);
+  scan_records(data, HEADER_BYTES, [&](uint64_t seq, const char *p, size_t n) {
+      if (seq > upto)
+	kept.append(p - RECORD_HEADER_BYTES, RECORD_HEADER_BYTES + n);
+    });
+
+  if (kept.empty()) {
+    write_header(upto + 1);
+    fdatasync(fd);
+    int r = ftruncate(fd, HEADER_BYTES);
+    assert(r == 0);
+    fdatasync(fd);
+  } else {
+    std::string tmp = filename + ".tmp";
+    int tfd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(tfd >= 0);
+    std::swap(fd, tfd);
+    write_header(upto + 1);
+    write_all(fd, kept.data(), kept.length(), HEADER_BYTES);
+    fsync(fd);
+    int r = rename(tmp.c_str(), filename.c_str());
+    assert(r == 0);
+    close(tfd);
+    size_t slash = filename.rfind('/');
+    int dirfd = open(slash == std::string::npos ? "." : filename.substr(0, slash + 1).c_str(),
+		     O_RDONLY | O_DIRECTORY);
+    if (dirfd >= 0) {
+      fsync(dirfd);
+      close(dirfd);
+    }
+  }
+  first_sequence = upto + 1;
+  file_bytes = HEADER_BYTES + kept.length();
+  synced_sequence = next_sequence - 1;
+  unsynced_bytes = 0;
+}
@@ -0,0 +1,104 @@
+// An append-only write-ahead log of opaque records.
+//
+// Every record gets the next sequence number, and is appended to the
+// file with a write() of its own, so it survives the process as soon
+// as append() returns.  When it survives the machine depends on the
+// durability mode, the same ones a backing_store has:
+//
+//   SYNC_EACH_WRITE: append() returns once the record is synced.
+//                    Appenders on other threads that wait at the same
+//                    time share one sync, whoever gets there first
+//                    syncs for all of them.  A caller that appends
+//                    under a lock of its own can wait for the sync
+//                    with wait_durable() after dropping it, so
+//                    appends behind that lock share syncs too.
+//   GROUP_COMMIT:    one sync covers every record in a byte or time
+//                    window.
+//   NO_SYNC:         only sync() makes records durable.
+//
+// The file is a header with the first sequence number the log may
+// hold, followed by records:
+//
+//   length       4 bytes, of the payload
+//   checksum     4 bytes, CRC-32 of the sequence number and payload
+//   sequence     8 bytes
+//   payload
+//
+// A torn or corrupt record ends the log: opening it drops that record
+// and anything after it.  truncate() drops the records a checkpoint
+// made unnecessary.
+
+#ifndef WAL_HPP
+#define WAL_HPP
+
+#include <cstdint>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "backing_store.hpp"
+
+class write_ahead_log {
+public:
+  write_ahead_log(std::string filename, store_open_mode mode = CREATE_STORE);
+  ~write_ahead_log(void);
+
+  void set_durability(durability_mode mode,
+		      uint64_t window_bytes = 1024 * 1024,
+		      uint64_t window_usecs = 10000);
+
+  // Returns the record's sequence number.  Safe to call from several
+  // threads at once.  With wait false it returns before the durability
+  // mode's sync, which is then up to wait_durable().
+  uint64_t append(const std::string &record, bool wait = true);
+
+  // What append() waits for: record seq is as durable as the mode
+  // makes it when this returns.
+  void wait_durable(uint64_t seq);
+
+  // Every record appended so far is on stable storage when this
+  // returns.
+  void sync(void);
+
+  // Calls apply for every record after sequence number after, oldest
+  // first.
+  void replay(uint64_t after, std::function<void(uint64_t, const std::string &)> apply);
+
+  // Drops the records up to and including upto.  Records appended
+  // from now on are numbered after upto.
+  void truncate(uint64_t upto);
+
+  uint64_t last_sequence(void) const { return next_sequence - 1; }
+  uint64_t bytes(void) const { return file_bytes; }
+  uint64_t syncs(void) const { return sync_count; }
+
+private:
+  static const size_t HEADER_BYTES = 16;
+  static const size_t RECORD_HEADER_BYTES = 16;
+
+  void write_header(uint64_t first);
+  // Syncs at least up to sequence number seq, called with lock held.
+  void sync_to(uint64_t seq, std::unique_lock<std::mutex> &lock);
+  // Syncs up to seq if the durability mode calls for it now.
+  void make_durable(uint64_t seq, std::unique_lock<std::mutex> &lock);
+
+  std::string	filename;
+  int		fd;
+  uint64_t	first_sequence;
+  uint64_t	next_sequence;
+  uint64_t	file_bytes;
+
+  durability_mode durability;
+  uint64_t	window_bytes;
+  uint64_t	window_usecs;
+  uint64_t	unsynced_bytes;
+  uint64_t	unsynced_since;
+
+  std::mutex	mutex;
+  std::condition_variable synced;
+  bool		syncing;
+  uint64_t	synced_sequence;
+  uint64_t	sync_count;
+};
+
+#endif // WAL_HPP
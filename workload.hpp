@@ -0,0 +1,222 @@
+// YCSB-style workloads: a stream of operations on records, with the
+// operation mixes of the YCSB core workloads A-F and their key
+// distributions.
+//
+//   UNIFORM_KEYS:    every record is as likely.
+//   ZIPFIAN_KEYS:    a few records take most of the requests (theta
+//                    0.99, as in YCSB).  The popular ones are spread
+//                    over the key space by hashing.
+//   LATEST_KEYS:     zipfian over the records from the newest back.
+//   SEQUENTIAL_KEYS: the records in order, over and over.
+//
+// Record r has key record_key(r): a hash of r, so that inserts land
+// all over the tree, or r itself when the mix asks for ordered keys.
+// A generator is deterministic: the same mix, record count and seed
+// give the same operations on any machine.
+
+#ifndef WORKLOAD_HPP
+#define WORKLOAD_HPP
+
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
+typedef enum {
+  UNIFORM_KEYS,
+  ZIPFIAN_KEYS,
+  LATEST_KEYS,
+  SEQUENTIAL_KEYS
+} key_distribution;
+
+typedef enum {
+  READ_OP,
+  UPDATE_OP,
+  INSERT_OP,
+  SCAN_OP,
+  READ_MODIFY_WRITE_OP
+} workload_opcode;
+
+struct workload_op {
+  workload_opcode opcode;
+  uint64_t key;
+  // The number of records a SCAN_OP reads.
+  uint64_t scan_length;
+};
+
+// The operation proportions add up to 1.
+struct workload_mix {
+  double read;
+  double update;
+  double insert;
+  double scan;
+  double read_modify_write;
+  key_distribution distribution;
+  uint64_t max_scan_length;
+  bool ordered_keys;
+};
+
+// The YCSB core workloads, 'A' to 'F':
+//   A  50% reads, 50% updates, zipfian
+//   B  95% reads, 5% updates, zipfian
+//   C  reads only, zipfian
+//   D  95% reads, 5% inserts, latest
+//   E  95% scans of up to 100 records, 5% inserts, zipfian
+//   F  50% reads, 50% read-modify-writes, zipfian
+// Returns false for any other name.
+inline bool ycsb_workload(char name, workload_mix &mix)
+{
+  workload_mix m = { 0, 0, 0, 0, 0, ZIPFIAN_KEYS, 100, false };
+  switch (name) {
+  case 'A': m.read = 0.5; m.update = 0.5; break;
+  case 'B': m.read = 0.95; m.update = 0.05; break;
+  case 'C': m.read = 1; break;
+  case 'D': m.read = 0.95; m.insert = 0.05; m.distribution = LATEST_KEYS; break;
+  case 'E': m.scan = 0.95; m.insert = 0.05; break;
+  case 'F': m.read = 0.5; m.read_modify_write = 0.5; break;
+  default: return false;
+  }
+  mix = m;
+  return true;
+}
+
+// 64-bit FNV-1a over the bytes of r.
+inline uint64_t fnv_hash64(uint64_t r)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < 8; i++) {
+    h ^= r & 0xff;
+    h *= 0x100000001b3ULL;
+    r >>= 8;
+  }
+  return h;
+}
+
+// xorshift64*, the same numbers everywhere.
+class workload_random {
+public:
+  workload_random(uint64_t seed) : state(seed ? seed : 0x9e3779b97f4a7c15ULL) {}
+
+  uint64_t next(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+  // In [0, 1).
+  double uniform(void) { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+  // In [0, n).
+  uint64_t below(uint64_t n) { return next() % n; }
+
+private:
+  uint64_t state;
+};
+
+// Gray et al., "Quickly generating billion-record synthetic
+// databases": ranks in [0, n), rank 0 the most popular.  n may grow,
+// zeta(n) is extended for the new items only.
+class zipfian_generator {
+public:
+  zipfian_generator(uint64_t n, double theta = 0.99) :
+    theta(theta),
+    items(0),
+    zetan(0)
+  {
+    zeta2 = 1 + std::pow(0.5, theta);
+    alpha = 1 / (1 - theta);
+    grow(n);
+  }
+
+  void grow(uint64_t n) {
+    for (; items < n; items++)
+      zetan += 1 / std::pow((double)(items + 1), theta);
+    eta = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetan);
+  }
+
+  uint64_t next(workload_random &random) {
+    double u = random.uniform();
+    double uz = u * zetan;
+    if (uz < 1)
+      return 0;
+    if (uz < zeta2)
+      return 1;
+    uint64_t rank = items * std::pow(eta * u - eta + 1, alpha);
+    return rank < items ? rank : items - 1;
+  }
+
+private:
+  double theta;
+  uint64_t items;
+  double zetan;
+  double zeta2;
+  double alpha;
+  double eta;
+};
+
+class workload_generator {
+public:
+  // Records [0, record_count) are the loaded ones, inserts add more.
+  workload_generator(const workload_mix &mix, uint64_t record_count, uint64_t seed) :
+    mix(mix),
+    record_count(record_count),
+    random(seed),
+    zipfian(record_count),
+    sequence(0)
+  {
+    assert(record_count > 0);
+  }
+
+  uint64_t record_key(uint64_t record) const {
+    return mix.ordered_keys ? record : fnv_hash64(record);
+  }
+
+  uint64_t records(void) const { return record_count; }
+
+  workload_op next(void) {
+    workload_op op;
+    op.scan_length = 0;
+    double p = random.uniform();
+    if ((p -= mix.insert) < 0) {
+      op.opcode = INSERT_OP;
+      op.key = record_key(record_count++);
+      zipfian.grow(record_count);
+      return op;
+    }
+    if ((p -= mix.update) < 0)
+      op.opcode = UPDATE_OP;
+    else if ((p -= mix.scan) < 0) {
+      op.opcode = SCAN_OP;
+      op.scan_length = 1 + random.below(mix.max_scan_length);
+    } else if ((p -= mix.read_modify_write) < 0)
+      op.opcode = READ_MODIFY_WRITE_OP;
+    else
+      op.opcode = READ_OP;
+    op.key = record_key(choose_record());
+    return op;
+  }
+
+private:
+  uint64_t choose_record(void) {
+    switch (mix.distribution) {
+    case UNIFORM_KEYS:
+      return random.below(record_count);
+    case ZIPFIAN_KEYS:
+      // Scattered, or the popular records would all be the oldest.
+      return fnv_hash64(zipfian.next(random)) % record_count;
+    case LATEST_KEYS:
+      return record_count - 1 - zipfian.next(random);
+    case SEQUENTIAL_KEYS:
+    default:
+      return sequence++ % record_count;
+    }
+  }
+
+  workload_mix mix;
+  uint64_t record_count;
+  workload_random random;
+  zipfian_generator zipfian;
+  uint64_t sequence;
+};
+
+#endif // WORKLOAD_HPP